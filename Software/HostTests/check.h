@@ -0,0 +1,24 @@
+#ifndef HOSTTESTS_CHECK_H_
+#define HOSTTESTS_CHECK_H_
+
+// Minimal assertion helpers shared by the host tests. A failed CHECK is
+// reported and counted, the test goes on. Tests return CHECK_RESULT() from
+// main so the exit code is 0 only if every check passed.
+
+#include <stdio.h>
+
+static int check_failures;
+
+#define CHECK(cond, ...) do { \
+	if (!(cond)) { \
+		check_failures++; \
+		printf("%s:%d: check failed: %s: ", __FILE__, __LINE__, #cond); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+	} \
+} while (0)
+
+#define CHECK_RESULT() (printf("%s: %s\n", __FILE__, \
+		check_failures ? "FAILED" : "passed"), check_failures ? 1 : 0)
+
+#endif
@@ -0,0 +1,312 @@
+// Reference for the display driver tests: the drawing functions of
+// Teststand/Drivers/Board/Display/display.c before the streaming bus writes,
+// unchanged apart from the namespace. Every pixel is a separate data write
+// with its own CS pulse. They drive the same GPIO registers as the driver,
+// so ssd1289_model.hpp counts their bus traffic as well. setData uses the
+// bit reversal of the driver, the inline assembly only builds for the M3.
+
+#pragma once
+
+namespace Baseline {
+
+color_t foreground;
+color_t background;
+font_t font;
+
+struct activeArea_t {
+	uint16_t minX;
+	uint16_t maxX;
+	uint16_t minY;
+	uint16_t maxY;
+};
+
+static activeArea_t active;
+
+inline void setData(uint16_t data) {
+	// rev and rbit on the target, same wiring as the driver
+	GPIOD->ODR = busValue(data);
+}
+
+inline void selectRegister(uint8_t reg) {
+	RS_LOW();
+	setData(reg);
+	CS_LOW();
+	WR_LOW();
+	asm volatile("nop");
+	asm volatile("nop");
+	asm volatile("nop");
+	asm volatile("nop");
+	asm volatile("nop");
+	WR_HIGH();
+	CS_HIGH();
+}
+
+inline void writeData(uint16_t data) {
+	RS_HIGH();
+	setData(data);
+	CS_LOW();
+	WR_LOW();
+	asm volatile("nop");
+	asm volatile("nop");
+	asm volatile("nop");
+	asm volatile("nop");
+	asm volatile("nop");
+	WR_HIGH();
+	CS_HIGH();
+}
+
+void writeRegister(uint8_t reg, uint16_t data) {
+	selectRegister(reg);
+	writeData(data);
+}
+
+inline void setYStartStop(uint16_t start, uint16_t stop) {
+	writeRegister(0x44, (stop << 8) + start);
+}
+
+inline void setXStart(uint16_t start) {
+	writeRegister(0x45, start);
+}
+
+inline void setXStop(uint16_t stop) {
+	writeRegister(0x46, stop);
+}
+
+void setXY(uint16_t x0, uint16_t y0, uint16_t x1, uint16_t y1) {
+	/* convert to landscape mode */
+	y0 = DISPLAY_HEIGHT - y0 - 1;
+	y1 = DISPLAY_HEIGHT - y1 - 1;
+	/* set start and stop values */
+	setYStartStop(y1, y0);
+	setXStart(x0);
+	setXStop(x1);
+	/* start in top left corner */
+	writeRegister(0x4e, y0);
+	writeRegister(0x4f, x0);
+	selectRegister(0x22);
+}
+
+void display_SetFont(font_t f) {
+	font = f;
+}
+
+void display_SetForeground(color_t c) {
+	foreground = c;
+}
+
+void display_SetBackground(color_t c) {
+	background = c;
+}
+
+void display_Clear() {
+	setXY(0, 0, DISPLAY_WIDTH - 1, DISPLAY_HEIGHT - 1);
+	uint32_t i = DISPLAY_WIDTH * DISPLAY_HEIGHT;
+	for (; i > 0; i--) {
+		writeData(background);
+	}
+}
+
+void display_Pixel(int16_t x, int16_t y, uint16_t color) {
+	if (x >= active.minX && x <= active.maxX && y >= active.minY
+			&& y <= active.maxY) {
+		setXY(x, y, x, y);
+		writeData(color);
+	}
+}
+
+void display_HorizontalLine(int16_t x, int16_t y, uint16_t length) {
+	if (y >= active.minY && y <= active.maxY && x <= active.maxX && x + length > active.minX) {
+		if (x < active.minX) {
+			length -= active.minX - x;
+			x = active.minX;
+		}
+		if (x + length - 1 > active.maxX) {
+			length = active.maxX - x + 1;
+		}
+		setXY(x, y, x + length - 1, y);
+		for (; length > 0; length--) {
+			writeData(foreground);
+		}
+	}
+}
+
+void display_VerticalLine(int16_t x, int16_t y, uint16_t length) {
+	if (x >= active.minX && x <= active.maxX && y <= active.maxY && y + length > active.minY) {
+		if (y < active.minY) {
+			length -= active.minY - y;
+			y = active.minY;
+		}
+		if (y + length - 1 > active.maxY) {
+			length = active.maxY - y + 1;
+		}
+		setXY(x, y, x, y + length - 1);
+		for (; length > 0; length--) {
+			writeData(foreground);
+		}
+	}
+}
+
+void display_Line(int16_t x0, int16_t y0, int16_t x1, int16_t y1) {
+	uint16_t dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+	uint16_t dy = abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+	int16_t err = (dx > dy ? dx : -dy) / 2, e2;
+
+	for (;;) {
+		display_Pixel(x0, y0, foreground);
+		if (x0 == x1 && y0 == y1)
+			break;
+		e2 = err;
+		if (e2 > -dx) {
+			err -= dy;
+			x0 += sx;
+		}
+		if (e2 < dy) {
+			err += dx;
+			y0 += sy;
+		}
+	}
+}
+
+void display_Rectangle(int16_t x0, int16_t y0, int16_t x1, int16_t y1) {
+	display_VerticalLine(x0, y0, y1 - y0);
+	display_VerticalLine(x1, y0 + 1, y1 - y0);
+	display_HorizontalLine(x0 + 1, y0, x1 - x0);
+	display_HorizontalLine(x0, y1, x1 - x0);
+}
+
+void display_RectangleFull(int16_t x0, int16_t y0, int16_t x1, int16_t y1){
+	if(x0 > active.maxX || y0 > active.maxY || x1 < active.minX || y1 < active.minY) {
+		/* completely out of active area, skip */
+		return;
+	}
+	if (x0 < active.minX) {
+		x0 = active.minX;
+	}
+	if (x1 > active.maxX) {
+		x1 = active.maxX;
+	}
+	if (y0 < active.minY) {
+		y0 = active.minY;
+	}
+	if (y1 > active.maxY) {
+		y1 = active.maxY;
+	}
+	setXY(x0, y0, x1, y1);
+	uint32_t i = (x1 - x0 + 1) * (y1 - y0 + 1);
+	for (; i > 0; i--) {
+		writeData(foreground);
+	}
+}
+
+void display_Circle(int16_t x0, int16_t y0, uint16_t radius)
+{
+    int x = radius;
+    int y = 0;
+    int err = 0;
+
+    while (x >= y)
+    {
+    	display_Pixel(x0 + x, y0 + y, foreground);
+    	display_Pixel(x0 + y, y0 + x, foreground);
+    	display_Pixel(x0 - y, y0 + x, foreground);
+    	display_Pixel(x0 - x, y0 + y, foreground);
+    	display_Pixel(x0 - x, y0 - y, foreground);
+    	display_Pixel(x0 - y, y0 - x, foreground);
+    	display_Pixel(x0 + y, y0 - x, foreground);
+    	display_Pixel(x0 + x, y0 - y, foreground);
+
+        y += 1;
+        if (err <= 0)
+        {
+            err += 2*y + 1;
+        } else {
+            x -= 1;
+            err += 2 * (y - x) + 1;
+        }
+    }
+}
+
+void display_CircleFull(int16_t x0, int16_t y0, uint16_t radius) {
+	for (int y = -radius; y <= radius; y++)
+		for (int x = -radius; x <= radius; x++)
+			if (x * x + y * y <= radius * radius)
+				display_Pixel(x0 + x, y0 + y, foreground);
+}
+
+void display_Char(int16_t x, int16_t y, uint8_t c) {
+	if(x > active.maxX || y > active.maxY || x + font.width < active.minX || y + font.height < active.minY) {
+		/* Character completely out of active area, skip */
+		return;
+	}
+	uint16_t skipLeft = 0, skipRight = 0, skipTop = 0, skipBottom = 0;
+	if (x < active.minX)
+		skipLeft = active.minX - x;
+	if (y < active.minY)
+		skipTop = active.minY - y;
+	if (x + font.width > active.maxX + 1)
+		skipRight = x + font.width - active.maxX - 1;
+	if (y + font.height > active.maxY + 1)
+		skipBottom = y + font.height - active.maxY - 1;
+
+	setXY(x + skipLeft, y + skipTop, x + font.width - 1 - skipRight, y + font.height - 1 - skipBottom);
+	/* number of bytes in font per row */
+	uint8_t yInc = (font.width - 1) / 8 + 1;
+	const uint8_t *charIndex = font.data + c * yInc * font.height;
+	uint8_t i, j;
+	uint8_t startMask = 0x80 >> (yInc * 8 - font.width);
+	for (i = skipTop; i < font.height - skipBottom; i++) {
+		uint8_t offset = (i + 1) * yInc - 1;
+		uint8_t bitMask = startMask;
+		for (j = 0; j < font.width - skipRight; j++) {
+			if (j >= skipLeft) {
+				uint16_t color;
+				if (charIndex[offset] & bitMask) {
+					color = foreground;
+				} else {
+					color = background;
+				}
+				writeData(color);
+			}
+			bitMask >>= 1;
+			if (!bitMask) {
+				bitMask = 0x80;
+				offset--;
+			}
+		}
+	}
+}
+
+void display_String(int16_t x, int16_t y, const char *s) {
+	while (*s) {
+		display_Char(x, y, *s++);
+		x += font.width;
+		if (x > active.maxX)
+			break;
+	}
+}
+
+void display_Image(int16_t x, int16_t y, const Image_t *im) {
+	setXY(x, y, x + im->width - 1, y + im->height - 1);
+	uint32_t i = im->width * im->height;
+	const uint16_t *ptr = im->data;
+	for (; i > 0; i--) {
+		writeData(*ptr++);
+	}
+}
+
+void display_SetActiveArea(uint16_t minx, uint16_t maxx, uint16_t miny,
+		uint16_t maxy) {
+	active.minX = minx;
+	active.maxX = maxx;
+	active.minY = miny;
+	active.maxY = maxy;
+}
+
+void display_SetDefaultArea() {
+	active.minX = 0;
+	active.maxX = DISPLAY_WIDTH - 1;
+	active.minY = 0;
+	active.maxY = DISPLAY_HEIGHT - 1;
+}
+
+}
@@ -0,0 +1,456 @@
+// Host test and bus benchmark of the display driver
+// (Teststand/Drivers/Board/Display/display.c). The driver is compiled for the
+// host against the GPIO stub, its bus traffic goes through the SSD1289 model
+// (ssd1289_model.hpp). Every primitive is drawn by the driver and by the
+// reference in display_baseline.hpp; the GRAM contents have to be equal and
+// the bus counters of both are printed. Transparent text, which the
+// reference does not have, is checked against the foreground pixels of its
+// opaque text. The modeled time and the characters per second are estimates
+// of the model at 72MHz, not hardware measurements.
+//
+// Build: g++ -std=c++11 -Wall -O2 -Istubs -I../Teststand/Drivers/Board/Display -o display_test display_test.cpp
+// Usage: display_test   (exit code 0 if all checks passed)
+
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+#include "check.h"
+#include "ssd1289_model.hpp"
+// compiled into this file to reach the static bus functions
+#include "../Teststand/Drivers/Board/Display/display.c"
+#include "../Teststand/Drivers/Board/Display/font.c"
+#include "display_baseline.hpp"
+
+using SSD1289::gram;
+using Drawing = std::function<void()>;
+
+static constexpr uint16_t Untouched = 0x1234;
+
+static uint16_t expected[DISPLAY_HEIGHT][DISPLAY_WIDTH];
+
+static void setColors(color_t fg, color_t bg) {
+	display_SetForeground(fg);
+	display_SetBackground(bg);
+	Baseline::display_SetForeground(fg);
+	Baseline::display_SetBackground(bg);
+}
+
+static void setActiveArea(uint16_t minx, uint16_t maxx, uint16_t miny,
+		uint16_t maxy) {
+	display_SetActiveArea(minx, maxx, miny, maxy);
+	Baseline::display_SetActiveArea(minx, maxx, miny, maxy);
+}
+
+static void setDefaultArea() {
+	display_SetDefaultArea();
+	Baseline::display_SetDefaultArea();
+}
+
+// Draws with the reference and the driver, returns the number of differing
+// pixels. The bus traffic of both is added to the counters
+static uint32_t compare(const Drawing &before, const Drawing &after,
+		SSD1289::Counters &countBefore, SSD1289::Counters &countAfter) {
+	SSD1289::Reset(Untouched);
+	before();
+	memcpy(expected, gram, sizeof(gram));
+	countBefore += SSD1289::count;
+
+	SSD1289::Reset(Untouched);
+	after();
+	countAfter += SSD1289::count;
+
+	uint32_t mismatches = 0;
+	for (uint16_t y = 0; y < DISPLAY_HEIGHT; y++) {
+		for (uint16_t x = 0; x < DISPLAY_WIDTH; x++) {
+			if (gram[y][x] != expected[y][x]) {
+				mismatches++;
+			}
+		}
+	}
+	return mismatches;
+}
+
+static void printCounters(const char *name, const SSD1289::Counters &c) {
+	printf("  %-8s %10llu stores %10llu strobes %9llu reg writes %8llu windows"
+			" %8.2fms\n", name, (unsigned long long) c.stores,
+			(unsigned long long) c.strobes,
+			(unsigned long long) c.registerWrites,
+			(unsigned long long) c.windows, SSD1289::Milliseconds(c.cycles));
+}
+
+static void report(const char *what, uint32_t mismatches,
+		const SSD1289::Counters &before, const SSD1289::Counters &after,
+		uint32_t calls = 0) {
+	printf("%s: %lu mismatching pixels\n", what, (unsigned long) mismatches);
+	printCounters("before", before);
+	printCounters("after", after);
+	if (calls) {
+		printf("  per call: %.1f -> %.1f windows, %.1f -> %.1f register writes\n",
+				(double) before.windows / calls, (double) after.windows / calls,
+				(double) before.registerWrites / calls,
+				(double) after.registerWrites / calls);
+	}
+	CHECK(mismatches == 0, "%s: %lu pixels differ from the reference", what,
+			(unsigned long) mismatches);
+	CHECK(!before.outside && !after.outside, "%s: GRAM writes outside", what);
+}
+
+// Random clipping rectangle for every fourth call
+static void randomArea(int i) {
+	if (i % 4 == 0) {
+		setActiveArea(rand() % 100, 150 + rand() % 170, rand() % 80,
+				120 + rand() % 120);
+	} else {
+		setDefaultArea();
+	}
+}
+
+static void testClear() {
+	SSD1289::Counters before = { }, after = { };
+	setColors(COLOR_BLACK, COLOR_ORANGE);
+	uint32_t mismatches = compare([] {
+		Baseline::display_Clear();
+	}, [] {
+		display_Clear();
+	}, before, after);
+	report("clear", mismatches, before, after);
+	CHECK(after.pixels == DISPLAY_WIDTH * DISPLAY_HEIGHT, "%llu pixels",
+			(unsigned long long) after.pixels);
+	for (uint16_t y = 0; y < DISPLAY_HEIGHT; y++) {
+		for (uint16_t x = 0; x < DISPLAY_WIDTH; x++) {
+			if (gram[y][x] != COLOR_ORANGE) {
+				CHECK(false, "pixel %d,%d not cleared", x, y);
+				return;
+			}
+		}
+	}
+	printf("  full-screen clear: %.1fx faster\n",
+			(double) before.cycles / after.cycles);
+}
+
+static void testRectangles() {
+	SSD1289::Counters before = { }, after = { };
+	uint32_t mismatches = 0;
+	srand(1);
+	for (int i = 0; i < 2000; i++) {
+		setColors(rand() & 0xFFFF, rand() & 0xFFFF);
+		randomArea(i);
+		int16_t x0 = rand() % 400 - 40, y0 = rand() % 300 - 30;
+		int16_t x1 = x0 + rand() % 120, y1 = y0 + rand() % 100;
+		mismatches += compare([=] {
+			Baseline::display_RectangleFull(x0, y0, x1, y1);
+		}, [=] {
+			display_RectangleFull(x0, y0, x1, y1);
+		}, before, after);
+	}
+	setDefaultArea();
+	report("filled rectangles", mismatches, before, after);
+}
+
+static void testImages() {
+	SSD1289::Counters before = { }, after = { };
+	uint32_t mismatches = 0;
+	srand(2);
+	for (int i = 0; i < 200; i++) {
+		Image_t im;
+		im.width = 1 + rand() % 80;
+		im.height = 1 + rand() % 60;
+		std::vector<uint16_t> pixels(im.width * im.height);
+		for (auto &p : pixels) {
+			p = rand();
+		}
+		im.data = pixels.data();
+		int16_t x = rand() % (DISPLAY_WIDTH - im.width + 1);
+		int16_t y = rand() % (DISPLAY_HEIGHT - im.height + 1);
+		mismatches += compare([&] {
+			Baseline::display_Image(x, y, &im);
+		}, [&] {
+			display_Image(x, y, &im);
+		}, before, after);
+	}
+	report("images", mismatches, before, after);
+}
+
+static void testLines() {
+	SSD1289::Counters before = { }, after = { };
+	uint32_t mismatches = 0;
+	srand(3);
+	// several lines per frame, every one in its own color
+	const int frames = 2000, perFrame = 10;
+	for (int i = 0; i < frames; i++) {
+		randomArea(i);
+		struct {
+			int16_t x0, y0, x1, y1;
+			color_t color;
+		} lines[perFrame];
+		for (auto &l : lines) {
+			l.x0 = rand() % 440 - 60;
+			l.y0 = rand() % 360 - 60;
+			switch (rand() % 8) {
+			case 0:
+				// horizontal
+				l.x1 = rand() % 440 - 60;
+				l.y1 = l.y0;
+				break;
+			case 1:
+				// vertical
+				l.x1 = l.x0;
+				l.y1 = rand() % 360 - 60;
+				break;
+			case 2:
+				// diagonal
+				l.x1 = l.x0 + (rand() % 2 ? 1 : -1) * (rand() % 200);
+				l.y1 = l.y0 + (l.x1 - l.x0) * (rand() % 2 ? 1 : -1);
+				break;
+			case 3:
+				// short
+				l.x1 = l.x0 + rand() % 7 - 3;
+				l.y1 = l.y0 + rand() % 7 - 3;
+				break;
+			default:
+				l.x1 = rand() % 440 - 60;
+				l.y1 = rand() % 360 - 60;
+				break;
+			}
+			l.color = rand();
+		}
+		mismatches += compare([&] {
+			for (auto &l : lines) {
+				Baseline::display_SetForeground(l.color);
+				Baseline::display_Line(l.x0, l.y0, l.x1, l.y1);
+			}
+		}, [&] {
+			for (auto &l : lines) {
+				display_SetForeground(l.color);
+				display_Line(l.x0, l.y0, l.x1, l.y1);
+			}
+		}, before, after);
+	}
+	setDefaultArea();
+	report("lines", mismatches, before, after, frames * perFrame);
+}
+
+static void testRectangleOutlines() {
+	SSD1289::Counters before = { }, after = { };
+	uint32_t mismatches = 0;
+	srand(4);
+	const int calls = 1000;
+	for (int i = 0; i < calls; i++) {
+		setColors(rand(), rand());
+		randomArea(i);
+		int16_t x0 = rand() % 400 - 40, y0 = rand() % 300 - 30;
+		int16_t x1 = x0 + 1 + rand() % 120, y1 = y0 + 1 + rand() % 100;
+		mismatches += compare([=] {
+			Baseline::display_Rectangle(x0, y0, x1, y1);
+		}, [=] {
+			display_Rectangle(x0, y0, x1, y1);
+		}, before, after);
+	}
+	setDefaultArea();
+	report("rectangles", mismatches, before, after, calls);
+}
+
+// Number of windows the driver sets up for a drawing
+static uint64_t windows(const Drawing &draw) {
+	SSD1289::Reset(Untouched);
+	draw();
+	return SSD1289::count.windows;
+}
+
+// One window per run of the major axis
+static void testRunWindows() {
+	setColors(COLOR_BLACK, COLOR_WHITE);
+	CHECK(windows([] {
+		display_Line(10, 20, 300, 20);
+	}) == 1, "horizontal line");
+	CHECK(windows([] {
+		display_Line(10, 200, 10, 20);
+	}) == 1, "vertical line");
+	CHECK(windows([] {
+		display_Line(0, 0, 299, 9);
+	}) == 10, "shallow line");
+	CHECK(windows([] {
+		display_Line(5, 230, 14, 0);
+	}) == 10, "steep line");
+	CHECK(windows([] {
+		display_Line(0, 0, 99, 99);
+	}) == 100, "diagonal line");
+	// one span per row
+	CHECK(windows([] {
+		display_CircleFull(160, 120, 100);
+	}) == 201, "filled circle");
+	// the runs of a circle are shared by the octants, 8 windows per run
+	uint64_t runs = windows([] {
+		display_Circle(160, 120, 100);
+	});
+	CHECK(runs % 8 == 0 && runs < 8 * 100, "circle: %llu windows",
+			(unsigned long long) runs);
+}
+
+// Every radius below 150, centered and around the corners so that the
+// edges and an active area clip the octants
+static void testCircles(bool filled) {
+	SSD1289::Counters before = { }, after = { };
+	uint32_t mismatches = 0;
+	static const int16_t centers[][2] = { { 160, 120 }, { 3, 5 },
+			{ 310, 230 }, { -20, 200 }, { 250, -40 } };
+	uint32_t calls = 0;
+	srand(5);
+	for (uint16_t radius = 0; radius < 150; radius++) {
+		for (auto &c : centers) {
+			setColors(rand(), rand());
+			randomArea(calls);
+			int16_t x = c[0], y = c[1];
+			mismatches += compare([=] {
+				if (filled) {
+					Baseline::display_CircleFull(x, y, radius);
+				} else {
+					Baseline::display_Circle(x, y, radius);
+				}
+			}, [=] {
+				if (filled) {
+					display_CircleFull(x, y, radius);
+				} else {
+					display_Circle(x, y, radius);
+				}
+			}, before, after);
+			calls++;
+		}
+	}
+	setDefaultArea();
+	report(filled ? "filled circles" : "circles", mismatches, before, after,
+			calls);
+}
+
+static const font_t *const fonts[] = { &Font_Small, &Font_Medium, &Font_Big };
+
+static void setFont(const font_t &f) {
+	display_SetFont(f);
+	Baseline::display_SetFont(f);
+}
+
+static std::string randomString() {
+	std::string s(1 + rand() % 40, ' ');
+	for (auto &c : s) {
+		c = 1 + rand() % 255;
+	}
+	return s;
+}
+
+// Random strings and single characters in all fonts, at positions where the
+// screen edges or an active area clip them
+static void testText() {
+	SSD1289::Counters before = { }, after = { };
+	uint32_t mismatches = 0;
+	srand(6);
+	const int calls = 6000;
+	for (int i = 0; i < calls; i++) {
+		setFont(*fonts[i % 3]);
+		setColors(rand(), rand());
+		randomArea(i / 3);
+		std::string s = randomString();
+		int16_t x = rand() % 380 - 40, y = rand() % 280 - 20;
+		if (i % 2) {
+			mismatches += compare([&] {
+				Baseline::display_String(x, y, s.c_str());
+			}, [&] {
+				display_String(x, y, s.c_str());
+			}, before, after);
+		} else {
+			mismatches += compare([&] {
+				Baseline::display_Char(x, y, s[0]);
+			}, [&] {
+				display_Char(x, y, s[0]);
+			}, before, after);
+		}
+	}
+	setDefaultArea();
+	report("text", mismatches, before, after, calls);
+}
+
+// Transparent text has to leave the background pixels of the opaque text
+// untouched
+static void testTransparentText() {
+	SSD1289::Counters before = { }, after = { };
+	uint32_t mismatches = 0;
+	srand(7);
+	const int calls = 3000;
+	display_SetTransparent(1);
+	for (int i = 0; i < calls; i++) {
+		setFont(*fonts[i % 3]);
+		color_t fg = COLOR_RED;
+		setColors(fg, COLOR_BLUE);
+		randomArea(i / 3);
+		std::string s = randomString();
+		int16_t x = rand() % 380 - 40, y = rand() % 280 - 20;
+		mismatches += compare([&] {
+			Baseline::display_String(x, y, s.c_str());
+			for (auto &row : gram) {
+				for (auto &p : row) {
+					if (p != fg) {
+						p = Untouched;
+					}
+				}
+			}
+		}, [&] {
+			display_String(x, y, s.c_str());
+		}, before, after);
+	}
+	display_SetTransparent(0);
+	setDefaultArea();
+	report("transparent text", mismatches, before, after, calls);
+}
+
+// Characters per second of a 20 character string in the bus model
+static void benchmarkText() {
+	static const char text[] = "Loadcell 2: -12.34kN";
+	const uint16_t n = sizeof(text) - 1;
+	static const char *const names[] = { "Font_Small", "Font_Medium",
+			"Font_Big" };
+	setDefaultArea();
+	setColors(COLOR_BLACK, COLOR_WHITE);
+	for (uint8_t f = 0; f < 3; f++) {
+		setFont(*fonts[f]);
+		SSD1289::Reset(Untouched);
+		Baseline::display_String(0, 100, text);
+		SSD1289::Counters before = SSD1289::count;
+		SSD1289::Reset(Untouched);
+		display_String(0, 100, text);
+		SSD1289::Counters after = SSD1289::count;
+		display_SetTransparent(1);
+		SSD1289::Reset(Untouched);
+		display_String(0, 100, text);
+		SSD1289::Counters transparent = SSD1289::count;
+		display_SetTransparent(0);
+		printf("%s, %u characters: %llu -> %llu strobes, %llu -> %llu register"
+				" writes\n", names[f], n, (unsigned long long) before.strobes,
+				(unsigned long long) after.strobes,
+				(unsigned long long) before.registerWrites,
+				(unsigned long long) after.registerWrites);
+		printf("  %.0f -> %.0f chars/s (%.1fx), transparent %.0f chars/s\n",
+				(double) SSD1289::ClockHz * n / before.cycles,
+				(double) SSD1289::ClockHz * n / after.cycles,
+				(double) before.cycles / after.cycles,
+				(double) SSD1289::ClockHz * n / transparent.cycles);
+		CHECK(after.cycles < before.cycles, "%s not faster", names[f]);
+	}
+}
+
+int main() {
+	display_Init();
+	setDefaultArea();
+	testClear();
+	testRectangles();
+	testImages();
+	testLines();
+	testRectangleOutlines();
+	testCircles(false);
+	testCircles(true);
+	testRunWindows();
+	testText();
+	testTransparentText();
+	benchmarkText();
+	return CHECK_RESULT();
+}
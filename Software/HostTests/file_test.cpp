@@ -0,0 +1,392 @@
+// Host test and benchmark of the config parameter lookup in
+// Teststand/Application/file.cpp, on top of an in-memory FatFs. Both lookup
+// paths, the index built by BuildIndex() and the line scan used for files
+// above MaxIndexedSize, have to agree on:
+// - keys match exactly, keys sharing a prefix do not interfere
+// - the first occurrence of a duplicated key counts
+// - keys with the same FNV-1a hash are told apart
+// The binary records of the config snapshot only keep the hash, the writer
+// has to refuse colliding keys instead.
+// The benchmark loads a synthetic config of almost MaxIndexedSize bytes
+// the way Config::Load() does, a few parameters per ReadParameters() call.
+//
+// Build: g++ -std=c++11 -Wall -Wno-format -O2 -Istubs -I../Teststand/Drivers/Board -o file_test file_test.cpp
+// (-Wno-format: int32_t is long on the target, printf formats follow that)
+// Usage: file_test   (exit code 0 if all checks passed)
+
+#include "check.h"
+// compiled into this file to reach the static hash function
+#include "../Teststand/Application/file.cpp"
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+// in-memory card, every byte read is counted
+static std::map<std::string, std::string> disk;
+static uint64_t bytesRead;
+
+uint8_t log_masks[LOG_SOURCES];
+
+void log_write(uint8_t source, uint8_t level, const char *fmt, ...) {
+}
+
+unsigned long getRunTimeCounterValue(void) {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max,
+		UBaseType_t initial) {
+	static UBaseType_t count;
+	count = initial;
+	return &count;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks) {
+	auto count = (UBaseType_t*) sem;
+	if (!*count) {
+		return pdFALSE;
+	}
+	(*count)--;
+	return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) {
+	(*(UBaseType_t*) sem)++;
+	return pdTRUE;
+}
+
+static std::string& data(FIL *fp) {
+	return *(std::string*) fp->obj;
+}
+
+FRESULT f_mount(FATFS *fs, const TCHAR *path, BYTE opt) {
+	return FR_OK;
+}
+
+FRESULT f_open(FIL *fp, const TCHAR *path, BYTE mode) {
+	if (mode & FA_CREATE_ALWAYS) {
+		disk[path].clear();
+	} else if (!disk.count(path)) {
+		return FR_NO_FILE;
+	}
+	fp->obj = &disk[path];
+	fp->fptr = 0;
+	fp->fsize = data(fp).size();
+	return FR_OK;
+}
+
+FRESULT f_close(FIL *fp) {
+	fp->obj = nullptr;
+	return FR_OK;
+}
+
+FRESULT f_read(FIL *fp, void *buff, UINT btr, UINT *br) {
+	UINT n = std::min<UINT>(btr, fp->fsize - fp->fptr);
+	memcpy(buff, &data(fp)[fp->fptr], n);
+	fp->fptr += n;
+	bytesRead += n;
+	*br = n;
+	return FR_OK;
+}
+
+FRESULT f_write(FIL *fp, const void *buff, UINT btw, UINT *bw) {
+	data(fp).replace(fp->fptr, btw, (const char*) buff, btw);
+	fp->fptr += btw;
+	fp->fsize = data(fp).size();
+	*bw = btw;
+	return FR_OK;
+}
+
+FRESULT f_lseek(FIL *fp, DWORD ofs) {
+	fp->fptr = std::min(ofs, fp->fsize);
+	return FR_OK;
+}
+
+FRESULT f_sync(FIL *fp) {
+	return FR_OK;
+}
+
+FRESULT f_unlink(const TCHAR *path) {
+	return disk.erase(path) ? FR_OK : FR_NO_FILE;
+}
+
+int f_puts(const TCHAR *str, FIL *fp) {
+	UINT n;
+	f_write(fp, str, strlen(str), &n);
+	return n;
+}
+
+TCHAR* f_gets(TCHAR *buff, int len, FIL *fp) {
+	int n = 0;
+	while (n < len - 1 && fp->fptr < fp->fsize) {
+		char c = data(fp)[fp->fptr++];
+		bytesRead++;
+		buff[n++] = c;
+		if (c == '\n') {
+			break;
+		}
+	}
+	buff[n] = 0;
+	return n ? buff : nullptr;
+}
+
+enum class Lookup {
+	Index,
+	Scan,
+};
+
+static const char* name(Lookup l) {
+	return l == Lookup::Index ? "index" : "scan";
+}
+
+static File::ParameterResult readParameters(const char *filename, Lookup l,
+		const File::Entry *entries, uint8_t n) {
+	File::Handle f;
+	CHECK(f.Open(filename, FA_READ | FA_OPEN_EXISTING) == FR_OK, "open %s",
+			filename);
+	if (l == Lookup::Index) {
+		CHECK(f.BuildIndex() == FR_OK, "index of %s", filename);
+	}
+	return f.ReadParameters(entries, n);
+}
+
+static void testPrefixKeys() {
+	// same keys in two orders, longer keys before and after shorter ones
+	static const char *configs[] = {
+		"# Loadcell::1::Scale = 99\n"
+		"Loadcell::1::ScaleX = 7\n"
+		"Loadcell::10::Scale=3.25\n"
+		"Loadcell::1::Scale = 0.5\r\n"
+		"Loadcell::1 = 9\n"
+		"Loadcell::1::Name =   left cell\n",
+
+		"Loadcell::1::Name =   left cell\n"
+		"Loadcell::1 = 9\n"
+		"Loadcell::1::Scale = 0.5\r\n"
+		"Loadcell::10::Scale=3.25\n"
+		"Loadcell::1::ScaleX = 7\n"
+		"# Loadcell::1::Scale = 99\n",
+	};
+	for (auto config : configs) {
+		disk["0:/prefix.cfg"] = config;
+		for (auto l : { Lookup::Index, Lookup::Scan }) {
+			float scale = 0, scale10 = 0;
+			int32_t scaleX = 0, cell = 0, missing = 11;
+			char cellName[32] = "";
+			const File::Entry entries[] = {
+				{ "Loadcell::1::Scale", &scale, File::PointerType::FLOAT },
+				{ "Loadcell::1::ScaleX", &scaleX, File::PointerType::INT32 },
+				{ "Loadcell::10::Scale", &scale10, File::PointerType::FLOAT },
+				{ "Loadcell::1", &cell, File::PointerType::INT32 },
+				{ "Loadcell::1::Name", cellName, File::PointerType::STRING },
+				{ "Loadcell::", &missing, File::PointerType::INT32 },
+			};
+			CHECK(readParameters("0:/prefix.cfg", l, entries, 5)
+					== File::ParameterResult::OK, "%s", name(l));
+			CHECK(scale == 0.5f && scaleX == 7 && scale10 == 3.25f && cell == 9,
+					"%s: %f %ld %f %ld", name(l), scale, (long) scaleX, scale10,
+					(long) cell);
+			CHECK(!strcmp(cellName, "left cell"), "%s: name '%s'", name(l),
+					cellName);
+			// a prefix of existing keys is not a key
+			CHECK(readParameters("0:/prefix.cfg", l, entries, 6)
+					== File::ParameterResult::Partial, "%s", name(l));
+			CHECK(missing == 11, "%s: prefix matched", name(l));
+		}
+	}
+}
+
+static void testDuplicateKeys() {
+	disk["0:/dup.cfg"] = "A = 1\nB = 2\nA = 3\nC = 4\n";
+	for (auto l : { Lookup::Index, Lookup::Scan }) {
+		int32_t a = 0, b = 0, c = 0;
+		const File::Entry entries[] = {
+			{ "A", &a, File::PointerType::INT32 },
+			{ "B", &b, File::PointerType::INT32 },
+			{ "C", &c, File::PointerType::INT32 },
+		};
+		CHECK(readParameters("0:/dup.cfg", l, entries, 3)
+				== File::ParameterResult::OK, "%s", name(l));
+		CHECK(a == 1 && b == 2 && c == 4, "%s: %ld %ld %ld", name(l), (long) a,
+				(long) b, (long) c);
+	}
+}
+
+static void testHashCollisions() {
+	// found by brute force, FNV-1a hash 0xa5d14955
+	const char *key1 = "Module::66558";
+	const char *key2 = "Module::190864";
+	CHECK(hashKey(key1) == hashKey(key2), "keys do not collide");
+	static const char *configs[] = {
+		"Module::190864 = 2\nModule::66558 = 1\n",
+		"Module::66558 = 1\nModule::190864 = 2\n",
+	};
+	for (auto config : configs) {
+		disk["0:/hash.cfg"] = config;
+		for (auto l : { Lookup::Index, Lookup::Scan }) {
+			int32_t v1 = 0, v2 = 0;
+			const File::Entry entries[] = {
+				{ key1, &v1, File::PointerType::INT32 },
+				{ key2, &v2, File::PointerType::INT32 },
+			};
+			CHECK(readParameters("0:/hash.cfg", l, entries, 2)
+					== File::ParameterResult::OK, "%s", name(l));
+			CHECK(v1 == 1 && v2 == 2, "%s: %ld %ld", name(l), (long) v1,
+					(long) v2);
+		}
+	}
+	// only one of them present, the other one must not be found by hash
+	disk["0:/hash.cfg"] = "Module::190864 = 2\n";
+	for (auto l : { Lookup::Index, Lookup::Scan }) {
+		int32_t v1 = 11;
+		const File::Entry entry = { key1, &v1, File::PointerType::INT32 };
+		CHECK(readParameters("0:/hash.cfg", l, &entry, 1)
+				== File::ParameterResult::Partial, "%s", name(l));
+		CHECK(v1 == 11, "%s: colliding key matched", name(l));
+	}
+}
+
+static void testSnapshotCollisions() {
+	uint8_t data[64];
+	int32_t v1 = 1, v2 = 2;
+	const File::Entry entries[] = {
+		{ "Module::66558", &v1, File::PointerType::INT32 },
+		{ "Module::190864", &v2, File::PointerType::INT32 },
+	};
+	File::Handle w;
+	w.CreateBuffer(data, sizeof(data));
+	w.WriteParameters(entries, 1);
+	CHECK(!w.BufferCollision() && !w.BufferOverflow(), "single key rejected");
+	// same hash, any type
+	int8_t i8 = 3;
+	const File::Entry other = { "Module::190864", &i8, File::PointerType::INT8 };
+	w.WriteParameters(&other, 1);
+	CHECK(w.BufferCollision(), "colliding key of other type accepted");
+	w.CreateBuffer(data, sizeof(data));
+	w.WriteParameters(entries, 2);
+	CHECK(w.BufferCollision(), "colliding keys accepted");
+	CHECK(w.BufferUsed() == sizeof(Record) + 4, "%u bytes stored",
+			w.BufferUsed());
+	w.CreateBuffer(data, sizeof(data));
+	CHECK(!w.BufferCollision(), "flag not cleared");
+
+	// distinct keys still read back
+	int32_t a = 5, b = 6;
+	const File::Entry distinct[] = {
+		{ "A", &a, File::PointerType::INT32 },
+		{ "B", &b, File::PointerType::INT32 },
+	};
+	w.WriteParameters(distinct, 2);
+	CHECK(!w.BufferCollision(), "distinct keys rejected");
+	a = b = 0;
+	File::Handle r;
+	r.OpenBuffer(data, w.BufferUsed());
+	CHECK(r.ReadParameters(distinct, 2) == File::ParameterResult::OK,
+			"read back");
+	CHECK(a == 5 && b == 6, "%ld %ld", (long) a, (long) b);
+}
+
+// Config with almost MaxIndexedSize bytes, keys in file order
+static std::string syntheticConfig(std::vector<std::string> &keys,
+		uint16_t maxSize) {
+	std::string config = "# synthetic config\n";
+	for (uint16_t i = 0;; i++) {
+		char key[40], line[60];
+		snprintf(key, sizeof(key), "Module%u::Param%u", i / 8, i % 8);
+		snprintf(line, sizeof(line), "%s = %u\n", key, i * 7);
+		if (config.size() + strlen(line) > maxSize) {
+			break;
+		}
+		config += line;
+		keys.push_back(key);
+	}
+	return config;
+}
+
+// Reads all keys a few per call like the config modules, returns the time
+// in us
+static double loadAll(const char *filename, Lookup l,
+		const std::vector<std::string> &keys, std::vector<int32_t> &values) {
+	constexpr uint8_t perCall = 4;
+	auto start = std::chrono::steady_clock::now();
+	File::Handle f;
+	f.Open(filename, FA_READ | FA_OPEN_EXISTING);
+	if (l == Lookup::Index) {
+		f.BuildIndex();
+	}
+	values.assign(keys.size(), -1);
+	for (size_t i = 0; i < keys.size(); i += perCall) {
+		File::Entry entries[perCall];
+		uint8_t n = 0;
+		for (; n < perCall && i + n < keys.size(); n++) {
+			entries[n] = { keys[i + n].c_str(), &values[i + n],
+					File::PointerType::INT32 };
+		}
+		f.ReadParameters(entries, n);
+	}
+	f.Close();
+	auto end = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+static void testLargeConfig() {
+	std::vector<std::string> keys;
+	disk["0:/large.cfg"] = syntheticConfig(keys, File::MaxIndexedSize);
+	printf("synthetic config: %zu bytes, %zu keys\n",
+			disk["0:/large.cfg"].size(), keys.size());
+	for (auto l : { Lookup::Index, Lookup::Scan }) {
+		std::vector<int32_t> values;
+		loadAll("0:/large.cfg", l, keys, values);
+		uint32_t wrong = 0;
+		for (size_t i = 0; i < keys.size(); i++) {
+			if (values[i] != (int32_t) i * 7) {
+				wrong++;
+			}
+		}
+		CHECK(!wrong, "%s: %lu wrong values", name(l), (unsigned long) wrong);
+	}
+
+	// larger files are not indexed, the scan still finds everything
+	std::vector<std::string> bigKeys;
+	disk["0:/big.cfg"] = syntheticConfig(bigKeys, 2 * File::MaxIndexedSize);
+	File::Handle f;
+	f.Open("0:/big.cfg", FA_READ | FA_OPEN_EXISTING);
+	CHECK(f.BuildIndex() == FR_NOT_ENOUGH_CORE, "oversized file indexed");
+	int32_t last = -1;
+	File::Entry entry = { bigKeys.back().c_str(), &last,
+			File::PointerType::INT32 };
+	CHECK(f.ReadParameters(&entry, 1) == File::ParameterResult::OK
+			&& last == (int32_t) (bigKeys.size() - 1) * 7, "last key %ld",
+			(long) last);
+}
+
+static void benchmark() {
+	constexpr uint16_t runs = 50;
+	std::vector<std::string> keys;
+	disk["0:/large.cfg"] = syntheticConfig(keys, File::MaxIndexedSize);
+	for (auto l : { Lookup::Index, Lookup::Scan }) {
+		std::vector<int32_t> values;
+		double us = 0;
+		bytesRead = 0;
+		for (uint16_t i = 0; i < runs; i++) {
+			us += loadAll("0:/large.cfg", l, keys, values);
+		}
+		printf("%s: %.0fus per load on the host, %lu bytes read from the "
+				"card\n", name(l), us / runs,
+				(unsigned long) (bytesRead / runs));
+	}
+}
+
+int main() {
+	File::Init();
+	testPrefixKeys();
+	testDuplicateKeys();
+	testHashCollisions();
+	testSnapshotCollisions();
+	testLargeConfig();
+	benchmark();
+	return CHECK_RESULT();
+}
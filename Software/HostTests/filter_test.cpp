@@ -0,0 +1,284 @@
+// Host test of the fixed point loadcell filters (Teststand/Application/
+// Filter.cpp). Every filter type is fed steps between the extremes of the
+// 24 bit ADC range and a pseudo random signal, the output is compared with a
+// double precision implementation of the same filter:
+// - moving average and median: exact apart from the integer division
+// - CIC: gain R^3 divided out, the first three outputs after priming are
+//   skipped, so the first output already covers full input history
+// - IIR1/IIR2: the reference uses the quantized coefficients, the
+//   coefficients are checked against the design formulas separately. a2 of
+//   the biquad is derived for exactly unity DC gain, with the rounding error
+//   carried over a step settles exactly on the input value
+// The IIR errors come from the rounding of the state and the output, the
+// worst one is printed.
+//
+// Build: g++ -std=c++11 -Wall -O2 -Istubs -I../Teststand/Drivers/Board -o filter_test filter_test.cpp
+// Usage: filter_test   (exit code 0 if all checks passed)
+
+#include "check.h"
+#include "../Teststand/Application/Filter.cpp"
+
+#include <algorithm>
+#include <initializer_list>
+#include <vector>
+
+static constexpr int32_t RawMin = -(1 << 23);
+static constexpr int32_t RawMax = (1 << 23) - 1;
+static const int16_t IIRLengths[] = { Filter::MinIIRLength, 10, 100,
+		Filter::MaxIIRLength };
+
+uint8_t log_masks[LOG_SOURCES];
+
+void log_write(uint8_t source, uint8_t level, const char *fmt, ...) {
+}
+
+// full scale steps in both directions, then a few mid scale ones
+static std::vector<int32_t> steps(uint32_t hold) {
+	std::vector<int32_t> x;
+	for (int32_t level : { RawMin, RawMax, RawMin, 0, RawMax, 12345, -777 }) {
+		x.insert(x.end(), hold, level);
+	}
+	return x;
+}
+
+// uniformly distributed over the whole 24 bit range
+static std::vector<int32_t> noise(uint32_t length) {
+	std::vector<int32_t> x;
+	uint32_t state = 1;
+	for (uint32_t i = 0; i < length; i++) {
+		state = state * 1664525 + 1013904223;
+		x.push_back((int32_t) state >> 8);
+	}
+	return x;
+}
+
+static Filter::Channel setup(Filter::Type type, int16_t length) {
+	Filter::FreeAll();
+	Filter::Channel c;
+	Filter::Settings s = { type, length };
+	CHECK(Filter::Setup(c, s), "type %d, length %d", (int) type, length);
+	return c;
+}
+
+// worst absolute error in LSB, outputs compared with ref(input index)
+template<typename Ref>
+static double compare(Filter::Channel &c, const std::vector<int32_t> &x,
+		Ref ref) {
+	double worst = 0;
+	for (size_t i = 0; i < x.size(); i++) {
+		int32_t v = x[i];
+		double expected;
+		bool out = Filter::Process(c, v);
+		if (ref(i, x[i], &expected) != out) {
+			CHECK(false, "output %s at sample %zu", out ? "unexpected" : "missing",
+					i);
+			return worst;
+		}
+		if (out) {
+			worst = std::max(worst, fabs(v - expected));
+		}
+	}
+	return worst;
+}
+
+static void testMovingAverage() {
+	for (int16_t length : { 1, 2, 7, 64, (int) Filter::MaxMovingAverage }) {
+		for (auto &x : { steps(300), noise(2000) }) {
+			auto c = setup(Filter::Type::MovingAverage, length);
+			// primed with the first input
+			std::vector<double> window(length, x[0]);
+			double worst = compare(c, x, [&](size_t i, int32_t in, double *ref) {
+				window[i % length] = in;
+				double sum = 0;
+				for (double w : window) {
+					sum += w;
+				}
+				*ref = sum / length;
+				return true;
+			});
+			// integer division truncates towards zero
+			CHECK(worst < 1, "length %d: error %.3f", length, worst);
+		}
+		// DC gain
+		auto c = setup(Filter::Type::MovingAverage, length);
+		for (int32_t level : { RawMin, RawMax }) {
+			int32_t v = 0;
+			for (int16_t i = 0; i <= length; i++) {
+				v = level;
+				Filter::Process(c, v);
+			}
+			CHECK(v == level, "length %d: %ld instead of %ld", length, (long) v,
+					(long) level);
+		}
+	}
+}
+
+static void testMedian() {
+	for (int16_t length : { 1, 3, 4, 9, (int) Filter::MaxMedian }) {
+		// even lengths are rounded up
+		int16_t taps = length | 1;
+		for (auto &x : { steps(40), noise(2000) }) {
+			auto c = setup(Filter::Type::Median, length);
+			std::vector<int32_t> window(taps, x[0]);
+			double worst = compare(c, x, [&](size_t i, int32_t in, double *ref) {
+				window[i % taps] = in;
+				auto sorted = window;
+				std::sort(sorted.begin(), sorted.end());
+				*ref = sorted[taps / 2];
+				return true;
+			});
+			CHECK(worst == 0, "length %d: error %.0f", length, worst);
+		}
+		// a single spike never passes
+		auto c = setup(Filter::Type::Median, length);
+		int32_t worst = 0;
+		for (int i = 0; i < 50; i++) {
+			int32_t v = i == 20 ? RawMax : 100;
+			Filter::Process(c, v);
+			worst = std::max(worst, v);
+		}
+		CHECK(length == 1 || worst == 100, "length %d: spike passed", length);
+	}
+}
+
+static void testCIC() {
+	for (int16_t R : { 1, 2, 5, 64, (int) Filter::MaxCICDecimation }) {
+		uint32_t samples = std::max(40 * R, 2000);
+		for (auto &x : { steps(samples / 7 + 1), noise(samples) }) {
+			auto c = setup(Filter::Type::CIC, R);
+			CHECK(c.coeff[0] == (int32_t) R * R * R, "R %d: gain %ld", R,
+					(long) c.coeff[0]);
+			// three moving sums of length R, starting from zero
+			std::vector<double> in[3];
+			for (auto &v : in) {
+				v.assign(R, 0);
+			}
+			double sum[3] = { 0, 0, 0 };
+			double worst = compare(c, x, [&](size_t i, int32_t value,
+					double *ref) {
+				double v = value;
+				for (uint8_t s = 0; s < 3; s++) {
+					sum[s] += v - in[s][i % R];
+					in[s][i % R] = v;
+					v = sum[s];
+				}
+				*ref = v / ((double) R * R * R);
+				// every R-th input, not the first three decimated outputs
+				return (i + 1) % R == 0 && i + 1 > 3 * (size_t) R;
+			});
+			// int64 division truncates towards zero
+			CHECK(worst < 1, "R %d: error %.3f", R, worst);
+		}
+		// DC gain and priming: the first output is the full scale input
+		for (int32_t level : { RawMin, RawMax }) {
+			auto c = setup(Filter::Type::CIC, R);
+			uint32_t inputs = 0;
+			int32_t v;
+			do {
+				v = level;
+				inputs++;
+			} while (!Filter::Process(c, v));
+			CHECK(inputs == 4 * (uint32_t) R && v == level,
+					"R %d: %ld after %lu inputs", R, (long) v,
+					(unsigned long) inputs);
+		}
+	}
+}
+
+static void testIIR1() {
+	for (int16_t length : IIRLengths) {
+		auto c = setup(Filter::Type::IIR1, length);
+		double ideal = 1 - exp(-2 * pi / length);
+		double alpha = (double) c.coeff[0] / (1UL << IIR1CoeffShift);
+		CHECK(fabs(alpha - ideal) < 1e-6, "length %d: alpha %.9f instead of %.9f",
+				length, alpha, ideal);
+		double worst = 0;
+		for (auto &x : { steps(20 * length), noise(5000) }) {
+			c = setup(Filter::Type::IIR1, length);
+			double y = x[0];
+			worst = std::max(worst, compare(c, x, [&](size_t i, int32_t in,
+					double *ref) {
+				y += (in - y) * alpha;
+				*ref = y;
+				return true;
+			}));
+		}
+		printf("IIR1 length %4d: error %.2f LSB\n", length, worst);
+		// output rounding plus a fraction of a state LSB
+		CHECK(worst < 0.6, "length %d: error %.2f", length, worst);
+		// DC gain
+		for (int32_t level : { RawMin, RawMax }) {
+			c = setup(Filter::Type::IIR1, length);
+			int32_t v = -level;
+			Filter::Process(c, v);
+			for (int i = 0; i < 40 * length; i++) {
+				v = level;
+				Filter::Process(c, v);
+			}
+			CHECK(v == level, "length %d: %ld instead of %ld", length, (long) v,
+					(long) level);
+		}
+	}
+}
+
+static void testIIR2() {
+	for (int16_t length = Filter::MinIIRLength; length <= Filter::MaxIIRLength;
+			length++) {
+		auto c = setup(Filter::Type::IIR2, length);
+		// a2 derived from the quantized b0 and a1: the numerator sums up to
+		// exactly 1 + a1 + a2
+		CHECK(4 * (int64_t) c.coeff[0]
+				== (1LL << IIR2CoeffShift) + c.coeff[1] + c.coeff[2],
+				"length %d: DC gain not unity", length);
+		double K = tan(pi / length);
+		double a2 = (1 - sqrt2 * K + K * K) / (1 + sqrt2 * K + K * K);
+		CHECK(fabs(c.coeff[2] - a2 * (1 << IIR2CoeffShift)) <= 3,
+				"length %d: a2 %ld instead of %.1f", length, (long) c.coeff[2],
+				a2 * (1 << IIR2CoeffShift));
+	}
+	for (int16_t length : IIRLengths) {
+		auto c = setup(Filter::Type::IIR2, length);
+		double b0 = (double) c.coeff[0] / (1 << IIR2CoeffShift);
+		double a1 = (double) c.coeff[1] / (1 << IIR2CoeffShift);
+		double a2 = (double) c.coeff[2] / (1 << IIR2CoeffShift);
+		double worst = 0;
+		for (auto &x : { steps(20 * length), noise(5000) }) {
+			c = setup(Filter::Type::IIR2, length);
+			double x1 = x[0], x2 = x[0], y1 = x[0], y2 = x[0];
+			worst = std::max(worst, compare(c, x, [&](size_t i, int32_t in,
+					double *ref) {
+				double y = b0 * (in + 2 * x1 + x2) - a1 * y1 - a2 * y2;
+				x2 = x1;
+				x1 = in;
+				y2 = y1;
+				y1 = y;
+				*ref = y;
+				return true;
+			}));
+		}
+		printf("IIR2 length %4d: error %.2f LSB\n", length, worst);
+		// low cutoff frequencies amplify the rounding noise of the state
+		CHECK(worst < 1.5, "length %d: error %.2f", length, worst);
+		// DC gain
+		for (int32_t level : { RawMin, RawMax }) {
+			c = setup(Filter::Type::IIR2, length);
+			int32_t v = -level;
+			Filter::Process(c, v);
+			for (int i = 0; i < 40 * length; i++) {
+				v = level;
+				Filter::Process(c, v);
+			}
+			CHECK(v == level, "length %d: %ld instead of %ld", length, (long) v,
+					(long) level);
+		}
+	}
+}
+
+int main() {
+	testMovingAverage();
+	testMedian();
+	testCIC();
+	testIIR1();
+	testIIR2();
+	return CHECK_RESULT();
+}
@@ -0,0 +1,140 @@
+// Bit-accuracy test and benchmark of the fixed point loadcell scaling
+// (Teststand/Application/FixedScale.hpp). Every 24 bit raw value is scaled
+// with a set of typical and extreme scales and compared with the exact
+// product, which a double holds without rounding (25 bit value times 24 bit
+// mantissa). Results outside the int32 range are skipped, the firmware does
+// not produce them for sensible calibrations.
+//
+// Build: g++ -std=c++11 -Wall -O2 -o fixedscale_test fixedscale_test.cpp
+// Usage: fixedscale_test   (exit code 0 if all checks passed)
+//
+// The benchmark compares the kernel with the float expression it replaced.
+// The host has an FPU, so it only shows that the kernel is cheap; on the M3
+// the float path costs a soft-float multiply and conversion per sample.
+
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <chrono>
+#include <initializer_list>
+#include "check.h"
+#include "../Teststand/Application/FixedScale.hpp"
+
+static constexpr int32_t RawMin = -(1 << 23);
+static constexpr int32_t RawMax = (1 << 23) - 1;
+
+struct Result {
+	double maxError;	// in LSB of the result
+	uint32_t mismatches;	// results differing from the exact product rounded
+	uint32_t skipped;	// exact result outside the int32 range
+};
+
+static Result checkScale(float scale, int32_t offset) {
+	Result r = { 0, 0, 0 };
+	auto f = FixedScale::FromFloat(scale);
+	for (int32_t raw = RawMin; raw <= RawMax; raw++) {
+		int32_t value = raw - offset;
+		double exact = (double) value * scale;
+		if (exact >= 2147483647.5 || exact < -2147483648.5) {
+			r.skipped++;
+			continue;
+		}
+		int32_t fixed = FixedScale::Apply(value, f.mul, f.shift);
+		double error = std::fabs(fixed - exact);
+		if (error > r.maxError) {
+			r.maxError = error;
+		}
+		// ties are rounded up, like the shift does
+		if (fixed != (int64_t) std::floor(exact + 0.5)) {
+			r.mismatches++;
+		}
+	}
+	return r;
+}
+
+static void testAccuracy() {
+	static const float scales[] = { 1.0f, -1.0f, 0.5f, 0.1f, 1.0f / 3,
+			-0.0123f, 1e-3f, 3.3e-5f, 7.5e-7f, 123.456f, -97.5f, 255.999f,
+			1e6f, 1e-9f,
+			// shift beyond 62, multiplier loses precision
+			1e-12f, -3.7e-15f, 1e-20f, 1e-40f, 0.0f };
+	printf("%14s %8s %10s %10s %8s\n", "scale", "shift", "mul", "max error",
+			"skipped");
+	for (float scale : scales) {
+		auto f = FixedScale::FromFloat(scale);
+		auto r = checkScale(scale, 0);
+		printf("%14g %8d %10ld %10.6f %8lu\n", scale, f.shift, (long) f.mul,
+				r.maxError, (unsigned long) r.skipped);
+		if (f.shift < 62 || scale == 0.0f) {
+			// multiplier holds the float scale exactly: always the exact
+			// product rounded to nearest
+			CHECK(r.mismatches == 0, "scale %g: %lu mismatches", scale,
+					(unsigned long) r.mismatches);
+		}
+		CHECK(r.maxError <= 0.5, "scale %g: error %f LSB", scale, r.maxError);
+	}
+	// the offset is subtracted before scaling, values span 25 bits
+	for (int32_t offset : { RawMax, RawMin, 1234567 }) {
+		for (float scale : { 0.1f, -7.5e-7f, 1.0f }) {
+			auto r = checkScale(scale, offset);
+			CHECK(r.mismatches == 0 && r.maxError <= 0.5,
+					"scale %g, offset %ld: %lu mismatches, error %f", scale,
+					(long) offset, (unsigned long) r.mismatches, r.maxError);
+		}
+	}
+}
+
+static void testSaturation() {
+	// scales from 2^30 on do not fit the multiplier, it saturates
+	auto f = FixedScale::FromFloat(1073741824.0f);
+	CHECK(f.mul == INT32_MAX && f.shift == 0, "mul %ld shift %d", (long) f.mul,
+			f.shift);
+	f = FixedScale::FromFloat(-3e10f);
+	CHECK(f.mul == -INT32_MAX && f.shift == 0, "mul %ld shift %d",
+			(long) f.mul, f.shift);
+	CHECK(FixedScale::Apply(1, f.mul, f.shift) == -INT32_MAX, "saturated");
+	// largest float below 2^30 is still exact
+	f = FixedScale::FromFloat(1073741760.0f);
+	CHECK(f.shift == 0 && FixedScale::Apply(1, f.mul, f.shift) == 1073741760,
+			"mul %ld shift %d", (long) f.mul, f.shift);
+	// far below one LSB of the 24 bit input everything becomes 0
+	f = FixedScale::FromFloat(1e-30f);
+	CHECK(f.mul == 0 && f.shift == 62, "mul %ld shift %d", (long) f.mul,
+			f.shift);
+	CHECK(FixedScale::Apply(RawMax, f.mul, f.shift) == 0, "tiny scale");
+}
+
+static void benchmark() {
+	const float scale = 7.5e-7f;
+	const int32_t offset = 12345;
+	auto f = FixedScale::FromFloat(scale);
+	// volatile factors keep the compiler from folding the loops
+	volatile int32_t mul = f.mul;
+	volatile uint8_t shift = f.shift;
+	volatile float vscale = scale;
+
+	auto start = std::chrono::steady_clock::now();
+	int64_t sumFixed = 0;
+	for (int32_t raw = RawMin; raw <= RawMax; raw++) {
+		sumFixed += FixedScale::Apply(raw - offset, mul, shift);
+	}
+	auto mid = std::chrono::steady_clock::now();
+	int64_t sumFloat = 0;
+	for (int32_t raw = RawMin; raw <= RawMax; raw++) {
+		sumFloat += (int32_t) ((raw - offset) * vscale);
+	}
+	auto end = std::chrono::steady_clock::now();
+
+	const double n = (double) RawMax - RawMin + 1;
+	double fixedNs = std::chrono::duration<double, std::nano>(mid - start).count() / n;
+	double floatNs = std::chrono::duration<double, std::nano>(end - mid).count() / n;
+	printf("host: fixed %.2fns/sample, float %.2fns/sample (sums %lld %lld)\n",
+			fixedNs, floatNs, (long long) sumFixed, (long long) sumFloat);
+}
+
+int main() {
+	testAccuracy();
+	testSaturation();
+	benchmark();
+	return CHECK_RESULT();
+}
@@ -0,0 +1,639 @@
+// Host test of the MAX11254 driver (Teststand/Drivers/Board/MAX11254) against
+// a simulated register file. The fake DMA calls decode every SPI frame like
+// the ADC does, so the test checks the exact bytes on the bus, the register
+// lengths, the register shadow, bus arbitration and the sign extension of
+// the 24 bit conversion results. The asynchronous result read is run
+// through the simulated completion interrupt frame by frame.
+//
+// Build: gcc -std=gnu11 -Wall -O2 -Istubs -I../Teststand/Drivers/Board -o max11254_test max11254_test.c
+// Usage: max11254_test   (exit code 0 if all checks passed)
+
+#include "stm.h"
+#include "check.h"
+// compiled into this file to reach the static register access functions
+#include "../Teststand/Drivers/Board/MAX11254/max11254.c"
+
+#include <stdarg.h>
+
+#define CS_PIN		0x0010U
+#define NUM_REGS	0x14
+#define MAX_FRAMES	64
+
+typedef struct {
+	uint8_t tx[8];
+	uint8_t length;
+} frame_t;
+
+static GPIO_TypeDef csPort, rdybPort;
+static SPI_HandleTypeDef spi;
+static max11254_t adc;
+
+// simulated ADC
+static uint32_t regs[NUM_REGS];
+static const uint8_t regLength[NUM_REGS] = { 3, 1, 1, 1, 1, 2, 3, 3, 1, 1, 3,
+		3, 3, 3, 3, 3, 3, 3, 3, 3 };
+static uint8_t lastCommand;
+static frame_t frames[MAX_FRAMES];
+static uint8_t numFrames;
+
+// simulated SPI/DMA, bus and task notification
+static uint8_t spiPending;
+static uint8_t failStarts;
+static uint8_t failTransfers;
+static uint8_t stall;
+static uint8_t inISR;
+static uint8_t busOwned;
+static uint32_t acquisitions;
+static uint32_t isrReleases;
+static uint32_t aborts;
+static void (*busComplete)(void*);
+static void *busPtr;
+static uint32_t notifyValue;
+static uint8_t notifyPending;
+static uint32_t logErrors;
+
+uint8_t log_masks[LOG_SOURCES];
+
+void log_write(uint8_t source, uint8_t level, const char *fmt, ...) {
+	if (level >= LevelError) {
+		logErrors++;
+	}
+}
+
+void log_flush() {
+}
+
+exti_result_t exti_set_callback(GPIO_TypeDef *gpio, uint16_t pin,
+		exti_type_t type, exti_pull_t pull, exti_callback_t cb, void *ptr) {
+	return EXTI_RES_OK;
+}
+
+void HAL_GPIO_Init(GPIO_TypeDef *gpio, GPIO_InitTypeDef *init) {
+}
+
+void vTaskDelay(TickType_t ticks) {
+}
+
+void spibus_register(spibus_device_t *dev, const char *name, uint16_t prescaler,
+		spibus_priority_t priority) {
+	CHECK(priority == SPIBUS_PRIO_HIGH, "registered with priority %d",
+			priority);
+}
+
+void spibus_set_complete_callback(spibus_device_t *dev, void (*cb)(void*),
+		void *ptr) {
+	busComplete = cb;
+	busPtr = ptr;
+}
+
+uint8_t spibus_acquire(spibus_device_t *dev, uint32_t timeout) {
+	CHECK(!inISR, "bus acquired from ISR");
+	CHECK(!busOwned, "bus acquired twice");
+	busOwned = 1;
+	acquisitions++;
+	return 1;
+}
+
+void spibus_release(spibus_device_t *dev) {
+	CHECK(!inISR, "task release from ISR");
+	CHECK(busOwned, "bus released without owning it");
+	busOwned = 0;
+}
+
+void spibus_release_from_isr(spibus_device_t *dev, BaseType_t *woken) {
+	CHECK(inISR, "ISR release outside of ISR");
+	CHECK(busOwned, "bus released without owning it");
+	busOwned = 0;
+	isrReleases++;
+}
+
+// Decodes one frame the way the ADC does and answers reads from regs
+static HAL_StatusTypeDef startFrame(uint8_t *tx, uint8_t *rx, uint16_t size) {
+	CHECK(busOwned, "transfer without owning the bus");
+	CHECK(!spiPending, "transfer started during another one");
+	CHECK(csPort.BSRR == CS_PIN << 16, "CS not low during transfer");
+	if (failStarts) {
+		failStarts--;
+		return HAL_ERROR;
+	}
+	// like the HAL, a started transfer clears the error
+	spi.ErrorCode = HAL_SPI_ERROR_NONE;
+	if (numFrames < MAX_FRAMES && size <= sizeof(frames[0].tx)) {
+		memcpy(frames[numFrames].tx, tx, size);
+		frames[numFrames].length = size;
+		numFrames++;
+	}
+	uint8_t cmd = tx[0];
+	if ((cmd & 0xC0) == 0xC0) {
+		uint8_t reg = (cmd >> 1) & 0x1F;
+		CHECK(reg < NUM_REGS, "invalid register %d", reg);
+		if (reg >= NUM_REGS) {
+			return HAL_OK;
+		}
+		uint8_t length = regLength[reg];
+		CHECK(size == length + 1, "register %d accessed with %d bytes", reg,
+				size);
+		if (cmd & 0x01) {
+			CHECK(rx != NULL, "register read without receive buffer");
+			if (rx) {
+				rx[0] = 0;
+				for (uint8_t i = 0; i < length && i + 1 < size; i++) {
+					rx[i + 1] = regs[reg] >> (8 * (length - 1 - i));
+				}
+			}
+		} else {
+			uint32_t value = 0;
+			for (uint8_t i = 0; i < length && i + 1 < size; i++) {
+				value = (value << 8) | tx[i + 1];
+			}
+			regs[reg] = value;
+		}
+	} else {
+		CHECK((cmd & 0xC0) == 0x80, "invalid command byte %02x", cmd);
+		CHECK(size == 1, "command with %d bytes", size);
+		lastCommand = cmd;
+	}
+	spiPending = 1;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef *hspi, uint8_t *data,
+		uint16_t size) {
+	return startFrame(data, NULL, size);
+}
+
+HAL_StatusTypeDef HAL_SPI_TransmitReceive_DMA(SPI_HandleTypeDef *hspi,
+		uint8_t *tx, uint8_t *rx, uint16_t size) {
+	return startFrame(tx, rx, size);
+}
+
+HAL_StatusTypeDef HAL_SPI_Abort(SPI_HandleTypeDef *hspi) {
+	spiPending = 0;
+	aborts++;
+	return HAL_OK;
+}
+
+// Runs the completion interrupt of the pending transfer, or the error
+// interrupt if failTransfers is set
+static void completeTransfer() {
+	spiPending = 0;
+	if (failTransfers) {
+		failTransfers--;
+		spi.ErrorCode = HAL_SPI_ERROR_DMA;
+	}
+	inISR = 1;
+	CHECK(busComplete != NULL, "no completion callback");
+	if (busComplete) {
+		busComplete(busPtr);
+	}
+	inISR = 0;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+	return &notifyValue;
+}
+
+BaseType_t xTaskNotifyWait(uint32_t clearOnEntry, uint32_t clearOnExit,
+		uint32_t *value, TickType_t ticks) {
+	notifyValue &= ~clearOnEntry;
+	if (!notifyPending && spiPending && !stall) {
+		completeTransfer();
+	}
+	if (!notifyPending) {
+		return pdFALSE;
+	}
+	*value = notifyValue;
+	notifyValue &= ~clearOnExit;
+	notifyPending = 0;
+	return pdTRUE;
+}
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value,
+		eNotifyAction action) {
+	notifyValue |= value;
+	notifyPending = 1;
+	return pdPASS;
+}
+
+BaseType_t xTaskNotifyFromISR(TaskHandle_t task, uint32_t value,
+		eNotifyAction action, BaseType_t *woken) {
+	CHECK(inISR, "ISR notification outside of ISR");
+	CHECK(task == &notifyValue, "wrong task notified");
+	notifyValue |= value;
+	notifyPending = 1;
+	return pdPASS;
+}
+
+static void resetSimulation() {
+	memset(regs, 0, sizeof(regs));
+	// power-on defaults of the registers touched by max11254_init()
+	regs[MAX11254_REG_CTRL1] = 0x02;
+	regs[MAX11254_REG_CTRL3] = 0x61;
+	numFrames = 0;
+	lastCommand = 0;
+	spiPending = 0;
+	failStarts = 0;
+	failTransfers = 0;
+	spi.ErrorCode = HAL_SPI_ERROR_NONE;
+	stall = 0;
+	busOwned = 0;
+	acquisitions = 0;
+	isrReleases = 0;
+	aborts = 0;
+	notifyValue = 0;
+	notifyPending = 0;
+	logErrors = 0;
+	memset(log_masks, LevelAll, sizeof(log_masks));
+	memset(&adc, 0, sizeof(adc));
+	adc.spi = &spi;
+	adc.CSgpio = &csPort;
+	adc.CSpin = CS_PIN;
+	adc.RDYBgpio = &rdybPort;
+	adc.RDYBpin = 0x0020;
+	csPort.BSRR = CS_PIN;
+}
+
+// Checks all bytes of a frame
+static void checkFrame(uint8_t index, uint8_t length, const uint8_t *bytes) {
+	CHECK(index < numFrames, "frame %d missing", index);
+	if (index >= numFrames) {
+		return;
+	}
+	CHECK(frames[index].length == length, "frame %d: %d bytes instead of %d",
+			index, frames[index].length, length);
+	CHECK(!memcmp(frames[index].tx, bytes, length),
+			"frame %d: %02x %02x %02x %02x", index, frames[index].tx[0],
+			frames[index].tx[1], frames[index].tx[2], frames[index].tx[3]);
+}
+
+// Checks command byte and length of a register read (MOSI is ignored after
+// the command byte)
+static void checkRead(uint8_t index, max11254_reg_t reg) {
+	CHECK(index < numFrames, "frame %d missing", index);
+	if (index >= numFrames) {
+		return;
+	}
+	CHECK(frames[index].tx[0] == (0xC1 | reg << 1),
+			"frame %d: command %02x, expected read of register %d", index,
+			frames[index].tx[0], reg);
+	CHECK(frames[index].length == regLength[reg] + 1,
+			"frame %d: %d bytes", index, frames[index].length);
+}
+
+static void testInit() {
+	resetSimulation();
+	CHECK(max11254_init(&adc) == MAX11254_RES_OK, "init failed");
+	// every register is read once before the first modification
+	checkRead(0, MAX11254_REG_DELAY);
+	checkFrame(1, 3, (const uint8_t[] ) { 0xCA, 0x32, 0x00 });
+	checkRead(2, MAX11254_REG_SEQ);
+	checkFrame(3, 2, (const uint8_t[] ) { 0xD0, 0x02 });
+	checkRead(4, MAX11254_REG_CTRL2);
+	checkFrame(5, 2, (const uint8_t[] ) { 0xC4, 0x0F });
+	checkRead(6, MAX11254_REG_CTRL1);
+	checkFrame(7, 2, (const uint8_t[] ) { 0xC2, 0x12 });
+	// power down command
+	checkFrame(8, 1, (const uint8_t[] ) { 0x90 });
+	// CTRL1 check always reads the ADC
+	checkRead(9, MAX11254_REG_CTRL1);
+	CHECK(numFrames == 10, "%d frames", numFrames);
+	CHECK(adc.transactions == numFrames, "%lu transactions",
+			(unsigned long ) adc.transactions);
+	CHECK(acquisitions == numFrames, "%lu acquisitions",
+			(unsigned long ) acquisitions);
+	CHECK(!busOwned && csPort.BSRR == CS_PIN, "bus or CS left active");
+	CHECK(regs[MAX11254_REG_DELAY] == 0x3200, "DELAY %06lx",
+			(unsigned long ) regs[MAX11254_REG_DELAY]);
+
+	// a broken SPI connection reads CTRL1 as 0
+	resetSimulation();
+	regs[MAX11254_REG_CTRL1] = 0x00;
+	failStarts = 255;
+	CHECK(max11254_init(&adc) == MAX11254_RES_ERROR, "init passed");
+	CHECK(!busOwned && csPort.BSRR == CS_PIN, "bus or CS left active");
+}
+
+static void testShadow() {
+	resetSimulation();
+	max11254_init(&adc);
+	numFrames = 0;
+	// value already in the shadow, no traffic at all
+	max11254_set_PGA(&adc, MAX11254_GAIN128, MAX11254_PGAMODE_LOWNOISE);
+	max11254_enable_MUX_delay(&adc, 1);
+	CHECK(numFrames == 0, "%d frames for unchanged registers", numFrames);
+	// modification from the shadow without a read
+	max11254_set_PGA(&adc, MAX11254_GAIN4, MAX11254_PGAMODE_LOWPOWER);
+	CHECK(numFrames == 1, "%d frames", numFrames);
+	checkFrame(0, 2, (const uint8_t[] ) { 0xC4, 0x1A });
+	// gain 1 bypasses the PGA
+	max11254_set_PGA(&adc, MAX11254_GAIN1, MAX11254_PGAMODE_LOWNOISE);
+	checkFrame(1, 2, (const uint8_t[] ) { 0xC4, 0x00 });
+	// the 16 bit DELAY register is shadowed as well
+	numFrames = 0;
+	max11254_set_GPO_delay(&adc, 100);
+	CHECK(numFrames == 1, "%d frames", numFrames);
+	checkFrame(0, 3, (const uint8_t[] ) { 0xCA, 0x32, 0x05 });
+	// a reset restores the defaults, the shadow must not be trusted anymore
+	max11254_set_pdmode(&adc, MAX11254_PDMODE_RESET);
+	regs[MAX11254_REG_CTRL2] = 0x00;
+	numFrames = 0;
+	max11254_set_PGA(&adc, MAX11254_GAIN1, MAX11254_PGAMODE_LOWNOISE);
+	CHECK(numFrames == 1, "%d frames after reset", numFrames);
+	checkRead(0, MAX11254_REG_CTRL2);
+	// a failed write leaves the shadow alone
+	failStarts = 1;
+	max11254_set_PGA(&adc, MAX11254_GAIN2, MAX11254_PGAMODE_LOWNOISE);
+	numFrames = 0;
+	max11254_set_PGA(&adc, MAX11254_GAIN2, MAX11254_PGAMODE_LOWNOISE);
+	checkFrame(0, 2, (const uint8_t[] ) { 0xC4, 0x09 });
+}
+
+static void testRegisterAccess() {
+	resetSimulation();
+	// all registers with their length, data MSB first
+	for (uint8_t reg = 0; reg < NUM_REGS; reg++) {
+		numFrames = 0;
+		Write(&adc, (max11254_reg_t) reg, 0xA5B6C7);
+		uint8_t expected[4] = { 0xC0 | reg << 1 };
+		uint8_t length = regLength[reg];
+		for (uint8_t i = 0; i < length; i++) {
+			expected[i + 1] = 0xA5B6C7 >> (8 * (length - 1 - i));
+		}
+		checkFrame(0, length + 1, expected);
+		uint32_t mask = (1UL << (8 * length)) - 1;
+		uint32_t read = Read(&adc, (max11254_reg_t) reg);
+		checkRead(1, (max11254_reg_t) reg);
+		CHECK(read == (0xA5B6C7 & mask), "register %d read as %06lx", reg,
+				(unsigned long ) read);
+	}
+	numFrames = 0;
+	max11254_power_down(&adc);
+	checkFrame(0, 1, (const uint8_t[] ) { 0x90 });
+	CHECK(lastCommand == 0x90, "command %02x", lastCommand);
+
+	regs[MAX11254_REG_STAT] = 0x000200;
+	max11254_state_t state = max11254_get_state(&adc);
+	CHECK(state == 0x000200, "STAT %06lx", (unsigned long ) state);
+	CHECK(max11254_out_of_range(state), "out of range not detected");
+	CHECK(!max11254_out_of_range(0x00000C), "out of range without flags");
+	CHECK(max11254_pdmode_from_state(0x000008) == MAX11254_PDMODE_STANDBY,
+			"power down mode");
+}
+
+static void testResults() {
+	static const struct {
+		uint32_t raw;
+		int32_t value;
+	} samples[] = {
+		{ 0x000000, 0 },
+		{ 0x000001, 1 },
+		{ 0x123456, 0x123456 },
+		{ 0x7FFFFF, 8388607 },
+		{ 0x800000, -8388608 },
+		{ 0x800001, -8388607 },
+		{ 0xEDCBAA, -0x123456 },
+		{ 0xFFFFFF, -1 },
+	};
+	const uint8_t n = sizeof(samples) / sizeof(samples[0]);
+	resetSimulation();
+	for (uint8_t s = 0; s < n; s++) {
+		for (uint8_t ch = 0; ch < 6; ch++) {
+			regs[MAX11254_REG_DATA0 + ch] = samples[(s + ch) % n].raw;
+		}
+		int32_t out[6];
+		numFrames = 0;
+		acquisitions = 0;
+		CHECK(max11254_read_results(&adc, 0x3F, out) == MAX11254_RES_OK,
+				"read failed");
+		CHECK(acquisitions == 1, "bus acquired %lu times",
+				(unsigned long ) acquisitions);
+		CHECK(numFrames == 6, "%d frames", numFrames);
+		for (uint8_t ch = 0; ch < 6; ch++) {
+			const uint8_t frame[4] = { 0xC1 | (MAX11254_REG_DATA0 + ch) << 1 };
+			checkFrame(ch, 4, frame);
+			int32_t expected = samples[(s + ch) % n].value;
+			CHECK(out[ch] == expected, "channel %d: %ld instead of %ld", ch,
+					(long ) out[ch], (long ) expected);
+			CHECK(max11254_read_result(&adc, ch) == expected,
+					"single read of channel %d", ch);
+		}
+	}
+
+	// only the selected channels are read and written
+	int32_t out[6] = { 11, 11, 11, 11, 11, 11 };
+	numFrames = 0;
+	regs[MAX11254_REG_DATA2] = 0x800000;
+	regs[MAX11254_REG_DATA5] = 0x7FFFFF;
+	max11254_read_results(&adc, 0x24, out);
+	CHECK(numFrames == 2, "%d frames", numFrames);
+	checkRead(0, MAX11254_REG_DATA2);
+	checkRead(1, MAX11254_REG_DATA5);
+	CHECK(out[0] == 11 && out[1] == 11 && out[3] == 11 && out[4] == 11,
+			"unselected channel written");
+	CHECK(out[2] == -8388608 && out[5] == 8388607, "results %ld %ld",
+			(long ) out[2], (long ) out[5]);
+
+	// nothing selected, no bus traffic
+	numFrames = 0;
+	acquisitions = 0;
+	CHECK(max11254_read_results(&adc, 0, out) == MAX11254_RES_OK, "empty");
+	CHECK(!numFrames && !acquisitions, "bus used without channels");
+
+	// failing second frame: error, bus and CS released, out untouched
+	numFrames = 0;
+	out[2] = 11;
+	failStarts = 0;
+	regs[MAX11254_REG_DATA2] = 0x000005;
+	max11254_read_results(&adc, 0x04, out);
+	CHECK(out[2] == 5, "result %ld", (long ) out[2]);
+	out[2] = 11;
+	failStarts = 1;
+	CHECK(max11254_read_results(&adc, 0x24, out) == MAX11254_RES_ERROR,
+			"failed transfer not reported");
+	CHECK(out[2] == 11, "result written after failed transfer");
+	CHECK(!busOwned && csPort.BSRR == CS_PIN, "bus or CS left active");
+}
+
+static void testTimeout() {
+	resetSimulation();
+	stall = 1;
+	CHECK(Read(&adc, MAX11254_REG_CTRL1) == 0, "read without completion");
+	CHECK(aborts == 1, "transfer not aborted");
+	CHECK(logErrors == 1, "timeout not logged");
+	CHECK(!busOwned && csPort.BSRR == CS_PIN, "bus or CS left active");
+	CHECK(adc.task == NULL, "waiting task not cleared");
+
+	// notification bits of the application survive a transfer
+	resetSimulation();
+	notifyValue = 0x01;
+	notifyPending = 1;
+	regs[MAX11254_REG_CTRL2] = 0x0F;
+	CHECK(Read(&adc, MAX11254_REG_CTRL2) == 0x0F, "read failed");
+	CHECK(notifyValue == 0x01 && notifyPending, "notification value %08lx",
+			(unsigned long ) notifyValue);
+}
+
+static uint32_t asyncCalls;
+static void *asyncArg;
+static max11254_result_t asyncResult;
+
+static void asyncDone(max11254_result_t res, void *ptr) {
+	CHECK(inISR, "callback outside of the completion interrupt");
+	CHECK(!busOwned, "callback before the bus was released");
+	asyncCalls++;
+	asyncArg = ptr;
+	asyncResult = res;
+}
+
+static void testAsyncResults() {
+	resetSimulation();
+	max11254_init(&adc);
+	static const uint32_t raw[6] = { 0x800000, 0x7FFFFF, 0xFFFFFF, 0x000001,
+			0x123456, 0xEDCBAA };
+	static const int32_t expected[6] = { -8388608, 8388607, -1, 1, 0x123456,
+			-0x123456 };
+	for (uint8_t ch = 0; ch < 6; ch++) {
+		regs[MAX11254_REG_DATA0 + ch] = raw[ch];
+	}
+	int32_t out[6] = { 11, 11, 11, 11, 11, 11 };
+	int token;
+	numFrames = 0;
+	acquisitions = 0;
+	asyncCalls = 0;
+	uint32_t transactions = adc.transactions;
+	CHECK(max11254_read_results_async(&adc, 0x3F, out, asyncDone, &token)
+			== MAX11254_RES_OK, "start failed");
+	// only the first frame runs, the task is free again
+	CHECK(numFrames == 1 && spiPending, "%d frames started", numFrames);
+	CHECK(busOwned && acquisitions == 1, "bus not held");
+	// the completion interrupt chains the remaining frames
+	uint8_t interrupts = 0;
+	while (spiPending && interrupts < 10) {
+		CHECK(!asyncCalls, "callback after %d frames", interrupts);
+		CHECK(busOwned, "bus released after %d frames", interrupts);
+		CHECK(out[0] == 11, "result written before the last frame");
+		completeTransfer();
+		interrupts++;
+	}
+	CHECK(interrupts == 6, "%d interrupts", interrupts);
+	CHECK(numFrames == 6, "%d frames", numFrames);
+	for (uint8_t ch = 0; ch < 6; ch++) {
+		const uint8_t frame[4] = { 0xC1 | (MAX11254_REG_DATA0 + ch) << 1 };
+		checkFrame(ch, 4, frame);
+		CHECK(out[ch] == expected[ch], "channel %d: %ld", ch, (long ) out[ch]);
+	}
+	CHECK(asyncCalls == 1 && asyncArg == &token, "%lu callbacks",
+			(unsigned long ) asyncCalls);
+	CHECK(asyncResult == MAX11254_RES_OK, "success reported as error");
+	CHECK(isrReleases == 1 && !busOwned, "bus not released from ISR");
+	CHECK(csPort.BSRR == CS_PIN, "CS left low");
+	CHECK(adc.transactions - transactions == 6, "%lu transactions",
+			(unsigned long ) (adc.transactions - transactions));
+	CHECK(adc.asyncCb == NULL, "async state left active");
+	CHECK(!notifyPending, "task notified by an async transfer");
+
+	// blocking transfers work as before afterwards
+	regs[MAX11254_REG_CTRL2] = 0x0C;
+	CHECK(Read(&adc, MAX11254_REG_CTRL2) == 0x0C, "blocking read failed");
+
+	// a subset of channels
+	asyncCalls = 0;
+	numFrames = 0;
+	out[1] = out[4] = 11;
+	max11254_read_results_async(&adc, 0x12, out, asyncDone, NULL);
+	while (spiPending) {
+		completeTransfer();
+	}
+	CHECK(numFrames == 2 && asyncCalls == 1, "%d frames", numFrames);
+	checkRead(0, MAX11254_REG_DATA1);
+	checkRead(1, MAX11254_REG_DATA4);
+	CHECK(out[1] == 8388607 && out[4] == 0x123456, "results %ld %ld",
+			(long ) out[1], (long ) out[4]);
+
+	// no channels: callback right away, no bus traffic
+	asyncCalls = 0;
+	numFrames = 0;
+	acquisitions = 0;
+	inISR = 1;
+	max11254_read_results_async(&adc, 0, out, asyncDone, NULL);
+	inISR = 0;
+	CHECK(asyncCalls == 1 && !numFrames && !acquisitions, "empty mask");
+}
+
+static void testAsyncErrors() {
+	resetSimulation();
+	max11254_init(&adc);
+	int32_t out[6] = { 11, 11, 11, 11, 11, 11 };
+	// first frame fails: reported to the caller, no callback
+	asyncCalls = 0;
+	isrReleases = 0;
+	failStarts = 1;
+	CHECK(max11254_read_results_async(&adc, 0x07, out, asyncDone, NULL)
+			== MAX11254_RES_ERROR, "failed start not reported");
+	CHECK(!asyncCalls, "callback after failed start");
+	CHECK(!busOwned && !isrReleases, "bus not released by the task");
+	CHECK(csPort.BSRR == CS_PIN && adc.asyncCb == NULL, "state left active");
+
+	// second frame fails in the interrupt: bus released, callback, out kept
+	numFrames = 0;
+	CHECK(max11254_read_results_async(&adc, 0x07, out, asyncDone, NULL)
+			== MAX11254_RES_OK, "start failed");
+	failStarts = 1;
+	completeTransfer();
+	CHECK(!spiPending, "transfer pending after error");
+	CHECK(asyncCalls == 1, "%lu callbacks", (unsigned long ) asyncCalls);
+	CHECK(asyncResult == MAX11254_RES_ERROR, "error not reported");
+	CHECK(isrReleases == 1 && !busOwned, "bus kept after error");
+	CHECK(csPort.BSRR == CS_PIN && adc.asyncCb == NULL, "state left active");
+	CHECK(out[0] == 11 && out[1] == 11 && out[2] == 11,
+			"results written after error");
+	CHECK(numFrames == 1, "%d frames", numFrames);
+
+	// a frame ends in the error interrupt: no further frames, out kept
+	asyncCalls = 0;
+	isrReleases = 0;
+	numFrames = 0;
+	CHECK(max11254_read_results_async(&adc, 0x07, out, asyncDone, NULL)
+			== MAX11254_RES_OK, "start failed");
+	completeTransfer();
+	failTransfers = 1;
+	completeTransfer();
+	CHECK(!spiPending && numFrames == 2, "%d frames after error", numFrames);
+	CHECK(asyncCalls == 1 && asyncResult == MAX11254_RES_ERROR,
+			"transfer error not reported");
+	CHECK(isrReleases == 1 && !busOwned, "bus kept after error");
+	CHECK(csPort.BSRR == CS_PIN && adc.asyncCb == NULL, "state left active");
+	CHECK(out[0] == 11 && out[1] == 11 && out[2] == 11,
+			"results written after error");
+}
+
+static void testTransferErrors() {
+	resetSimulation();
+	max11254_init(&adc);
+	int32_t out[6] = { 11, 11, 11, 11, 11, 11 };
+	regs[MAX11254_REG_DATA2] = 0x000005;
+	// the error interrupt wakes the task like a completion
+	logErrors = 0;
+	failTransfers = 1;
+	CHECK(max11254_read_results(&adc, 0x04, out) == MAX11254_RES_ERROR,
+			"transfer error not reported");
+	CHECK(out[2] == 11, "result written after transfer error");
+	CHECK(logErrors == 1, "transfer error not logged");
+	CHECK(!busOwned && csPort.BSRR == CS_PIN, "bus or CS left active");
+	CHECK(adc.task == NULL, "waiting task not cleared");
+	// the next transfer starts clean
+	CHECK(max11254_read_results(&adc, 0x04, out) == MAX11254_RES_OK
+			&& out[2] == 5, "read after error failed");
+}
+
+int main() {
+	testInit();
+	testShadow();
+	testRegisterAccess();
+	testResults();
+	testTimeout();
+	testAsyncResults();
+	testAsyncErrors();
+	testTransferErrors();
+	return CHECK_RESULT();
+}
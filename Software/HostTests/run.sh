@@ -0,0 +1,23 @@
+#!/bin/sh
+# Builds and runs all host tests (see the header of each test for details).
+# Usage: ./run.sh   (from any directory, exit code 0 if all tests passed)
+
+cd "$(dirname "$0")" || exit 2
+mkdir -p build
+INC="-Istubs -I../Teststand/Drivers/Board"
+result=0
+
+gcc -std=gnu11 -Wall -O2 $INC -o build/max11254_test max11254_test.c \
+	&& build/max11254_test || result=1
+g++ -std=c++11 -Wall -O2 -o build/fixedscale_test fixedscale_test.cpp \
+	&& build/fixedscale_test || result=1
+g++ -std=c++11 -Wall -Wno-format -O2 $INC -o build/file_test file_test.cpp \
+	&& build/file_test || result=1
+g++ -std=c++11 -Wall -O2 -Istubs -I../Teststand/Drivers/Board/Display \
+	-o build/display_test display_test.cpp && build/display_test || result=1
+g++ -std=c++11 -Wall -O2 $INC -o build/filter_test filter_test.cpp \
+	&& build/filter_test || result=1
+g++ -std=c++11 -Wall -O2 -o build/statistics_test statistics_test.cpp \
+	&& build/statistics_test || result=1
+
+exit $result
@@ -0,0 +1,165 @@
+// Bus model of the SSD1289 display controller for the host tests of the
+// display driver. The GPIO registers of stubs/stm32f1xx.h report every store
+// here; a rising WR edge with CS low latches the data lines like the
+// controller does: RS low selects the register index, RS high writes the
+// register or, for index 0x22, the GRAM at the address counter, which then
+// advances inside the window set by registers 0x44-0x46 (landscape, see
+// setXY in display.c).
+//
+// Besides the GRAM the model counts the bus traffic and estimates the CPU
+// cycles the driver spends on it at 72MHz:
+// - every GPIO store costs StoreCycles,
+// - every WR pulse is held low for 5 nops,
+// - a streamed WR pulse (CS not lowered right before, see strobe()) adds 3
+//   nops of WR high time.
+// Loop overhead and the table lookups are not part of the model, the numbers
+// are meant for comparing driver versions.
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include "stm32f1xx.h"
+
+GPIO_TypeDef gpio_Ports[5];
+
+namespace SSD1289 {
+
+static constexpr uint16_t Width = 320;
+static constexpr uint16_t Height = 240;
+static constexpr uint32_t ClockHz = 72000000;
+static constexpr uint8_t StoreCycles = 2;
+static constexpr uint8_t PulseNops = 5;
+static constexpr uint8_t StreamNops = 3;
+
+struct Counters {
+	uint64_t stores;	// GPIO register stores
+	uint64_t strobes;	// WR pulses with CS low
+	uint64_t pixels;	// GRAM writes
+	uint64_t registerWrites;	// writes to registers other than the GRAM
+	uint64_t windows;	// window set-ups (register 0x44)
+	uint64_t cycles;	// modeled CPU cycles
+	uint64_t outside;	// GRAM writes outside the display
+
+	Counters &operator+=(const Counters &c) {
+		stores += c.stores;
+		strobes += c.strobes;
+		pixels += c.pixels;
+		registerWrites += c.registerWrites;
+		windows += c.windows;
+		cycles += c.cycles;
+		outside += c.outside;
+		return *this;
+	}
+};
+
+static uint16_t gram[Height][Width];
+static Counters count;
+
+static uint16_t reg[256];
+static uint8_t index;
+static uint16_t cursorX, cursorY;
+static bool wrLow;
+static bool lastStoreCsLow;
+
+// the data lines are wired with reversed bit order within each byte
+static uint16_t decode(uint32_t bus) {
+	uint16_t data = 0;
+	for (uint8_t b = 0; b < 8; b++) {
+		if (bus & (1UL << b)) {
+			data |= 0x80 >> b;
+		}
+		if (bus & (0x100UL << b)) {
+			data |= 0x8000 >> b;
+		}
+	}
+	return data;
+}
+
+static void writeGRAM(uint16_t data) {
+	count.pixels++;
+	// landscape mode: the vertical address counts down from the top row
+	int16_t y = Height - 1 - cursorY;
+	if (cursorX < Width && y >= 0 && y < Height) {
+		gram[y][cursorX] = data;
+	} else {
+		count.outside++;
+	}
+	if (++cursorX > reg[0x46]) {
+		cursorX = reg[0x45];
+		if (cursorY-- == (reg[0x44] & 0xFF)) {
+			cursorY = reg[0x44] >> 8;
+		}
+	}
+}
+
+static void latch(bool rs, uint16_t data) {
+	count.strobes++;
+	if (!rs) {
+		index = data;
+	} else if (index == 0x22) {
+		writeGRAM(data);
+	} else {
+		count.registerWrites++;
+		reg[index] = data;
+		if (index == 0x44) {
+			count.windows++;
+		} else if (index == 0x4e) {
+			cursorY = data;
+		} else if (index == 0x4f) {
+			cursorX = data;
+		}
+	}
+}
+
+// Sets the GRAM to a color, the counters to zero
+static void Reset(uint16_t color) {
+	for (auto &row : gram) {
+		for (auto &p : row) {
+			p = color;
+		}
+	}
+	count = Counters();
+}
+
+static double Milliseconds(uint64_t cycles) {
+	return cycles * 1000.0 / ClockHz;
+}
+
+}
+
+void HAL_GPIO_Init(GPIO_TypeDef *port, GPIO_InitTypeDef *init) {
+}
+
+void HAL_Delay(uint32_t ms) {
+}
+
+void gpio_Store(GpioRegister *r) {
+	using namespace SSD1289;
+	count.stores++;
+	count.cycles += StoreCycles;
+	// WR pulses right after lowering CS are single accesses
+	bool csLowStore = r == &DISPLAY_CS_GPIO_Port->BSRR
+			&& (r->value & (uint32_t) DISPLAY_CS_Pin << 16);
+	for (auto &port : gpio_Ports) {
+		if (r != &port.BSRR) {
+			continue;
+		}
+		// the set/reset register only changes the output latch
+		port.ODR.value |= r->value & 0xFFFF;
+		port.ODR.value &= ~(r->value >> 16);
+		bool cs = !(DISPLAY_CS_GPIO_Port->ODR.value & DISPLAY_CS_Pin);
+		bool wr = !(DISPLAY_WR_GPIO_Port->ODR.value & DISPLAY_WR_Pin);
+		bool rs = DISPLAY_RS_GPIO_Port->ODR.value & DISPLAY_RS_Pin;
+		if (wr && !wrLow) {
+			count.cycles += PulseNops;
+			if (!lastStoreCsLow) {
+				count.cycles += StreamNops;
+			}
+		} else if (!wr && wrLow && cs) {
+			latch(rs, decode(GPIOD->ODR.value));
+		}
+		wrLow = wr;
+	}
+	lastStoreCsLow = csLowStore;
+}
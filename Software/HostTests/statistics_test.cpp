@@ -0,0 +1,144 @@
+// Host test of the integer running statistics (Teststand/Application/
+// Statistics.cpp) against a double precision reference. Signals:
+// - small noise on a large offset, the deviations keep the fractional bits
+// - noise and steps over the 24 bit ADC range, deviations above 2^23 take the
+//   clamped branch of Add()
+// - noise over the whole int32 range. M2 saturates after a few dozen samples instead of wrapping around,
+//   the variance is then UINT64_MAX / n
+// - alternating full scale values, the deviations are clamped to the int32
+//   range
+// Mean, variance and peak-to-peak are checked after every sample. The mean
+// carries the remainder of its updates and stays within the rounding of
+// Mean(), however many samples there are.
+//
+// Build: g++ -std=c++11 -Wall -O2 -o statistics_test statistics_test.cpp
+// Usage: statistics_test   (exit code 0 if all checks passed)
+
+#include "check.h"
+#include "../Teststand/Application/Statistics.cpp"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+
+struct Reference {
+	uint32_t n;
+	double mean;
+	double M2;
+	int32_t min;
+	int32_t max;
+
+	void Add(int32_t value) {
+		if (!n || value < min) {
+			min = value;
+		}
+		if (!n || value > max) {
+			max = value;
+		}
+		n++;
+		double delta = value - mean;
+		mean += delta / n;
+		M2 += delta * (value - mean);
+	}
+};
+
+struct Errors {
+	double mean;	// absolute, in units of value
+	double variance;	// relative, before M2 saturated
+	uint32_t saturated;	// samples with saturated M2
+};
+
+static uint32_t state;
+
+static int32_t random32() {
+	state = state * 1664525 + 1013904223;
+	return state;
+}
+
+// Feeds count values, returns the worst errors
+static Errors run(const char *name, uint32_t count,
+		std::function<int32_t(uint32_t)> signal) {
+	Statistics s;
+	Reference r = { };
+	Errors worst = { 0, 0, 0 };
+	state = 1;
+	for (uint32_t i = 0; i < count; i++) {
+		int32_t v = signal(i);
+		s.Add(v);
+		r.Add(v);
+		worst.mean = std::max(worst.mean, fabs(s.Mean() - r.mean));
+		double variance = r.M2 / r.n;
+		if (r.M2 > 1.0001 * UINT64_MAX) {
+			worst.saturated++;
+			CHECK(s.Variance() == UINT64_MAX / r.n, "%s, sample %u: variance %llu",
+					name, i, (unsigned long long) s.Variance());
+		} else if (variance >= 1 && r.M2 < 0.9999 * UINT64_MAX) {
+			worst.variance = std::max(worst.variance,
+					fabs(s.Variance() - variance) / variance);
+		}
+		int64_t p2p = (int64_t) r.max - r.min;
+		CHECK(s.Count() == r.n && s.Min() == r.min && s.Max() == r.max
+				&& s.PeakToPeak() == std::min<int64_t>(p2p, INT32_MAX),
+				"%s, sample %u: min %d, max %d, peak-to-peak %d", name, i,
+				s.Min(), s.Max(), s.PeakToPeak());
+	}
+	printf("%-16s mean error %.3f, variance error %.2e, %u saturated\n", name,
+			worst.mean, worst.variance, worst.saturated);
+	return worst;
+}
+
+static void testAdcRange() {
+	// the rounding of small increments of M2 dominates the variance error
+	auto e = run("noise on offset", 100000, [](uint32_t) {
+		return 5000000 + (random32() >> 24);
+	});
+	CHECK(e.mean < 0.51 && e.variance < 1e-3, "noise on offset");
+	e = run("24 bit noise", 100000, [](uint32_t) {
+		return random32() >> 8;
+	});
+	CHECK(e.mean < 0.51 && e.variance < 1e-6, "24 bit noise");
+	e = run("24 bit steps", 10000, [](uint32_t i) {
+		return (i / 100) & 1 ? (1 << 23) - 1 : -(1 << 23);
+	});
+	CHECK(e.mean < 0.51 && e.variance < 1e-6, "24 bit steps");
+}
+
+static void testInt32Range() {
+	// deviations up to 2^31, no clamping of the value itself yet
+	auto e = run("int32 noise", 100000, [](uint32_t) {
+		return random32() >> 1;
+	});
+	CHECK(e.mean < 0.51 && e.variance < 1e-6 && e.saturated > 90000,
+			"int32 noise");
+	// every deviation is clamped to the int32 range
+	Statistics s;
+	for (uint8_t i = 0; i < 10; i++) {
+		s.Add(i & 1 ? INT32_MAX : INT32_MIN);
+	}
+	CHECK(s.PeakToPeak() == INT32_MAX, "peak-to-peak %d", s.PeakToPeak());
+	CHECK(abs(s.Mean()) <= 1, "mean %d", s.Mean());
+	// the true M2 is 10 * 2^62, saturated instead of wrapped around
+	CHECK(s.Variance() == UINT64_MAX / 10, "variance %llu",
+			(unsigned long long) s.Variance());
+	CHECK(s.StdDev() == (uint32_t) sqrt(UINT64_MAX / 10), "std dev %u",
+			s.StdDev());
+}
+
+static void testReset() {
+	Statistics s;
+	s.Add(INT32_MIN);
+	s.Add(INT32_MAX);
+	s.Reset();
+	CHECK(s.Count() == 0 && s.Mean() == 0 && s.Variance() == 0
+			&& s.PeakToPeak() == 0, "not reset");
+	s.Add(-5);
+	CHECK(s.Min() == -5 && s.Max() == -5 && s.Mean() == -5
+			&& s.Variance() == 0, "single value");
+}
+
+int main() {
+	testAdcRange();
+	testInt32Range();
+	testReset();
+	return CHECK_RESULT();
+}
@@ -0,0 +1,51 @@
+#ifndef HOST_FREERTOS_H_
+#define HOST_FREERTOS_H_
+
+/*
+ * Host replacement for the FreeRTOS headers: types, constants and the
+ * calls without behaviour worth simulating. Scheduling related calls are
+ * declared in task.h/semphr.h and implemented by the tests that need them.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE					((BaseType_t) 0)
+#define pdTRUE					((BaseType_t) 1)
+#define pdPASS					pdTRUE
+#define pdFAIL					pdFALSE
+#define portMAX_DELAY			((TickType_t) 0xffffffffUL)
+#define configTICK_RATE_HZ		((TickType_t) 1000)
+#define pdMS_TO_TICKS(ms)		((TickType_t) (ms))
+
+#define portYIELD_FROM_ISR(x)	((void) (x))
+#define portENTER_CRITICAL()
+#define portEXIT_CRITICAL()
+#define taskENTER_CRITICAL()
+#define taskEXIT_CRITICAL()
+#define configASSERT(x)			do { if (!(x)) { abort(); } } while (0)
+
+static inline void* pvPortMalloc(size_t size) {
+	return malloc(size);
+}
+
+static inline void vPortFree(void *p) {
+	free(p);
+}
+
+// 1MHz run time counter, see FreeRTOSConfig.h
+unsigned long getRunTimeCounterValue(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef HOST_FATFS_H_
+#define HOST_FATFS_H_
+
+/*
+ * Host replacement for the FatFs API (R0.11) as used by the application. The
+ * functions are implemented by the tests, usually on top of files in memory.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef uint8_t BYTE;
+typedef unsigned int UINT;
+typedef uint32_t DWORD;
+typedef char TCHAR;
+
+typedef enum {
+	FR_OK = 0,
+	FR_DISK_ERR,
+	FR_INT_ERR,
+	FR_NOT_READY,
+	FR_NO_FILE,
+	FR_NO_PATH,
+	FR_INVALID_NAME,
+	FR_DENIED,
+	FR_EXIST,
+	FR_INVALID_OBJECT,
+	FR_WRITE_PROTECTED,
+	FR_INVALID_DRIVE,
+	FR_NOT_ENABLED,
+	FR_NO_FILESYSTEM,
+	FR_MKFS_ABORTED,
+	FR_TIMEOUT,
+	FR_LOCKED,
+	FR_NOT_ENOUGH_CORE,
+	FR_TOO_MANY_OPEN_FILES,
+	FR_INVALID_PARAMETER
+} FRESULT;
+
+typedef struct {
+	int dummy;
+} FATFS;
+
+typedef struct {
+	// backing store, owned by the test
+	void *obj;
+	DWORD fptr;
+	DWORD fsize;
+} FIL;
+
+#define	FA_READ				0x01
+#define	FA_OPEN_EXISTING	0x00
+#define	FA_WRITE			0x02
+#define	FA_CREATE_NEW		0x04
+#define	FA_CREATE_ALWAYS	0x08
+#define	FA_OPEN_ALWAYS		0x10
+
+#define f_eof(fp) ((int)((fp)->fptr == (fp)->fsize))
+#define f_tell(fp) ((fp)->fptr)
+#define f_size(fp) ((fp)->fsize)
+
+FRESULT f_mount(FATFS *fs, const TCHAR *path, BYTE opt);
+FRESULT f_open(FIL *fp, const TCHAR *path, BYTE mode);
+FRESULT f_close(FIL *fp);
+FRESULT f_read(FIL *fp, void *buff, UINT btr, UINT *br);
+FRESULT f_write(FIL *fp, const void *buff, UINT btw, UINT *bw);
+FRESULT f_lseek(FIL *fp, DWORD ofs);
+FRESULT f_sync(FIL *fp);
+FRESULT f_unlink(const TCHAR *path);
+int f_puts(const TCHAR *str, FIL *fp);
+TCHAR* f_gets(TCHAR *buff, int len, FIL *fp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef IOX_STM_H_
+#define IOX_STM_H_
+
+/*
+ * Host replacement for Drivers/Board/stm.h with the few HAL types and calls
+ * the code under test needs. The include guard is the same as in the real
+ * header, so including this one first keeps quoted includes of "stm.h" from
+ * the driver directories out. The HAL functions are implemented by each test.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	HAL_OK = 0x00,
+	HAL_ERROR = 0x01,
+	HAL_BUSY = 0x02,
+	HAL_TIMEOUT = 0x03,
+} HAL_StatusTypeDef;
+
+typedef struct {
+	volatile uint32_t CRL;
+	volatile uint32_t CRH;
+	volatile uint32_t IDR;
+	volatile uint32_t ODR;
+	volatile uint32_t BSRR;
+	volatile uint32_t BRR;
+	volatile uint32_t LCKR;
+} GPIO_TypeDef;
+
+typedef struct {
+	uint32_t Pin;
+	uint32_t Mode;
+	uint32_t Pull;
+	uint32_t Speed;
+} GPIO_InitTypeDef;
+
+typedef struct {
+	void *Instance;
+	volatile uint32_t ErrorCode;
+} SPI_HandleTypeDef;
+
+#define HAL_SPI_ERROR_NONE				0x00000000U
+#define HAL_SPI_ERROR_OVR				0x00000004U
+#define HAL_SPI_ERROR_DMA				0x00000010U
+
+#define GPIO_MODE_INPUT					0x00000000U
+#define GPIO_MODE_OUTPUT_PP				0x00000001U
+#define GPIO_MODE_IT_RISING				0x10110000U
+#define GPIO_MODE_IT_FALLING			0x10210000U
+#define GPIO_MODE_IT_RISING_FALLING		0x10310000U
+#define GPIO_NOPULL						0x00000000U
+#define GPIO_PULLUP						0x00000001U
+#define GPIO_PULLDOWN					0x00000002U
+#define GPIO_SPEED_FREQ_HIGH			0x00000003U
+
+#define SPI_BAUDRATEPRESCALER_2			0x00000000U
+#define SPI_BAUDRATEPRESCALER_8			0x00000010U
+#define SPI_BAUDRATEPRESCALER_256		0x00000038U
+
+#define __BKPT()						abort()
+
+void HAL_GPIO_Init(GPIO_TypeDef *gpio, GPIO_InitTypeDef *init);
+void HAL_Delay(uint32_t ms);
+
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef *spi, uint8_t *data,
+		uint16_t size);
+HAL_StatusTypeDef HAL_SPI_TransmitReceive_DMA(SPI_HandleTypeDef *spi,
+		uint8_t *tx, uint8_t *rx, uint16_t size);
+HAL_StatusTypeDef HAL_SPI_Abort(SPI_HandleTypeDef *spi);
+
+static inline uint8_t stm_in_interrupt() {
+	return 0;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
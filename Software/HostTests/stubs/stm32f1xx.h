@@ -0,0 +1,89 @@
+#ifndef HOST_STM32F1XX_H_
+#define HOST_STM32F1XX_H_
+
+/*
+ * Host replacement for the device header as used by the display driver. C++
+ * only: the GPIO registers are objects that report every store to
+ * gpio_Store(), which the test implements (see ssd1289_model.hpp). The pin
+ * assignment is the one from Inc/main.h.
+ */
+
+#include <stdint.h>
+
+struct GpioRegister;
+void gpio_Store(GpioRegister *reg);
+
+struct GpioRegister {
+	uint32_t value;
+	GpioRegister &operator=(uint32_t v) {
+		value = v;
+		gpio_Store(this);
+		return *this;
+	}
+	operator uint32_t() const {
+		return value;
+	}
+};
+
+typedef struct {
+	GpioRegister CRL;
+	GpioRegister CRH;
+	GpioRegister IDR;
+	GpioRegister ODR;
+	GpioRegister BSRR;
+	GpioRegister BRR;
+	GpioRegister LCKR;
+} GPIO_TypeDef;
+
+extern GPIO_TypeDef gpio_Ports[5];
+
+#define GPIOA	(&gpio_Ports[0])
+#define GPIOB	(&gpio_Ports[1])
+#define GPIOC	(&gpio_Ports[2])
+#define GPIOD	(&gpio_Ports[3])
+#define GPIOE	(&gpio_Ports[4])
+
+typedef struct {
+	uint32_t Pin;
+	uint32_t Mode;
+	uint32_t Pull;
+	uint32_t Speed;
+} GPIO_InitTypeDef;
+
+#define GPIO_PIN_0				((uint16_t)0x0001)
+#define GPIO_PIN_1				((uint16_t)0x0002)
+#define GPIO_PIN_2				((uint16_t)0x0004)
+#define GPIO_PIN_3				((uint16_t)0x0008)
+#define GPIO_PIN_4				((uint16_t)0x0010)
+#define GPIO_PIN_5				((uint16_t)0x0020)
+#define GPIO_PIN_6				((uint16_t)0x0040)
+#define GPIO_PIN_7				((uint16_t)0x0080)
+#define GPIO_PIN_8				((uint16_t)0x0100)
+#define GPIO_PIN_9				((uint16_t)0x0200)
+#define GPIO_PIN_10				((uint16_t)0x0400)
+#define GPIO_PIN_11				((uint16_t)0x0800)
+#define GPIO_PIN_12				((uint16_t)0x1000)
+#define GPIO_PIN_13				((uint16_t)0x2000)
+#define GPIO_PIN_14				((uint16_t)0x4000)
+#define GPIO_PIN_15				((uint16_t)0x8000)
+
+#define GPIO_MODE_INPUT			0x00000000u
+#define GPIO_MODE_OUTPUT_PP		0x00000001u
+#define GPIO_NOPULL				0x00000000u
+#define GPIO_SPEED_FREQ_HIGH	0x00000003u
+
+#define DISPLAY_RST_Pin			GPIO_PIN_8
+#define DISPLAY_RST_GPIO_Port	GPIOE
+#define DISPLAY_CS_Pin			GPIO_PIN_13
+#define DISPLAY_CS_GPIO_Port	GPIOE
+#define DISPLAY_RD_Pin			GPIO_PIN_10
+#define DISPLAY_RD_GPIO_Port	GPIOC
+#define DISPLAY_WR_Pin			GPIO_PIN_11
+#define DISPLAY_WR_GPIO_Port	GPIOC
+#define DISPLAY_RS_Pin			GPIO_PIN_12
+#define DISPLAY_RS_GPIO_Port	GPIOC
+
+void HAL_GPIO_Init(GPIO_TypeDef *port, GPIO_InitTypeDef *init);
+void HAL_Delay(uint32_t ms);
+
+#endif
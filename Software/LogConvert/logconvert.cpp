@@ -0,0 +1,205 @@
+// Converts binary teststand logs (see Teststand/Application/BinaryLog.hpp)
+// to CSV and checks their integrity.
+//
+// Build: g++ -std=c++11 -O2 -o logconvert logconvert.cpp
+// Usage: logconvert <log.bin> [out.csv]   (CSV goes to stdout without out.csv)
+//
+// Exit code is 0 for an intact log, 1 if records were corrupted or dropped
+// and 2 if the file could not be read at all.
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "../Teststand/Application/BinaryLog.hpp"
+
+using namespace BinaryLog;
+
+static bool readFile(const char *name, std::vector<uint8_t> &data) {
+	FILE *f = fopen(name, "rb");
+	if (!f) {
+		return false;
+	}
+	uint8_t buf[4096];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+		data.insert(data.end(), buf, buf + n);
+	}
+	fclose(f);
+	return true;
+}
+
+template<typename T> static T get(const std::vector<uint8_t> &data, size_t pos) {
+	T v;
+	memcpy(&v, &data[pos], sizeof(T));
+	return v;
+}
+
+class Reader {
+public:
+	Reader(const std::vector<uint8_t> &data, const Header &h, size_t start) :
+			data(data), h(h), pos(start) {
+	}
+
+	// true if a valid record starts at p
+	bool validRecord(size_t p) const {
+		if (p + h.recordSize > data.size()) {
+			return false;
+		}
+		size_t values = h.channels * sizeof(int32_t);
+		auto t = get<Trailer>(data, p + values);
+		uint16_t crc = CRC16(&data[p], values);
+		crc = CRC16(&t.sequence, sizeof(t.sequence), crc);
+		return crc == t.crc;
+	}
+
+	bool syncAt(size_t p) const {
+		return p + sizeof(Sync) <= data.size()
+				&& get<uint32_t>(data, p) == SyncWord
+				&& validRecord(p + sizeof(Sync));
+	}
+
+	// Returns false at the end of the file
+	bool next(std::vector<int32_t> &values) {
+		while (pos + h.recordSize <= data.size()) {
+			if (syncAt(pos)) {
+				auto s = get<Sync>(data, pos);
+				if (synced && s.index != expected) {
+					fprintf(stderr, "Sync at offset %zu: expected record %u, got %u\n",
+							pos, expected, s.index);
+				}
+				expected = s.index;
+				synced = true;
+				pos += sizeof(Sync);
+			}
+			if (!validRecord(pos)) {
+				// skip to the next sync marker
+				size_t start = pos;
+				do {
+					pos++;
+				} while (pos + h.recordSize <= data.size() && !syncAt(pos));
+				corrupted += pos - start;
+				resyncs++;
+				synced = false;
+				continue;
+			}
+			auto t = get<Trailer>(data, pos + h.channels * sizeof(int32_t));
+			uint16_t gap = t.sequence - (uint16_t) expected;
+			if (synced) {
+				dropped += gap;
+			}
+			index = expected + gap;
+			expected = index + 1;
+			values.resize(h.channels);
+			memcpy(values.data(), &data[pos], h.channels * sizeof(int32_t));
+			pos += h.recordSize;
+			records++;
+			return true;
+		}
+		trailing = data.size() - pos;
+		return false;
+	}
+
+	uint32_t index = 0;
+	uint32_t records = 0;
+	uint32_t dropped = 0;
+	uint32_t resyncs = 0;
+	size_t corrupted = 0;
+	size_t trailing = 0;
+private:
+	const std::vector<uint8_t> &data;
+	const Header &h;
+	size_t pos;
+	uint32_t expected = 0;
+	bool synced = true;
+};
+
+int main(int argc, char *argv[]) {
+	if (argc < 2 || argc > 3) {
+		fprintf(stderr, "Usage: %s <log.bin> [out.csv]\n", argv[0]);
+		return 2;
+	}
+	std::vector<uint8_t> data;
+	if (!readFile(argv[1], data)) {
+		fprintf(stderr, "Unable to read %s\n", argv[1]);
+		return 2;
+	}
+	if (data.size() < sizeof(Header)) {
+		fprintf(stderr, "File too short for a header\n");
+		return 2;
+	}
+	auto h = get<Header>(data, 0);
+	if (memcmp(h.magic, Magic, sizeof(Magic)) || h.version != Version) {
+		fprintf(stderr, "Not a binary log (version %d)\n", Version);
+		return 2;
+	}
+	size_t headerEnd = sizeof(Header) + h.channels * sizeof(Channel);
+	if (h.channels > MaxChannels || h.recordSize != RecordSize(h.channels)
+			|| data.size() < headerEnd + sizeof(uint16_t)) {
+		fprintf(stderr, "Invalid header\n");
+		return 2;
+	}
+	if (CRC16(&data[0], headerEnd) != get<uint16_t>(data, headerEnd)) {
+		fprintf(stderr, "Header CRC mismatch\n");
+		return 2;
+	}
+	std::vector<Channel> channels(h.channels);
+	for (uint8_t i = 0; i < h.channels; i++) {
+		channels[i] = get<Channel>(data, sizeof(Header) + i * sizeof(Channel));
+		// names are not terminated if they use the whole field
+		channels[i].name[sizeof(channels[i].name) - 1] = 0;
+		channels[i].unit[sizeof(channels[i].unit) - 1] = 0;
+	}
+
+	fprintf(stderr, "%d channels, rate setting %d, driver features 0x%02x\n",
+			h.channels, h.rate, h.features);
+	for (uint8_t i = 0; i < MaxCells; i++) {
+		if (h.enabledCells & (1 << i)) {
+			fprintf(stderr, "Loadcell %d: offset %d, scale %g\n", i, h.offset[i],
+					h.scale[i]);
+		}
+	}
+
+	FILE *out = stdout;
+	if (argc == 3) {
+		out = fopen(argv[2], "w");
+		if (!out) {
+			fprintf(stderr, "Unable to create %s\n", argv[2]);
+			return 2;
+		}
+	}
+	for (uint8_t i = 0; i < h.channels; i++) {
+		fprintf(out, i ? ";%s" : "%s", channels[i].name);
+		if (channels[i].unit[0]) {
+			fprintf(out, "[%s]", channels[i].unit);
+		}
+	}
+	fprintf(out, "\n");
+
+	Reader r(data, h, headerEnd + sizeof(uint16_t));
+	std::vector<int32_t> values;
+	while (r.next(values)) {
+		for (uint8_t i = 0; i < h.channels; i++) {
+			if (i) {
+				fputc(';', out);
+			}
+			if (channels[i].scale == 1.0f) {
+				fprintf(out, "%d", values[i]);
+			} else {
+				fprintf(out, "%.9g", values[i] * (double) channels[i].scale);
+			}
+		}
+		fputc('\n', out);
+	}
+	if (out != stdout) {
+		fclose(out);
+	}
+
+	fprintf(stderr, "%u records, %u dropped, %u resyncs, %zu corrupted bytes",
+			r.records, r.dropped, r.resyncs, r.corrupted);
+	if (r.trailing) {
+		// usually a record cut off by power loss
+		fprintf(stderr, ", %zu trailing bytes", r.trailing);
+	}
+	fprintf(stderr, "\n");
+	return r.dropped || r.resyncs || r.trailing ? 1 : 0;
+}
@@ -0,0 +1,57 @@
+#include "BinaryLog.hpp"
+
+#include <cstring>
+#include "Logger.hpp"
+#include "Loadcells.hpp"
+
+bool BinaryLog::Writer::Begin(const Channel *ch, uint8_t n, uint8_t features) {
+	if (n > MaxChannels) {
+		return false;
+	}
+	channels = n;
+	index = 0;
+	Header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, Magic, sizeof(h.magic));
+	h.version = Version;
+	h.channels = n;
+	h.recordSize = RecordSize(n);
+	h.syncInterval = SyncInterval;
+	h.features = features;
+	h.rate = Loadcells::rate;
+	for (uint8_t i = 0; i < MaxCells && i < Loadcells::MaxCells; i++) {
+		if (Loadcells::enabled[i]) {
+			h.enabledCells |= 1 << i;
+		}
+		h.offset[i] = Loadcells::cells[i].offset;
+		h.scale[i] = Loadcells::cells[i].scale;
+	}
+	uint16_t crc = CRC16(&h, sizeof(h));
+	crc = CRC16(ch, n * sizeof(Channel), crc);
+	return Logger::Write(&h, sizeof(h))
+			&& Logger::Write(ch, n * sizeof(Channel))
+			&& Logger::Write(&crc, sizeof(crc));
+}
+
+bool BinaryLog::Writer::Record(const int32_t *values) {
+	// sync marker and record go to the logger as one piece
+	uint8_t buf[sizeof(Sync) + MaxChannels * sizeof(int32_t) + sizeof(Trailer)];
+	uint16_t pos = 0;
+	if (index % SyncInterval == 0) {
+		Sync s = { SyncWord, index };
+		memcpy(buf, &s, sizeof(s));
+		pos += sizeof(s);
+	}
+	uint8_t *record = &buf[pos];
+	memcpy(record, values, channels * sizeof(int32_t));
+	pos += channels * sizeof(int32_t);
+	Trailer t;
+	t.sequence = index;
+	t.crc = CRC16(record, channels * sizeof(int32_t));
+	t.crc = CRC16(&t.sequence, sizeof(t.sequence), t.crc);
+	memcpy(&buf[pos], &t, sizeof(t));
+	pos += sizeof(t);
+	// counted even if dropped, the reader sees the gap in the sequence
+	index++;
+	return Logger::Write(buf, pos);
+}
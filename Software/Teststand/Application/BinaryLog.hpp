@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+// Binary measurement log. Only depends on the standard headers, the host
+// converter (Software/LogConvert) includes it as well. All values are little
+// endian.
+//
+// File layout:
+//   Header
+//   Channel[header.channels]
+//   uint16_t CRC of everything above
+//   records, with a Sync marker in front of every syncInterval-th record
+//
+// Record: int32_t value[header.channels], uint16_t sequence, uint16_t CRC.
+// The sequence is the lower 16 bits of the record index, gaps show dropped
+// records. After corrupted data the next Sync marker allows to resynchronize.
+namespace BinaryLog {
+
+constexpr char Magic[4] = { 'T', 'S', 'L', 'G' };
+constexpr uint8_t Version = 1;
+constexpr uint32_t SyncWord = 0x434E5953;	// "SYNC"
+constexpr uint16_t SyncInterval = 64;
+constexpr uint8_t MaxChannels = 16;
+constexpr uint8_t MaxCells = 6;
+
+// matches the readback features of the motor driver
+enum Features : uint8_t {
+	FeatureRPM = 0x01,
+	FeatureCurrent = 0x02,
+	FeatureVoltage = 0x04,
+	FeatureThrust = 0x08,
+};
+
+using Header = struct __attribute__((packed)) header {
+	char magic[4];
+	uint8_t version;
+	uint8_t channels;
+	uint16_t recordSize;
+	uint16_t syncInterval;
+	uint8_t features;
+	// MAX11254 rate setting
+	uint8_t rate;
+	// loadcell calibration: uNewton = (raw - offset) * scale
+	uint8_t enabledCells;
+	uint8_t reserved[3];
+	int32_t offset[MaxCells];
+	float scale[MaxCells];
+};
+
+using Channel = struct __attribute__((packed)) channel {
+	char name[16];
+	char unit[8];
+	// value in unit = raw value * scale
+	float scale;
+};
+
+using Sync = struct __attribute__((packed)) sync {
+	uint32_t word;
+	uint32_t index;
+};
+
+using Trailer = struct __attribute__((packed)) trailer {
+	uint16_t sequence;
+	uint16_t crc;
+};
+
+constexpr uint16_t RecordSize(uint8_t channels) {
+	return channels * sizeof(int32_t) + sizeof(Trailer);
+}
+
+// CRC-16/CCITT-FALSE
+inline uint16_t CRC16(const void *data, size_t len, uint16_t crc = 0xFFFF) {
+	auto p = (const uint8_t*) data;
+	while (len--) {
+		crc ^= (uint16_t) *p++ << 8;
+		for (uint8_t i = 0; i < 8; i++) {
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+// Firmware side, writes through the Logger
+class Writer {
+public:
+	// Writes the header, calibration and rate are taken from the loadcells
+	bool Begin(const Channel *channels, uint8_t n, uint8_t features);
+	// Appends one record with a value for every channel
+	bool Record(const int32_t *values);
+private:
+	uint8_t channels;
+	uint32_t index;
+};
+
+}
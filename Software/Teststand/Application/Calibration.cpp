@@ -0,0 +1,169 @@
+#include "Calibration.hpp"
+
+#include <cmath>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "Loadcells.hpp"
+#include "log.h"
+
+// Time until the loadcell task has written half of the sample buffer at the
+// current scan rate (filters may decimate, but never add samples). One tick
+// while the rate is unknown. Above SampleBufferSize scans per tick polling
+// cannot keep up anymore, missed samples are reported by the reader
+static TickType_t pollInterval() {
+	constexpr TickType_t maxInterval = pdMS_TO_TICKS(50);
+	uint32_t us = Loadcells::ScanInterval() * (Loadcells::SampleBufferSize / 2);
+	TickType_t ticks = us / (1000000UL / configTICK_RATE_HZ);
+	if (ticks < 1) {
+		return 1;
+	}
+	return ticks < maxInterval ? ticks : maxInterval;
+}
+
+// Adds the next n values of a cell to stats, reports progress from
+// progressStart to progressStart + progressSpan
+static bool collect(Loadcells::Reader &reader, uint8_t cell, uint16_t n,
+		Statistics &stats, Calibration::ProgressCallback cb, void *ptr,
+		uint8_t progressStart = 0, uint8_t progressSpan = 100) {
+	constexpr uint32_t timeout = pdMS_TO_TICKS(1000);
+	uint16_t i = 0;
+	uint8_t lastPercentage = progressStart;
+	uint32_t lastSample = xTaskGetTickCount();
+	while (i < n) {
+		// the rate changes when characterizing, check it every time
+		vTaskDelay(pollInterval());
+		Loadcells::Sample s;
+		while (i < n && reader.Read(s)) {
+			stats.Add(s.raw[cell]);
+			i++;
+			lastSample = xTaskGetTickCount();
+		}
+		if (xTaskGetTickCount() - lastSample > timeout) {
+			LOG(Log_Loadcell, LevelError, "No samples, got only %d/%d", i, n);
+			return false;
+		}
+		uint8_t percentage = progressStart + (uint32_t) i * progressSpan / n;
+		if (cb && percentage != lastPercentage) {
+			cb(ptr, percentage);
+			lastPercentage = percentage;
+		}
+	}
+	if (reader.Overruns()) {
+		LOG(Log_Loadcell, LevelWarn, "Missed %lu samples", reader.Overruns());
+	}
+	return true;
+}
+
+bool Calibration::Sample(uint8_t cell, uint16_t n, int32_t &raw,
+		ProgressCallback cb, void *ptr) {
+	Loadcells::Reader reader;
+	Statistics stats;
+	if (!collect(reader, cell, n, stats, cb, ptr)) {
+		return false;
+	}
+	raw = stats.Mean();
+	return true;
+}
+
+max11254_rate_t Calibration::CharacterizeRates(uint8_t cell, uint16_t n,
+		RateNoise *results, uint8_t nRates, float targetBits,
+		ProgressCallback cb, void *ptr) {
+	// conversions after a rate change that are not used
+	constexpr uint16_t settleSamples = 8;
+	const auto oldRate = Loadcells::rate;
+	uint8_t best = 0;
+	int8_t recommended = -1;
+	for (uint8_t r = 0; r < nRates; r++) {
+		results[r] = RateNoise();
+	}
+	for (uint8_t r = 0; r < nRates; r++) {
+		Loadcells::rate = (max11254_rate_t) r;
+		Loadcells::UpdateSettings();
+		// give the loadcell task time to restart the ADC
+		vTaskDelay(pdMS_TO_TICKS(20));
+		Loadcells::Reader reader;
+		Statistics stats;
+		uint8_t progress = (uint16_t) r * 100 / nRates;
+		if (!collect(reader, cell, settleSamples, stats, nullptr, nullptr)) {
+			break;
+		}
+		stats.Reset();
+		if (!collect(reader, cell, n, stats, cb, ptr, progress, 100 / nRates)) {
+			break;
+		}
+		// full scale of the raw value depends on the gain it was scaled from
+		float fullScale = (float) (1UL << 24)
+				* (1 << (MAX11254_GAIN128 - Loadcells::GetGain()));
+		auto &res = results[r];
+		res.peakToPeak = stats.PeakToPeak();
+		res.rms = stats.StdDev();
+		res.noiseFreeBits = log2f(fullScale / (res.peakToPeak ? res.peakToPeak : 1));
+		res.effectiveBits = log2f(fullScale / (res.rms ? res.rms : 1));
+		LOG(Log_Loadcell, LevelInfo,
+				"Rate %d: noise p-p %lu rms %lu, noise free bits %d.%d", r,
+				res.peakToPeak, res.rms, (int) res.noiseFreeBits,
+				(int) (res.noiseFreeBits * 10) % 10);
+		if (res.noiseFreeBits > results[best].noiseFreeBits) {
+			best = r;
+		}
+		if (res.noiseFreeBits >= targetBits) {
+			// rates are sorted, the last one meeting the target is the fastest
+			recommended = r;
+		}
+	}
+	Loadcells::rate = oldRate;
+	Loadcells::UpdateSettings();
+	return (max11254_rate_t) (recommended >= 0 ? recommended : best);
+}
+
+bool Calibration::LinearFit(const Point *points, uint8_t n,
+		int32_t currentOffset, Fit &fit) {
+	if (n == 0) {
+		return false;
+	}
+	double scale, offset;
+	if (n == 1) {
+		if (points[0].raw == currentOffset) {
+			return false;
+		}
+		offset = currentOffset;
+		scale = (double) points[0].uNewton / (points[0].raw - currentOffset);
+	} else {
+		// y = a * x + b, relative to the first point for numerical stability
+		double sx = 0, sy = 0, sxx = 0, sxy = 0;
+		for (uint8_t i = 0; i < n; i++) {
+			double x = points[i].raw - points[0].raw;
+			double y = points[i].uNewton;
+			sx += x;
+			sy += y;
+			sxx += x * x;
+			sxy += x * y;
+		}
+		double det = n * sxx - sx * sx;
+		if (det == 0) {
+			// all points at the same raw value
+			return false;
+		}
+		double a = (n * sxy - sx * sy) / det;
+		double b = (sy - a * sx) / n;
+		if (a == 0) {
+			return false;
+		}
+		scale = a;
+		offset = points[0].raw - b / a;
+	}
+	fit.scale = scale;
+	fit.offset = lround(offset);
+	fit.maxResidual = 0;
+	double sumSq = 0;
+	for (uint8_t i = 0; i < n; i++) {
+		double residual = points[i].uNewton
+				- (points[i].raw - fit.offset) * (double) fit.scale;
+		sumSq += residual * residual;
+		if (fabs(residual) > fit.maxResidual) {
+			fit.maxResidual = fabs(residual);
+		}
+	}
+	fit.rmsResidual = sqrt(sumSq / n);
+	return true;
+}
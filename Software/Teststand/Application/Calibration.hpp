@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include "max11254.h"
+
+namespace Calibration {
+
+constexpr uint8_t MaxPoints = 8;
+
+using Point = struct point {
+	int32_t raw;
+	int32_t uNewton;
+};
+
+using Fit = struct fit {
+	int32_t offset;
+	float scale;
+	// deviation of the points from the fitted line, in uN
+	int32_t maxResidual;
+	int32_t rmsResidual;
+};
+
+using ProgressCallback = void(*)(void *ptr, uint8_t percentage);
+
+// Averages the raw value of a cell over the next n conversions, the duration
+// scales with the sample rate. Returns false if the samples stop arriving
+bool Sample(uint8_t cell, uint16_t n, int32_t &raw,
+		ProgressCallback cb = nullptr, void *ptr = nullptr);
+
+using RateNoise = struct ratenoise {
+	// of the raw value, scaled to gain 128
+	uint32_t peakToPeak;
+	uint32_t rms;
+	// log2 of full scale over peak-to-peak/rms noise
+	float noiseFreeBits;
+	float effectiveBits;
+};
+
+// Measures the noise of a cell at every rate from MAX11254_RATE_CONT1_9_SINGLE50
+// up to nRates - 1 with n samples each. Returns the fastest rate with at least
+// targetBits noise free bits (or the least noisy one). The active rate is
+// restored afterwards
+max11254_rate_t CharacterizeRates(uint8_t cell, uint16_t n, RateNoise *results,
+		uint8_t nRates, float targetBits, ProgressCallback cb = nullptr,
+		void *ptr = nullptr);
+
+// Least squares fit of uNewton = scale * (raw - offset) through all points.
+// With only one point the current offset of the cell is kept
+bool LinearFit(const Point *points, uint8_t n, int32_t currentOffset,
+		Fit &fit);
+
+}
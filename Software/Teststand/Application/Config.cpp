@@ -1,6 +1,8 @@
 #include "Config.hpp"
 #include "file.hpp"
 #include "log.h"
+#include "stm.h"
+#include "FreeRTOS.h"
 
 using ConfigEntry = struct configEntry {
 	Config::WriteFunc write;
@@ -60,45 +62,222 @@ bool Config::RemoveParseFunctions(int index) {
 	return removed;
 }
 
-bool Config::Store(const char* filename) {
-	if (File::Open(filename, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) {
-		LOG(Log_Config, LevelError, "Failed to\ncreate file");
-		return false;
-	}
+static bool writeModules(File::Handle &file) {
 	ConfigEntry *entry = first;
-	bool success = true;
 	while (entry) {
 		if (entry->write) {
-			if (!entry->write(entry->ptr)) {
+			if (!entry->write(entry->ptr, file)) {
 				LOG(Log_Config, LevelError, "Config write function failed");
-				success = false;
-				break;
+				return false;
 			}
-			File::Write("\n");
+			file.Write("\n");
 		}
 		entry = entry->next;
 	}
-	File::Close();
-	return success;
+	return true;
 }
 
-bool Config::Load(const char* filename) {
-	if (File::Open(filename, FA_READ | FA_OPEN_EXISTING) != FR_OK) {
-		LOG(Log_Config, LevelError, "Failed to\nopen file");
-		return false;
-	}
+static bool readModules(File::Handle &file) {
 	ConfigEntry *entry = first;
-	bool success = true;
 	while (entry) {
 		if (entry->read) {
-			if (!entry->read(entry->ptr)) {
+			if (!entry->read(entry->ptr, file)) {
 				LOG(Log_Config, LevelError, "Config read function failed");
-				success = false;
-				break;
+				return false;
 			}
 		}
 		entry = entry->next;
 	}
-	File::Close();
+	return true;
+}
+
+bool Config::Store(const char* filename) {
+	File::Handle file;
+	if (file.Open(filename, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) {
+		LOG(Log_Config, LevelError, "Failed to\ncreate file");
+		return false;
+	}
+	return writeModules(file);
+}
+
+bool Config::Load(const char* filename) {
+	File::Handle file;
+	if (file.Open(filename, FA_READ | FA_OPEN_EXISTING) != FR_OK) {
+		LOG(Log_Config, LevelError, "Failed to\nopen file");
+		return false;
+	}
+	// every module looks up its entries in the index instead of rescanning
+	uint32_t start = getRunTimeCounterValue();
+	if (file.BuildIndex() != FR_OK) {
+		LOG(Log_Config, LevelWarn, "Unable to index config, scanning instead");
+	}
+	bool success = readModules(file);
+	LOG(Log_Config, LevelInfo, "Loaded %s in %luus", filename,
+			getRunTimeCounterValue() - start);
+	return success;
+}
+
+using SnapshotHeader = struct snapshotHeader {
+	uint32_t magic;
+	uint16_t version;
+	// bytes of parameter records following the header
+	uint16_t length;
+	// incremented with every store, the higher one of both pages is newer
+	uint32_t sequence;
+	// CRC32 of the records
+	uint32_t crc;
+};
+
+static constexpr uint32_t SnapshotMagic = 0x47464E43;	// "CNFG"
+// has to change with the record format, not with the modules
+static constexpr uint16_t SnapshotVersion = 1;
+// last two pages, excluded from the program area in the linker script
+static constexpr uint32_t SnapshotPages[2] = {
+		FLASH_BANK1_END + 1 - 2 * FLASH_PAGE_SIZE,
+		FLASH_BANK1_END + 1 - FLASH_PAGE_SIZE };
+static constexpr uint16_t SnapshotSize = FLASH_PAGE_SIZE
+		- sizeof(SnapshotHeader);
+
+static uint32_t crc32(const uint8_t *data, uint16_t len) {
+	uint32_t crc = 0xFFFFFFFF;
+	while (len--) {
+		crc ^= *data++;
+		for (uint8_t i = 0; i < 8; i++) {
+			crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+		}
+	}
+	return ~crc;
+}
+
+static const SnapshotHeader* validSnapshot(uint8_t page) {
+	auto h = (const SnapshotHeader*) SnapshotPages[page];
+	if (h->magic != SnapshotMagic || h->version != SnapshotVersion
+			|| h->length > SnapshotSize) {
+		return nullptr;
+	}
+	if (crc32((const uint8_t*) &h[1], h->length) != h->crc) {
+		return nullptr;
+	}
+	return h;
+}
+
+// Page of the newest valid snapshot, -1 if there is none
+static int8_t newestSnapshot() {
+	auto a = validSnapshot(0);
+	auto b = validSnapshot(1);
+	if (a && (!b || (int32_t) (a->sequence - b->sequence) > 0)) {
+		return 0;
+	}
+	return b ? 1 : -1;
+}
+
+// Flash operations stall the CPU while they run (~20ms for the erase)
+static bool programPage(uint8_t page, const SnapshotHeader &h,
+		const uint8_t *data) {
+	uint32_t address = SnapshotPages[page];
+	HAL_FLASH_Unlock();
+	FLASH_EraseInitTypeDef erase;
+	erase.TypeErase = FLASH_TYPEERASE_PAGES;
+	erase.Banks = FLASH_BANK_1;
+	erase.PageAddress = address;
+	erase.NbPages = 1;
+	uint32_t pageError;
+	bool ok = HAL_FLASHEx_Erase(&erase, &pageError) == HAL_OK;
+	for (uint16_t i = 0; ok && i < h.length; i += 2) {
+		uint16_t half = data[i];
+		half |= (i + 1 < h.length ? data[i + 1] : 0xFF) << 8;
+		ok = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD,
+				address + sizeof(h) + i, half) == HAL_OK;
+	}
+	// header last and magic at the very end, the page only becomes valid
+	// once everything else is in place
+	auto halfs = (const uint16_t*) &h;
+	for (int8_t i = sizeof(h) / 2 - 1; ok && i >= 0; i--) {
+		ok = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address + 2 * i,
+				halfs[i]) == HAL_OK;
+	}
+	HAL_FLASH_Lock();
+	return ok && validSnapshot(page);
+}
+
+// Both pages, loading falls back to the config file
+static bool eraseSnapshots() {
+	HAL_FLASH_Unlock();
+	FLASH_EraseInitTypeDef erase;
+	erase.TypeErase = FLASH_TYPEERASE_PAGES;
+	erase.Banks = FLASH_BANK_1;
+	erase.PageAddress = SnapshotPages[0];
+	erase.NbPages = 2;
+	uint32_t pageError;
+	bool ok = HAL_FLASHEx_Erase(&erase, &pageError) == HAL_OK;
+	HAL_FLASH_Lock();
+	return ok;
+}
+
+bool Config::StoreSnapshot() {
+	auto data = (uint8_t*) pvPortMalloc(SnapshotSize);
+	if (!data) {
+		return false;
+	}
+	File::Handle file;
+	file.CreateBuffer(data, SnapshotSize);
+	bool success = writeModules(file);
+	if (file.BufferOverflow()) {
+		LOG(Log_Config, LevelError, "Config exceeds snapshot size");
+		success = false;
+	}
+	if (file.BufferCollision()) {
+		// an older snapshot would not reflect the current config either
+		LOG(Log_Config, LevelError, "Config keys collide, dropping snapshots");
+		if (newestSnapshot() >= 0 && !eraseSnapshots()) {
+			LOG(Log_Config, LevelError, "Failed to erase snapshots");
+		}
+		success = false;
+	}
+	if (success) {
+		// overwrite the older page, keeps the newest snapshot until done
+		int8_t newest = newestSnapshot();
+		SnapshotHeader h;
+		h.magic = SnapshotMagic;
+		h.version = SnapshotVersion;
+		h.length = file.BufferUsed();
+		h.sequence =
+				newest >= 0 ? validSnapshot(newest)->sequence + 1 : 0;
+		h.crc = crc32(data, h.length);
+		uint8_t page = newest == 0 ? 1 : 0;
+		success = programPage(page, h, data);
+		if (success) {
+			LOG(Log_Config, LevelInfo, "Stored snapshot %lu (%d bytes) in page %d",
+					h.sequence, h.length, page);
+		} else {
+			LOG(Log_Config, LevelError, "Failed to program snapshot page %d",
+					page);
+		}
+	}
+	vPortFree(data);
+	return success;
+}
+
+bool Config::OpenSnapshot(File::Handle &file) {
+	int8_t newest = newestSnapshot();
+	if (newest < 0) {
+		return false;
+	}
+	auto h = validSnapshot(newest);
+	// records are read directly from flash
+	file.OpenBuffer((const uint8_t*) &h[1], h->length);
+	return true;
+}
+
+bool Config::LoadSnapshot() {
+	uint32_t start = getRunTimeCounterValue();
+	File::Handle file;
+	if (!OpenSnapshot(file)) {
+		LOG(Log_Config, LevelWarn, "No valid config snapshot");
+		return false;
+	}
+	bool success = readModules(file);
+	LOG(Log_Config, LevelInfo, "Loaded snapshot (%d bytes) in %luus",
+			file.BufferUsed(), getRunTimeCounterValue() - start);
 	return success;
 }
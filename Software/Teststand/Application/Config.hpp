@@ -5,14 +5,23 @@
 
 namespace Config {
 
-using WriteFunc = bool (*)(void *ptr);
-using ReadFunc = bool (*)(void *ptr);
+using WriteFunc = bool (*)(void *ptr, File::Handle &file);
+using ReadFunc = bool (*)(void *ptr, File::Handle &file);
 
 void Init();
 int AddParseFunctions(WriteFunc write, ReadFunc read, void *ptr);
 bool RemoveParseFunctions(int index);
 
+// Text configuration on the SD card, for import/export
 bool Store(const char *filename);
 bool Load(const char *filename);
 
+// Binary snapshot of all modules in internal flash, available without SD card.
+// Two pages are written alternately, an interrupted store leaves the previous
+// snapshot intact
+bool StoreSnapshot();
+bool LoadSnapshot();
+// Opens the newest valid snapshot for reading single parameters
+bool OpenSnapshot(File::Handle &file);
+
 }
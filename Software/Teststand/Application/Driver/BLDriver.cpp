@@ -136,24 +136,24 @@ void BLDriver::Task() {
 	vTaskDelete(nullptr);
 }
 
-bool BLDriver::WriteConfig() {
-	File::Write("# BL driver settings\n");
+bool BLDriver::WriteConfig(File::Handle &file) {
+	file.Write("# BL driver settings\n");
 	const File::Entry entries[] = {
 		{ "Driver::BLDriver::Address", &i2cAddress, File::PointerType::INT32},
 		{ "Driver::BLDriver::vCutoff", &vCutoff, File::PointerType::INT32},
 		{ "Driver::BLDriver::UpdatePeriod", &updatePeriod, File::PointerType::INT32},
 	};
-	File::WriteParameters(entries, 3);
+	file.WriteParameters(entries, 3);
 	return true;
 }
 
-bool BLDriver::ReadConfig() {
+bool BLDriver::ReadConfig(File::Handle &file) {
 	const File::Entry entries[] = {
 		{ "Driver::BLDriver::Address", &i2cAddress, File::PointerType::INT32},
 		{ "Driver::BLDriver::vCutoff", &vCutoff, File::PointerType::INT32},
 		{ "Driver::BLDriver::UpdatePeriod", &updatePeriod, File::PointerType::INT32},
 	};
-	File::ReadParameters(entries, 3);
+	file.ReadParameters(entries, 3);
 	communicationOK = false;
 	running = false;
 	setValue = 0;
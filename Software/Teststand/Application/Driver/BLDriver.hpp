@@ -5,6 +5,7 @@
 #include "task.h"
 #include "stm32f1xx.h"
 #include "gui.hpp"
+#include "file.hpp"
 
 class BLDriver : public Driver {
 public:
@@ -16,8 +17,8 @@ public:
 	Readback GetData() override;
 private:
 	void Task();
-	bool WriteConfig();
-	bool ReadConfig();
+	bool WriteConfig(File::Handle &file);
+	bool ReadConfig(File::Handle &file);
 
 	enum class DriverMode : uint8_t {
 			Off,
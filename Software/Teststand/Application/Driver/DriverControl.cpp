@@ -7,6 +7,8 @@
 #include "log.h"
 #include "gui.hpp"
 #include "file.hpp"
+#include "Logger.hpp"
+#include "BinaryLog.hpp"
 #include "Config.hpp"
 #include "progress.hpp"
 #include "Loadcells.hpp"
@@ -45,26 +47,57 @@ using RampSettings = struct {
 	int32_t steps;
 	int32_t length;
 	char filename[15];
+	// binary log instead of CSV
+	bool binary;
 };
 
 static DriverSettings *settings;
 static RampSettings *ramp;
 
-static bool WriteConfig(void *ptr) {
+// columns of the binary ramp log, same order as the CSV columns
+static const BinaryLog::Channel rampChannels[] = {
+		{ "Step", "", 1.0f },
+		{ "Time", "ms", 1.0f },
+		{ "SampleTime", "us", 1.0f },
+		{ "Setpoint", "", 1.0f },
+		{ "Force", "N", 1e-6f },
+		{ "Torque", "Nm", 1e-6f },
+		{ "ForceStdDev", "N", 1e-6f },
+		{ "ForcePP", "N", 1e-6f },
+		{ "TorqueStdDev", "Nm", 1e-6f },
+		{ "TorquePP", "Nm", 1e-6f },
+};
+static const BinaryLog::Channel readbackChannels[] = {
+		{ "DriverRPM", "", 1.0f },
+		{ "DriverI", "A", 1e-6f },
+		{ "DriverV", "V", 1e-6f },
+		{ "DriverForce", "N", 1e-6f },
+};
+
+// replaces the file extension according to the selected log format
+static void setExtension() {
+	auto c = strchr(ramp->filename, '.');
+	if (c) {
+		*c = 0;
+	}
+	strcat(ramp->filename, ramp->binary ? ".bin" : ".csv");
+}
+
+static bool WriteConfig(void *ptr, File::Handle &file) {
 	if (!settings) {
 		return false;
 	}
-	File::Write("# Driver configuration\n");
+	file.Write("# Driver configuration\n");
 	const File::Entry entries[] = {
 		{ "Driver::Driver", (void*) drivers[settings->driver], File::PointerType::STRING},
 		{ "Driver::ControlMode", &settings->control, File::PointerType::INT8},
 		{ "Driver::Setpoint", &settings->setpoint, File::PointerType::INT32},
 	};
-	File::WriteParameters(entries, 3);
+	file.WriteParameters(entries, 3);
 	return true;
 }
 
-static bool ReadConfig(void *ptr) {
+static bool ReadConfig(void *ptr, File::Handle &file) {
 	if (!settings) {
 		return false;
 	}
@@ -74,7 +107,7 @@ static bool ReadConfig(void *ptr) {
 		{ "Driver::ControlMode", &settings->control, File::PointerType::INT8},
 		{ "Driver::Setpoint", &settings->setpoint, File::PointerType::INT32},
 	};
-	File::ReadParameters(entries, 3);
+	file.ReadParameters(entries, 3);
 	uint8_t driverNum = 0;
 	while (drivers[driverNum]) {
 		if (!strcmp(driverName, drivers[driverNum])) {
@@ -165,12 +198,18 @@ static void ConfigureRamp(void) {
 				[](void *ptr, Dialog::Result r){
 			Label *l = (Label*) ptr;
 			// reattach fileextension
-			strcat(ramp->filename, ".csv");
+			setExtension();
 			if(r == Dialog::Result::OK) {
 				l->setText(ramp->filename);
 			}
 		}, ptr);
 	}, lname), COORDS(20, 140));
+	c->attach(new Label("Binary:", Font_Big), COORDS(150, 145));
+	c->attach(new Checkbox(&ramp->binary, [](void *ptr, Widget *w) {
+		Label *l = (Label*) ptr;
+		setExtension();
+		l->setText(ramp->filename);
+	}, lname), COORDS(230, 140));
 
 	w->setMainWidget(c);
 }
@@ -191,19 +230,33 @@ static void RunRamp(Driver *driver) {
 	w->setMainWidget(c);
 
 	// check for already existing file
-	if (File::Open(ramp->filename, FA_OPEN_EXISTING) == FR_OK) {
+	File::Handle existing;
+	if (existing.Open(ramp->filename, FA_OPEN_EXISTING) == FR_OK) {
+		existing.Close();
 		if(Dialog::MessageBox("Warning", Font_Big,
 				"File already\nexists. Overwrite?", Dialog::MsgBox::ABORT_OK,
 				nullptr, true) == Dialog::Result::ABORT) {
 			// abort
 			delete w;
 			return;
-		} else {
-			File::Close();
 		}
 	}
 
-	if (File::Open(ramp->filename, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK) {
+	// allocate the whole log up front, avoids FAT updates during the ramp
+	uint32_t expectedSize;
+	if (ramp->binary) {
+		expectedSize = sizeof(BinaryLog::Header)
+				+ BinaryLog::MaxChannels * sizeof(BinaryLog::Channel)
+				+ sizeof(uint16_t)
+				+ ramp->steps * BinaryLog::RecordSize(BinaryLog::MaxChannels)
+				+ (ramp->steps / BinaryLog::SyncInterval + 1)
+						* sizeof(BinaryLog::Sync);
+	} else {
+		// typical row length with all readbacks, longer logs grow the file
+		constexpr uint16_t csvRowSize = 128;
+		expectedSize = (ramp->steps + 1) * csvRowSize;
+	}
+	if (Logger::Open(ramp->filename, expectedSize) != FR_OK) {
 		// failed to create file
 		Dialog::MessageBox("Error", Font_Big, "Failed to\ncreate file",
 				Dialog::MsgBox::OK, nullptr, true);
@@ -211,31 +264,56 @@ static void RunRamp(Driver *driver) {
 		return;
 	}
 
-	File::Write("Step;Time[ms];Setpoint;Force[N];Torque[Nm]");
+	// rows only go to RAM here, the logger task writes them to the card
 	auto features = driver->GetFeatures();
-	if (features.Readback.RPM) {
-		File::Write(";DriverRPM");
-	}
-	if (features.Readback.Current) {
-		File::Write(";DriverI[A]");
-	}
-	if (features.Readback.Voltage) {
-		File::Write(";DriverV[V]");
-	}
-	if (features.Readback.Thrust) {
-		File::Write(";DriverForce[N]");
+	BinaryLog::Writer binLog;
+	if (ramp->binary) {
+		BinaryLog::Channel channels[BinaryLog::MaxChannels];
+		uint8_t n = 0;
+		for (auto &ch : rampChannels) {
+			channels[n++] = ch;
+		}
+		uint8_t flags = 0;
+		const bool readback[] = { features.Readback.RPM,
+				features.Readback.Current, features.Readback.Voltage,
+				features.Readback.Thrust };
+		for (uint8_t j = 0; j < 4; j++) {
+			if (readback[j]) {
+				channels[n++] = readbackChannels[j];
+				flags |= 1 << j;
+			}
+		}
+		binLog.Begin(channels, n, flags);
+	} else {
+		Logger::Write("Step;Time[ms];SampleTime[us];Setpoint;Force[N];Torque[Nm]"
+				";ForceStdDev[N];ForcePP[N];TorqueStdDev[Nm];TorquePP[Nm]");
+		if (features.Readback.RPM) {
+			Logger::Write(";DriverRPM");
+		}
+		if (features.Readback.Current) {
+			Logger::Write(";DriverI[A]");
+		}
+		if (features.Readback.Voltage) {
+			Logger::Write(";DriverV[V]");
+		}
+		if (features.Readback.Thrust) {
+			Logger::Write(";DriverForce[N]");
+		}
+		Logger::Write("\n");
 	}
-	File::Write("\n");
 
 	l->setText("Starting motor...");
 	driver->SetRunning(true);
 	driver->SetControl(settings->control, ramp->start);
 	int32_t i = 0;
 	// clear average
-	Loadcells::Get();
+	Loadcells::Reader loadcells;
+	constexpr uint32_t statsInterval = 10;
+	log_reset_stats();
 	if (!xTaskNotifyWait(0, 0xFFFFFFFF, nullptr, 2000)) {
 		// not aborted
 		uint32_t start = HAL_GetTick();
+		uint32_t startUs = getRunTimeCounterValue();
 		for (i = 0; i < ramp->steps; i++) {
 			char str[200];
 			snprintf(str, sizeof(str), "Step %ld/%ld", i + 1, ramp->steps);
@@ -255,45 +333,113 @@ static void RunRamp(Driver *driver) {
 			}
 			LOG(Log_App, LevelInfo, "now: %lu, next: %lu, wait: %lu", now, time_next,
 					wait);
-			if (xTaskNotifyWait(0, 0xFFFFFFFF, nullptr, wait)) {
-				// abort button pressed
+			bool aborted = false;
+			while (1) {
+				// feed all samples into the statistics while waiting, the
+				// sample buffer only covers a few ms at high rates
+				Loadcells::Sample sample;
+				while (loadcells.Read(sample))
+					;
+				wait = time_next - HAL_GetTick();
+				if (wait == 0 || wait > INT32_MAX) {
+					break;
+				}
+				if (wait > statsInterval) {
+					wait = statsInterval;
+				}
+				if (xTaskNotifyWait(0, 0xFFFFFFFF, nullptr, wait)) {
+					// abort button pressed
+					aborted = true;
+					break;
+				}
+			}
+			if (aborted) {
 				break;
 			}
 			// save measurement of this step to file
-			auto meas = Loadcells::Get();
+			Loadcells::Meas meas;
+			// time when the newest sample of this step was taken
+			uint32_t sampleTime = startUs;
+			loadcells.Average(meas, &sampleTime);
+			auto &stats = loadcells.Stats();
 			auto driverData = driver->GetData();
+			if (ramp->binary) {
+				// no float formatting, values in their integer units
+				int32_t values[BinaryLog::MaxChannels] = { i + 1,
+						(int32_t) (time_next - start),
+						(int32_t) (sampleTime - startUs), val, meas.force,
+						meas.torque, (int32_t) stats.force.StdDev(),
+						stats.force.PeakToPeak(),
+						(int32_t) stats.torque.StdDev(),
+						stats.torque.PeakToPeak() };
+				uint8_t n = sizeof(rampChannels) / sizeof(rampChannels[0]);
+				if (features.Readback.RPM) {
+					values[n++] = driverData.RPM;
+				}
+				if (features.Readback.Current) {
+					values[n++] = driverData.current;
+				}
+				if (features.Readback.Voltage) {
+					values[n++] = driverData.voltage;
+				}
+				if (features.Readback.Thrust) {
+					values[n++] = driverData.thrust;
+				}
+				loadcells.ResetStats();
+				if (!binLog.Record(values)) {
+					LOG(Log_App, LevelWarn, "Dropped record of step %ld", i + 1);
+				}
+				continue;
+			}
 			float force = (float) meas.force / 1000000;
 			float torque = (float) meas.torque / 1000000;
-			snprintf(str, sizeof(str), "%ld;%lu;%ld;%f;%f", i + 1,
-					time_next - start, val, force, torque);
-			File::Write(str);
+			// whole row as one record, it is either logged or dropped
+			char row[256];
+			uint16_t pos = snprintf(row, sizeof(row),
+					"%ld;%lu;%lu;%ld;%f;%f;%f;%f;%f;%f",
+					i + 1, time_next - start, sampleTime - startUs, val, force,
+					torque,
+					(float) stats.force.StdDev() / 1000000,
+					(float) stats.force.PeakToPeak() / 1000000,
+					(float) stats.torque.StdDev() / 1000000,
+					(float) stats.torque.PeakToPeak() / 1000000);
+			loadcells.ResetStats();
 			if (features.Readback.RPM) {
-				snprintf(str, sizeof(str), ";%ld", driverData.RPM);
-				File::Write(str);
+				pos += snprintf(&row[pos], sizeof(row) - pos, ";%ld",
+						driverData.RPM);
 			}
 			if (features.Readback.Current) {
-				snprintf(str, sizeof(str), ";%f",
+				pos += snprintf(&row[pos], sizeof(row) - pos, ";%f",
 						(float) driverData.current / 1000000);
-				File::Write(str);
 			}
 			if (features.Readback.Voltage) {
-				snprintf(str, sizeof(str), ";%f",
+				pos += snprintf(&row[pos], sizeof(row) - pos, ";%f",
 						(float) driverData.voltage / 1000000);
-				File::Write(str);
 			}
 			if (features.Readback.Thrust) {
-				snprintf(str, sizeof(str), ";%f",
+				pos += snprintf(&row[pos], sizeof(row) - pos, ";%f",
 						(float) driverData.thrust / 1000000);
-				File::Write(str);
 			}
-			File::Write("\n");
+			snprintf(&row[pos], sizeof(row) - pos, "\n");
+			if (!Logger::Write(row)) {
+				LOG(Log_App, LevelWarn, "Dropped row of step %ld", i + 1);
+			}
 		}
 	}
 
 	driver->SetRunning(false);
 	driver->SetControl(settings->control, 0);
 
-	File::Close();
+	Logger::Close();
+
+	// cost of the LOG calls made by the ramp (CPU cycles per call)
+	log_stats_t logStats;
+	log_get_stats(&logStats);
+	if (logStats.calls) {
+		LOG(Log_App, LevelInfo, "%lu log calls: avg %lu, max %lu cycles, %lu dropped",
+				logStats.calls, logStats.cycles / logStats.calls,
+				logStats.maxCycles, logStats.dropped);
+	}
 
 	if(i != ramp->steps) {
 		// ramp was aborted
@@ -318,6 +464,7 @@ void DriverControl::Task(void* a) {
 	ramp->length = 10000000;
 	ramp->steps = 100;
 	strcpy(ramp->filename, "ramp.csv");
+	ramp->binary = false;
 
 	auto c = new Container(COORDS(280, 240));
 
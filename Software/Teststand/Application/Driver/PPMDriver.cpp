@@ -168,26 +168,26 @@ void TIM_HANDLER(void) {
 }
 }
 
-bool PPMDriver::WriteConfig() {
-	File::Write("# PPM driver settings\n");
+bool PPMDriver::WriteConfig(File::Handle &file) {
+	file.Write("# PPM driver settings\n");
 	const File::Entry entries[] = {
 		{ "Driver::PPM::WidthMin", &widthMin, File::PointerType::INT32},
 		{ "Driver::PPM::WidthCutoff", &widthCutoff, File::PointerType::INT32},
 		{ "Driver::PPM::WidthMax", &widthMax, File::PointerType::INT32},
 		{ "Driver::PPM::UpdatePeriod", &updatePeriod, File::PointerType::INT32},
 	};
-	File::WriteParameters(entries, 4);
+	file.WriteParameters(entries, 4);
 	return true;
 }
 
-bool PPMDriver::ReadConfig() {
+bool PPMDriver::ReadConfig(File::Handle &file) {
 	const File::Entry entries[] = {
 		{ "Driver::PPM::WidthMin", &widthMin, File::PointerType::INT32},
 		{ "Driver::PPM::WidthCutoff", &widthCutoff, File::PointerType::INT32},
 		{ "Driver::PPM::WidthMax", &widthMax, File::PointerType::INT32},
 		{ "Driver::PPM::UpdatePeriod", &updatePeriod, File::PointerType::INT32},
 	};
-	File::ReadParameters(entries, 4);
+	file.ReadParameters(entries, 4);
 	setValue = 0;
 	UpdatePPM();
 	topWidget->requestRedrawFull();
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "driver.hpp"
+#include "file.hpp"
 
 class PPMDriver : public Driver {
 public:
@@ -12,8 +13,8 @@ public:
 	Readback GetData() override;
 private:
 	void UpdatePPM(Widget* = nullptr);
-	bool WriteConfig();
-	bool ReadConfig();
+	bool WriteConfig(File::Handle &file);
+	bool ReadConfig(File::Handle &file);
 	static constexpr uint16_t widthOffDefault = 800;
 	static constexpr uint16_t widthMinDefault = 900;
 	static constexpr uint16_t widthMaxDefault = 2200;
@@ -0,0 +1,248 @@
+#include "Filter.hpp"
+
+#include <cmath>
+#include "log.h"
+
+static int32_t pool[Filter::PoolSize] __attribute__((aligned(8)));
+static uint16_t poolUsed;
+
+static constexpr uint8_t CICStages = 3;
+static constexpr double pi = 3.14159265358979;
+static constexpr double sqrt2 = 1.41421356237310;
+// fractional bits of the IIR coefficients and state
+static constexpr uint8_t IIR1CoeffShift = 24;
+static constexpr uint8_t IIR1StateShift = 7;
+static constexpr uint8_t IIR2CoeffShift = 28;
+static constexpr uint8_t IIR2StateShift = 6;
+
+static int32_t* allocate(uint16_t words) {
+	// keep 64 bit alignment for the CIC registers
+	uint16_t start = (poolUsed + 1) & ~1;
+	if (start + words > Filter::PoolSize) {
+		return nullptr;
+	}
+	poolUsed = start + words;
+	return &pool[start];
+}
+
+void Filter::FreeAll() {
+	poolUsed = 0;
+}
+
+bool Filter::Setup(Channel &c, const Settings &s) {
+	c.type = Type::None;
+	c.primed = false;
+	c.pos = 0;
+	c.sum = 0;
+	c.buf = nullptr;
+	uint16_t words = 0;
+	int16_t length = s.length;
+	switch (s.type) {
+	case Type::None:
+		return true;
+	case Type::MovingAverage:
+		if (length < 1 || length > MaxMovingAverage) {
+			goto invalid;
+		}
+		words = length;
+		break;
+	case Type::CIC:
+		if (length < 1 || length > MaxCICDecimation) {
+			goto invalid;
+		}
+		// integrator and comb registers, 64 bit each
+		words = 4 * CICStages;
+		// gain of the CIC is R^N
+		c.coeff[0] = length * length * length;
+		break;
+	case Type::IIR1: {
+		if (length < MinIIRLength || length > MaxIIRLength) {
+			goto invalid;
+		}
+		// y += (x - y) * alpha
+		float alpha = 1.0f - expf(-2 * (float) pi / length);
+		c.coeff[0] = lroundf(alpha * (1UL << IIR1CoeffShift));
+	}
+		break;
+	case Type::IIR2: {
+		if (length < MinIIRLength || length > MaxIIRLength) {
+			goto invalid;
+		}
+		// butterworth low-pass from bilinear transform. Double precision
+		// because 1 + a1 + a2 gets tiny for low cutoff frequencies
+		double K = tan(pi / length);
+		double norm = 1.0 / (1.0 + sqrt2 * K + K * K);
+		double b0 = K * K * norm;
+		double a1 = 2 * (K * K - 1) * norm;
+		c.coeff[0] = lround(b0 * (1UL << IIR2CoeffShift));
+		c.coeff[1] = lround(a1 * (1UL << IIR2CoeffShift));
+		// derive a2 from the quantized coefficients for exactly unity DC gain
+		c.coeff[2] = 4 * c.coeff[0] - (1L << IIR2CoeffShift) - c.coeff[1];
+		// x[n-1], x[n-2], y[n-1], y[n-2]
+		words = 4;
+	}
+		break;
+	case Type::Median:
+		if (length < 1 || length > MaxMedian) {
+			goto invalid;
+		}
+		// use odd length to always have a middle element
+		length |= 0x01;
+		words = length;
+		break;
+	default:
+		goto invalid;
+	}
+	if (words) {
+		c.buf = allocate(words);
+		if (!c.buf) {
+			LOG(Log_Loadcell, LevelError, "Filter pool exhausted");
+			return false;
+		}
+	}
+	c.type = s.type;
+	c.length = length;
+	return true;
+invalid:
+	LOG(Log_Loadcell, LevelWarn, "Invalid filter %d with length %d",
+			(int) s.type, s.length);
+	return false;
+}
+
+void Filter::Restart(Channel &c) {
+	c.primed = false;
+	c.pos = 0;
+}
+
+static void prime(Filter::Channel &c, int32_t value) {
+	using namespace Filter;
+	switch (c.type) {
+	case Type::MovingAverage:
+		for (uint16_t i = 0; i < c.length; i++) {
+			c.buf[i] = value;
+		}
+		c.sum = value * c.length;
+		break;
+	case Type::Median:
+		for (uint16_t i = 0; i < c.length; i++) {
+			c.buf[i] = value;
+		}
+		break;
+	case Type::CIC:
+		for (uint8_t i = 0; i < 4 * CICStages; i++) {
+			c.buf[i] = 0;
+		}
+		// the first outputs are only the step response from zero
+		c.coeff[1] = CICStages;
+		break;
+	case Type::IIR1:
+		c.sum = value << IIR1StateShift;
+		// rounding remainder
+		c.coeff[1] = 0;
+		break;
+	case Type::IIR2:
+		c.buf[0] = c.buf[1] = value;
+		c.buf[2] = c.buf[3] = value << IIR2StateShift;
+		// rounding remainder
+		c.coeff[3] = 0;
+		break;
+	default:
+		break;
+	}
+	c.primed = true;
+}
+
+bool Filter::Process(Channel &c, int32_t &value) {
+	if (c.type == Type::None) {
+		return true;
+	}
+	if (!c.primed) {
+		prime(c, value);
+	}
+	switch (c.type) {
+	case Type::MovingAverage:
+		c.sum += value - c.buf[c.pos];
+		c.buf[c.pos] = value;
+		if (++c.pos >= c.length) {
+			c.pos = 0;
+		}
+		value = c.sum / c.length;
+		break;
+	case Type::Median: {
+		c.buf[c.pos] = value;
+		if (++c.pos >= c.length) {
+			c.pos = 0;
+		}
+		// insertion sort of a copy, length is small
+		int32_t sorted[MaxMedian];
+		for (uint8_t i = 0; i < c.length; i++) {
+			int32_t v = c.buf[i];
+			uint8_t j = i;
+			for (; j > 0 && sorted[j - 1] > v; j--) {
+				sorted[j] = sorted[j - 1];
+			}
+			sorted[j] = v;
+		}
+		value = sorted[c.length / 2];
+	}
+		break;
+	case Type::CIC: {
+		// unsigned arithmetic, wrap around in the integrators is intended
+		uint64_t *integrator = (uint64_t*) c.buf;
+		uint64_t *comb = integrator + CICStages;
+		uint64_t v = (int64_t) value;
+		for (uint8_t i = 0; i < CICStages; i++) {
+			integrator[i] += v;
+			v = integrator[i];
+		}
+		if (++c.pos < c.length) {
+			return false;
+		}
+		c.pos = 0;
+		for (uint8_t i = 0; i < CICStages; i++) {
+			uint64_t prev = comb[i];
+			comb[i] = v;
+			v -= prev;
+		}
+		if (c.coeff[1]) {
+			c.coeff[1]--;
+			return false;
+		}
+		// only once per decimated output
+		value = (int64_t) v / c.coeff[0];
+	}
+		break;
+	case Type::IIR1: {
+		int64_t diff = ((int64_t) value << IIR1StateShift) - c.sum;
+		// the remainder is carried to the next sample, a truncated step
+		// would stop (x - y) * alpha short of the input
+		int64_t step = diff * c.coeff[0] + c.coeff[1];
+		c.sum += step >> IIR1CoeffShift;
+		c.coeff[1] = step & ((1L << IIR1CoeffShift) - 1);
+		value = (c.sum + (1 << (IIR1StateShift - 1))) >> IIR1StateShift;
+	}
+		break;
+	case Type::IIR2: {
+		int32_t *x = c.buf;
+		int32_t *y = &c.buf[2];
+		int64_t acc = ((int64_t) value + 2 * (int64_t) x[0] + x[1]) * c.coeff[0];
+		acc <<= IIR2StateShift;
+		acc -= (int64_t) y[0] * c.coeff[1];
+		acc -= (int64_t) y[1] * c.coeff[2];
+		// carry the rounding error to the next sample, otherwise the output
+		// gets stuck up to 1 / (8 * b0) state LSBs from the input
+		acc += c.coeff[3];
+		int32_t out = (acc + (1LL << (IIR2CoeffShift - 1))) >> IIR2CoeffShift;
+		c.coeff[3] = acc - ((int64_t) out << IIR2CoeffShift);
+		x[1] = x[0];
+		x[0] = value;
+		y[1] = y[0];
+		y[0] = out;
+		value = (out + (1 << (IIR2StateShift - 1))) >> IIR2StateShift;
+	}
+		break;
+	default:
+		break;
+	}
+	return true;
+}
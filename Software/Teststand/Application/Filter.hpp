@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdint>
+
+// Fixed point filters for the loadcell pipeline. Filter state lives in a
+// static pool which is handed out by Setup() and released by FreeAll().
+namespace Filter {
+
+enum class Type : uint8_t {
+	None = 0,
+	MovingAverage = 1,	// length: number of taps
+	CIC = 2,			// length: decimation factor, 3 stages
+	IIR1 = 3,			// length: sample rate / cutoff frequency
+	IIR2 = 4,			// length: sample rate / cutoff frequency, butterworth
+	Median = 5,			// length: number of taps, odd
+};
+
+constexpr uint16_t MaxMovingAverage = 128;
+constexpr uint16_t MaxCICDecimation = 1024;
+constexpr uint16_t MinIIRLength = 3;
+constexpr uint16_t MaxIIRLength = 1000;
+constexpr uint16_t MaxMedian = 15;
+
+// Pool size in 32 bit words, shared by all channels
+constexpr uint16_t PoolSize = 256;
+
+using Settings = struct settings {
+	Type type;
+	int16_t length;
+};
+
+using Channel = struct channel {
+	Type type;
+	bool primed;
+	uint16_t length;
+	uint16_t pos;
+	int32_t *buf;
+	int32_t sum;
+	// coefficients, the remaining ones hold small state (CIC priming count,
+	// IIR rounding remainder)
+	int32_t coeff[5];
+};
+
+// releases all filter memory, call before setting up the channels again
+void FreeAll();
+// prepares a channel, falls back to Type::None if settings are invalid or
+// the pool is exhausted
+bool Setup(Channel &c, const Settings &s);
+// restarts the filter from the next input, keeps the settings
+void Restart(Channel &c);
+// filters value in place. Returns false if there is no new output for this
+// input (decimating filters)
+bool Process(Channel &c, int32_t &value);
+
+}
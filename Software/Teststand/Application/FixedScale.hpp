@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+
+// Fixed point version of value * scale for the loadcell pipeline, the M3 has
+// no FPU. A float scale is converted once into a multiplier with 30
+// significant bits and a shift: result = (value * mul) >> shift, rounded to
+// nearest. Header only, so the host tests can check the kernel as is.
+namespace FixedScale {
+
+using Factor = struct factor {
+	int32_t mul;
+	uint8_t shift;
+};
+
+static inline Factor FromFloat(float scale) {
+	// scale = m * 2^e with 0.5 <= |m| < 1
+	int e;
+	float m = std::frexp(scale, &e);
+	int32_t mul = lroundf(m * (1UL << 30));
+	int shift = 30 - e;
+	if (shift < 0) {
+		// scale too large, saturate
+		mul = m < 0 ? -INT32_MAX : INT32_MAX;
+		shift = 0;
+	} else if (shift > 62) {
+		// scale very small, drop precision
+		mul = shift - 62 < 31 ? mul >> (shift - 62) : 0;
+		shift = 62;
+	}
+	return { mul, (uint8_t) shift };
+}
+
+static inline int32_t Apply(int32_t value, int32_t mul, uint8_t shift) {
+	int64_t prod = (int64_t) value * mul;
+	if (shift) {
+		// round to nearest
+		prod += (int64_t) 1 << (shift - 1);
+	}
+	return prod >> shift;
+}
+
+}
@@ -14,8 +14,8 @@ Desktop::Desktop() {
 	size.y = DISPLAY_HEIGHT;
 
 	configIndex = Config::AddParseFunctions(
-			pmf_cast<bool (*)(void*), Desktop, &Desktop::WriteConfig>::cfn,
-			pmf_cast<bool (*)(void*), Desktop, &Desktop::ReadConfig>::cfn,
+			pmf_cast<Config::WriteFunc, Desktop, &Desktop::WriteConfig>::cfn,
+			pmf_cast<Config::ReadFunc, Desktop, &Desktop::ReadConfig>::cfn,
 			this);
 }
 
@@ -200,27 +200,27 @@ void Desktop::drawChildren(coords_t offset) {
 	}
 }
 
-bool Desktop::WriteConfig() {
-	File::Write("# Apps configuration\n");
+bool Desktop::WriteConfig(File::Handle &file) {
+	file.Write("# Apps configuration\n");
 	for (uint8_t i = 0; i < AppCnt; i++) {
 		char name[50] = "App::";
 		strncat(name, apps[i]->info.name, sizeof(name) - 15);
 		strcat(name, "::Running");
 		bool running = apps[i]->state == App::State::Running;
 		File::Entry entry = { name, &running, File::PointerType::BOOL };
-		File::WriteParameters(&entry, 1);
+		file.WriteParameters(&entry, 1);
 	}
 	return true;
 }
 
-bool Desktop::ReadConfig() {
+bool Desktop::ReadConfig(File::Handle &file) {
 	for (uint8_t i = 0; i < AppCnt; i++) {
 		char name[50] = "App::";
 		strncat(name, apps[i]->info.name, sizeof(name) - 15);
 		strcat(name, "::Running");
 		bool running = false;
 		File::Entry entry = { name, &running, File::PointerType::BOOL };
-		File::ReadParameters(&entry, 1);
+		file.ReadParameters(&entry, 1);
 		/*
 		 * Start/stop apps to comply to configuration. Needs to wait for
 		 * the app to actually start/stop because the apps themselves might
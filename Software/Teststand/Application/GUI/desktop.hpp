@@ -6,6 +6,7 @@
 #include "App.hpp"
 #include <array>
 #include "Unit.hpp"
+#include "file.hpp"
 
 class Desktop : public Widget {
 public:
@@ -19,8 +20,8 @@ private:
 	void input(GUIEvent_t *ev) override;
 	void drawChildren(coords_t offset) override;
 
-	bool WriteConfig();
-	bool ReadConfig();
+	bool WriteConfig(File::Handle &file);
+	bool ReadConfig(File::Handle &file);
 
 	Widget::Type getType() override { return Widget::Type::Desktop; };
 
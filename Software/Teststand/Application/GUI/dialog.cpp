@@ -147,11 +147,6 @@ Result FileChooser(const char *title, char *result,
 	}
 
 	/* Find applicable files */
-	if(!xSemaphoreTake(fileAccess, 1000)) {
-		/* failed to allocate fileAccess */
-		return Result::ERR;
-	}
-
 #define MAX_NUMBER_OF_FILES		50
 	char *filenames[MAX_NUMBER_OF_FILES + 1];
 	uint8_t foundFiles = 0;
@@ -211,7 +206,6 @@ Result FileChooser(const char *title, char *result,
 		f_closedir(dj);
 	}
 	vPortFree(dj);
-	xSemaphoreGive(fileAccess);
 	/* Got all matching filenames */
 	/* mark end of filename strings */
 	filenames[foundFiles] = 0;
@@ -3,6 +3,8 @@
 #include "Loadcells.hpp"
 #include "progress.hpp"
 #include "ValueInput.hpp"
+#include "dialog.hpp"
+#include "Calibration.hpp"
 
 #include "log.h"
 #include "LoadcellSetup.hpp"
@@ -19,20 +21,44 @@ enum class Notification : uint32_t {
 	WeightLoadcell,
 	CalLoadcell,
 	NewRate,
+	TestRates,
 };
 
-static int32_t sampleLoadcell(uint8_t cell) {
+static void updateProgress(void *ptr, uint8_t percentage) {
+	((ProgressDialog*) ptr)->SetPercentage(percentage);
+}
+
+static bool sampleLoadcell(uint8_t cell, int32_t &raw) {
+	// takes 100ms at 1000sps, 2s at 50sps
 	constexpr uint16_t samples = 100;
-	constexpr uint32_t deltaT = pdMS_TO_TICKS(20);
 	auto p = new ProgressDialog("Sampling...", 0);
-	int32_t sum = 0;
-	for(uint16_t i=0;i<samples;i++) {
-		sum += Loadcells::cells[cell].raw;
-		p->SetPercentage(i * 100 / samples);
-		vTaskDelay(deltaT);
-	}
+	bool ret = Calibration::Sample(cell, samples, raw, updateProgress, p);
 	delete p;
-	return sum / samples;
+	if (!ret) {
+		Dialog::MessageBox("Error", Font_Big, "No loadcell\nsamples",
+				Dialog::MsgBox::OK, nullptr, true);
+	}
+	return ret;
+}
+
+// calibration points of the current cell, restarted by zeroing
+static Calibration::Point points[Calibration::MaxPoints];
+static uint8_t nPoints;
+static uint8_t pointsCell;
+
+static void addCalibrationPoint(uint8_t cell, int32_t raw, int32_t uNewton) {
+	if (cell != pointsCell) {
+		nPoints = 0;
+		pointsCell = cell;
+	}
+	if (nPoints >= Calibration::MaxPoints) {
+		// drop the oldest point except the zero point
+		memmove(&points[1], &points[2], sizeof(points[0]) * (nPoints - 2));
+		nPoints--;
+	}
+	points[nPoints].raw = raw;
+	points[nPoints].uNewton = uNewton;
+	nPoints++;
 }
 
 void LoadcellSetup::Task(void *a) {
@@ -136,11 +162,23 @@ void LoadcellSetup::Task(void *a) {
 					&Loadcells::invert_cell[(int) Loadcells::MeasCell::Torque2],
 					nullptr, nullptr, SIZE(19, 19)), COORDS(215, 215));
 
+	c->attach(new Label("Auto gain:", Font_Big), COORDS(85, 235));
+	c->attach(new Checkbox(&Loadcells::autoGain, [](void *ptr, Widget* w) {
+		xTaskNotify(ptr, (uint32_t ) Notification::NewSettings,
+				eSetValueWithOverwrite);
+	}, xTaskGetCurrentTaskHandle(), SIZE(19, 19)), COORDS(215, 235));
+
 	c->attach(new Label("Torque factor:", Font_Big), COORDS(85, 255));
 	c->attach(
 			new Entry(&Loadcells::factor_torque, 1000, 0, Font_Big, 6,
 					Unit::Distance), COORDS(125, 275));
 
+	// noise of the force cell at every rate
+	c->attach(new Button("Rate test", Font_Big, [](void *ptr, Widget *w) {
+		xTaskNotify(ptr, (uint32_t ) Notification::TestRates,
+				eSetValueWithOverwrite);
+	}, xTaskGetCurrentTaskHandle()), COORDS(85, 300));
+
 	app->StartComplete(c);
 
 	while(1) {
@@ -154,8 +192,16 @@ void LoadcellSetup::Task(void *a) {
 					Loadcells::UpdateSettings();
 				}
 				break;
-			case Notification::ZeroLoadcell:
-				Loadcells::cells[loadcell].offset = sampleLoadcell(loadcell);
+			case Notification::ZeroLoadcell: {
+				int32_t raw;
+				if (sampleLoadcell(loadcell, raw)) {
+					Loadcells::cells[loadcell].offset = raw;
+					// start a new multi-point calibration
+					pointsCell = loadcell;
+					nPoints = 0;
+					addCalibrationPoint(loadcell, raw, 0);
+				}
+			}
 				break;
 			case Notification::WeightLoadcell: {
 				new ValueInput("Calibration force?", &calibrationWeight, Unit::Force,
@@ -170,15 +216,65 @@ void LoadcellSetup::Task(void *a) {
 			}
 				break;
 			case Notification::CalLoadcell: {
-				int32_t raw = sampleLoadcell(loadcell);
-				int32_t lsb = raw - Loadcells::cells[loadcell].offset;
-				Loadcells::cells[loadcell].scale = (float) calibrationWeight
-						/ lsb;
+				int32_t raw;
+				if (!sampleLoadcell(loadcell, raw)) {
+					break;
+				}
+				addCalibrationPoint(loadcell, raw, calibrationWeight);
+				Calibration::Fit fit;
+				if (!Calibration::LinearFit(points, nPoints,
+						Loadcells::cells[loadcell].offset, fit)) {
+					Dialog::MessageBox("Error", Font_Big, "Calibration\nfailed",
+							Dialog::MsgBox::OK, nullptr, true);
+					break;
+				}
+				Loadcells::cells[loadcell].offset = fit.offset;
+				Loadcells::SetScale(loadcell, fit.scale);
+				if (nPoints > 2) {
+					// show linearity of the cell
+					char msg[60];
+					snprintf(msg, sizeof(msg),
+							"%d points\nmax dev: %ldmN\nrms dev: %ldmN", nPoints,
+							fit.maxResidual / 1000, fit.rmsResidual / 1000);
+					LOG(Log_App, LevelInfo,
+							"Cell %d: %d points, max dev %lduN, rms dev %lduN",
+							loadcell, nPoints, fit.maxResidual, fit.rmsResidual);
+					Dialog::MessageBox("Calibration", Font_Big, msg,
+							Dialog::MsgBox::OK, nullptr, true);
+				}
 			}
 				break;
 			case Notification::NewRate: {
 				Loadcells::rate = (max11254_rate_t) itemValue;
 				Loadcells::UpdateSettings();
+			}
+				break;
+			case Notification::TestRates: {
+				constexpr uint8_t nRates = sizeof(items) / sizeof(items[0]) - 1;
+				constexpr uint16_t samples = 64;
+				Calibration::RateNoise results[nRates];
+				uint8_t cell =
+						Loadcells::select_cell[(int) Loadcells::MeasCell::Force];
+				auto p = new ProgressDialog("Testing rates...", 0);
+				auto rate = Calibration::CharacterizeRates(cell, samples,
+						results, nRates, Loadcells::targetBits, updateProgress,
+						p);
+				delete p;
+				auto bits = results[rate].noiseFreeBits;
+				char msg[80];
+				snprintf(msg, sizeof(msg), "%s rate for\n%d noise free bits:\n"
+						"%ssps (%d.%d bits)\nUse this rate?",
+						bits >= Loadcells::targetBits ? "Fastest" : "Best",
+						Loadcells::targetBits, items[rate], (int) bits,
+						(int) (bits * 10) % 10);
+				if (Dialog::MessageBox("Rate test", Font_Big, msg,
+						Dialog::MsgBox::ABORT_OK, nullptr, true)
+						== Dialog::Result::OK) {
+					itemValue = rate;
+					iRate->requestRedraw();
+					Loadcells::rate = rate;
+					Loadcells::UpdateSettings();
+				}
 			}
 			}
 		}
@@ -1,10 +1,14 @@
 #include "Loadcells.hpp"
 
+#include <cstring>
+#include <cstdio>
 #include "FreeRTOS.h"
 #include "task.h"
 #include "log.h"
 #include "file.hpp"
 #include "Config.hpp"
+#include "FixedScale.hpp"
+#include "touch.hpp"
 
 static TaskHandle_t handle;
 extern SPI_HandleTypeDef hspi1;
@@ -13,28 +17,131 @@ static max11254_t max;
 std::array<Loadcells::Cell, Loadcells::MaxCells> Loadcells::cells;
 std::array<bool, Loadcells::MaxCells> Loadcells::enabled;
 max11254_rate_t Loadcells::rate = MAX11254_RATE_CONT1_9_SINGLE50;
+Loadcells::Acquisition Loadcells::acquisition =
+		Loadcells::Acquisition::Continuous;
+Filter::Settings Loadcells::filter[Loadcells::MaxCells];
+bool Loadcells::autoGain;
+int8_t Loadcells::targetBits;
 bool Loadcells::invert_cell[3];
 int32_t Loadcells::select_cell[3];
 int32_t Loadcells::factor_torque;
-static uint32_t samples;
-static int64_t forceIntegral;
-static int64_t torqueIntegral;
+static Filter::Channel filterState[Loadcells::MaxCells];
+static max11254_pga_gain_t gain = MAX11254_GAIN128;
+// change gain when the ADC exceeds 7/8 of full scale or stays below 3/8
+static constexpr int32_t gainUpperLimit = 0x700000;
+static constexpr int32_t gainLowerLimit = 0x300000;
+// STAT is only checked for an out-of-range condition above 3/4 of full scale,
+// it costs an SPI transaction and an overrange drives the results towards
+// full scale anyway
+static constexpr int32_t gainStatusLimit = 0x600000;
+// scans below gainLowerLimit before the gain is increased
+static constexpr uint8_t gainWindow = 64;
+static int32_t gainWindowPeak;
+static uint8_t gainWindowCount;
+static Loadcells::Sample sampleBuffer[Loadcells::SampleBufferSize];
+// number of samples written to sampleBuffer so far
+static volatile uint32_t samplesWritten;
+static int64_t forceSum;
+static int64_t torqueSum;
+static Loadcells::RateStats rateStats[MAX11254_RATE_CONT64000_SINGLE12800 + 1];
+static max11254_rate_t activeRate;
+static volatile uint32_t lastScan;
+static bool lastScanValid;
+// running average of the scan interval in 1/16us
+static uint32_t avgInterval;
+static Loadcells::Timing scanTiming;
 
+// bit field, the MAX11254 driver signals SPI completion in another bit
 enum class Notification : uint32_t {
-	NewSample,
-	NewSettings,
+	NewSample = 0x01,
+	NewSettings = 0x02,
 };
+// set by the RDYB interrupt until the task has picked up the scan
+static volatile bool samplePending;
+
+static uint8_t histogramBin(uint32_t us) {
+	uint8_t bin = us ? 32 - __builtin_clz(us) : 0;
+	return bin < Loadcells::HistogramBins ? bin : Loadcells::HistogramBins - 1;
+}
 
 static void conversionComplete(void *ptr) {
+	uint32_t now = getRunTimeCounterValue();
+	auto &stats = rateStats[activeRate];
+	if (lastScanValid) {
+		uint32_t interval = now - lastScan;
+		if (interval < stats.minInterval) {
+			stats.minInterval = interval;
+		}
+		if (interval > stats.maxInterval) {
+			stats.maxInterval = interval;
+		}
+		stats.sumInterval += interval;
+		stats.scans++;
+		if (avgInterval) {
+			avgInterval += ((int32_t) (interval << 4) - (int32_t) avgInterval)
+					>> 4;
+		} else {
+			avgInterval = interval << 4;
+		}
+		int32_t deviation = interval - (avgInterval >> 4);
+		scanTiming.jitter[histogramBin(
+				deviation >= 0 ? deviation : -deviation)]++;
+	}
+	lastScan = now;
+	lastScanValid = true;
+
+	if (samplePending) {
+		// previous scan has not been read yet
+		stats.overruns++;
+		return;
+	}
+	samplePending = true;
 	BaseType_t yield = pdFALSE;
-	xTaskNotifyFromISR(handle, (uint32_t ) Notification::NewSample,
-			eSetValueWithoutOverwrite, &yield);
+	xTaskNotifyFromISR(handle, (uint32_t ) Notification::NewSample, eSetBits,
+			&yield);
 	portYIELD_FROM_ISR(yield);
 }
 
-static void newSample() {
+static void startScan() {
+	// first edge after (re)starting has no valid interval
+	lastScanValid = false;
+	avgInterval = 0;
+	samplePending = false;
+	activeRate = Loadcells::rate;
+	if (Loadcells::acquisition == Loadcells::Acquisition::Continuous) {
+		max11254_scan_conversion_continuous(&max, Loadcells::rate,
+				conversionComplete, nullptr);
+	} else {
+		max11254_scan_conversion_static_gpio(&max, Loadcells::rate,
+				conversionComplete, nullptr);
+	}
+}
+
+static inline int32_t toMicroNewton(int32_t raw, const Loadcells::Cell &c) {
+	return FixedScale::Apply(raw - c.offset, c.scaleMul, c.scaleShift);
+}
+
+static void calculateFixedScale(Loadcells::Cell &c) {
+	auto f = FixedScale::FromFloat(c.scale);
+	portENTER_CRITICAL();
+	c.scaleMul = f.mul;
+	c.scaleShift = f.shift;
+	portEXIT_CRITICAL();
+}
+
+// factor_torque / 1000 as fixed point with torqueShift fractional bits
+static constexpr uint8_t torqueShift = 30;
+static int32_t torqueFactor;
+static int64_t torqueMul;
+
+static void newSample(const int32_t *raw, uint32_t timestamp) {
 	using namespace Loadcells;
-	Meas sample;
+	uint32_t index = samplesWritten;
+	Sample &s = sampleBuffer[index % SampleBufferSize];
+	s.index = index;
+	s.timestamp = timestamp;
+	memcpy(s.raw, raw, sizeof(s.raw));
+	Meas &sample = s.meas;
 	sample.force = cells[select_cell[(int) MeasCell::Force]].uNewton;
 	if (invert_cell[(int) MeasCell::Force]) {
 		sample.force = -sample.force;
@@ -47,40 +154,172 @@ static void newSample() {
 	if (invert_cell[(int) MeasCell::Torque2]) {
 		uNew2 = -uNew2;
 	}
-	sample.torque = ((int64_t) (uNew1 + uNew2) * factor_torque) / 1000;
-	portENTER_CRITICAL();
-	forceIntegral += sample.force;
-	torqueIntegral += sample.torque;
-	samples++;
-	portEXIT_CRITICAL();
+	if (torqueFactor != factor_torque) {
+		// factor changed, this is the only remaining 64 bit division
+		torqueFactor = factor_torque;
+		torqueMul = ((int64_t) torqueFactor << torqueShift) / 1000;
+	}
+	sample.torque = ((int64_t) uNew1 + uNew2) * torqueMul >> torqueShift;
+	forceSum += sample.force;
+	torqueSum += sample.torque;
+	s.forceSum = forceSum;
+	s.torqueSum = torqueSum;
+	// sample must be complete before readers can see it
+	__DMB();
+	samplesWritten = index + 1;
+}
+
+// Copies a sample out of the buffer, fails if it was (partially) overwritten
+static bool fetchSample(uint32_t index, Loadcells::Sample &s) {
+	s = sampleBuffer[index % Loadcells::SampleBufferSize];
+	__DMB();
+	// the writer only touches the slot of index samplesWritten
+	return samplesWritten - index < Loadcells::SampleBufferSize;
+}
+
+static void logHistogram(const char *name, const uint32_t *bins) {
+	char line[Loadcells::HistogramBins * 11 + 1];
+	uint16_t pos = 0;
+	for (uint8_t i = 0; i < Loadcells::HistogramBins; i++) {
+		pos += snprintf(&line[pos], sizeof(line) - pos, " %lu", bins[i]);
+	}
+	LOG(Log_Loadcell, LevelInfo, "%s:%s", name, line);
+}
+
+static void logTiming() {
+	// static to keep it off the small task stack
+	static Loadcells::Timing t;
+	t = Loadcells::GetTiming();
+	logHistogram("Jitter", t.jitter);
+	logHistogram("Latency", t.latency);
+	Loadcells::ResetTiming();
+}
+
+// Returns the gain to use for the next scans, based on the current one
+static max11254_pga_gain_t evaluateGain(const int32_t *raw) {
+	int32_t peak = 0;
+	for (uint8_t i = 0; i < Loadcells::cells.size(); i++) {
+		if (Loadcells::enabled[i]) {
+			int32_t value = raw[i] >= 0 ? raw[i] : -raw[i];
+			if (value > peak) {
+				peak = value;
+			}
+		}
+	}
+	if (peak > gainUpperLimit || (peak > gainStatusLimit
+			&& max11254_out_of_range(max11254_get_state(&max)))) {
+		gainWindowPeak = 0;
+		gainWindowCount = 0;
+		if (gain > MAX11254_GAIN1) {
+			return (max11254_pga_gain_t) (gain - 1);
+		}
+		return gain;
+	}
+	if (peak > gainWindowPeak) {
+		gainWindowPeak = peak;
+	}
+	if (++gainWindowCount >= gainWindow) {
+		bool increase = gainWindowPeak < gainLowerLimit;
+		gainWindowPeak = 0;
+		gainWindowCount = 0;
+		if (increase && gain < MAX11254_GAIN128) {
+			return (max11254_pga_gain_t) (gain + 1);
+		}
+	}
+	return gain;
+}
+
+static void setGain(max11254_pga_gain_t g) {
+	gain = g;
+	gainWindowPeak = 0;
+	gainWindowCount = 0;
+	max11254_set_PGA(&max, gain, MAX11254_PGAMODE_LOWNOISE);
 }
 
 static void loadcelltask(void *ptr) {
 	LOG(Log_Loadcell, LevelInfo, "Task start");
 	while(1) {
-		Notification n;
-		xTaskNotifyWait(0, 0xFFFFFFFF, (uint32_t*) &n, portMAX_DELAY);
-		switch(n) {
-		case Notification::NewSample:
+		uint32_t n;
+		xTaskNotifyWait(0, 0xFFFFFFFF, &n, portMAX_DELAY);
+		if (n & (uint32_t) Notification::NewSample) {
+			samplePending = false;
 			LOG(Log_Loadcell, LevelDebug, "New sample");
+			uint32_t timestamp = lastScan;
+			scanTiming.latency[histogramBin(getRunTimeCounterValue() - timestamp)]++;
+			uint8_t mask = 0;
+			for (uint8_t i = 0; i < Loadcells::cells.size(); i++) {
+				if (Loadcells::enabled[i]) {
+					mask |= 1 << i;
+				}
+			}
+			// fetch all enabled channels in one go
+			int32_t raw[Loadcells::MaxCells] = { 0 };
+			max11254_read_results(&max, mask, raw);
+			if (Loadcells::acquisition == Loadcells::Acquisition::SingleScan) {
+				// time between RDYB and re-arming shows up as scan interval
+				max11254_scan_conversion_static_gpio(&max, Loadcells::rate,
+						conversionComplete, nullptr);
+			}
+			auto newGain = gain;
+			if (Loadcells::autoGain) {
+				newGain = evaluateGain(raw);
+			}
+			// only publish when all filters have an output (decimation)
+			bool ready = true;
 			for (uint8_t i = 0; i < Loadcells::cells.size(); i++) {
 				if (Loadcells::enabled[i]) {
+					if (!Filter::Process(filterState[i], raw[i])) {
+						ready = false;
+						continue;
+					}
+					// scale to gain 128
+					raw[i] *= 1 << (MAX11254_GAIN128 - gain);
 					auto& cell = Loadcells::cells[i];
-					cell.raw = max11254_read_result(&max, i);
-					cell.uNewton = (cell.raw - cell.offset) * cell.scale;
+					cell.raw = raw[i];
+					cell.uNewton = toMicroNewton(cell.raw, cell);
 				}
 			}
-			max11254_scan_conversion_static_gpio(&max, Loadcells::rate,
-					conversionComplete, nullptr);
-			newSample();
-			break;
-		case Notification::NewSettings:
+			if (ready) {
+				newSample(raw, timestamp);
+			}
+			if (newGain != gain) {
+				LOG(Log_Loadcell, LevelInfo, "Switching to gain %d",
+						1 << newGain);
+				max11254_power_down(&max);
+				setGain(newGain);
+				// filter history is at the old gain
+				for (auto &f : filterState) {
+					Filter::Restart(f);
+				}
+				startScan();
+			}
+		}
+		if (n & (uint32_t) Notification::NewSettings) {
 			LOG(Log_Loadcell, LevelInfo, "New settings");
 			max11254_power_down(&max);
+			if (rateStats[activeRate].scans) {
+				auto stats = Loadcells::GetRateStats(activeRate);
+				LOG(Log_Loadcell, LevelInfo,
+						"Rate %d: %lu scans, interval avg %luus min %luus max %luus, %lu overruns",
+						activeRate, stats.scans,
+						(uint32_t) (stats.sumInterval / stats.scans),
+						stats.minInterval, stats.maxInterval, stats.overruns);
+				logTiming();
+				// bus contention is the usual cause of overruns
+				spibus_log_stats();
+				LOG(Log_Loadcell, LevelInfo, "Touch bus time: %luus/s",
+						Touch::BusTimePerSecond());
+				spibus_reset_stats();
+			}
+			if (!Loadcells::autoGain) {
+				setGain(MAX11254_GAIN128);
+			}
 			uint8_t order = 1;
+			Filter::FreeAll();
 			for (uint8_t i = 0; i < Loadcells::cells.size(); i++) {
 				if (Loadcells::enabled[i]) {
 					LOG(Log_Loadcell, LevelInfo, "Enable channel %d", i);
+					Filter::Setup(filterState[i], Loadcells::filter[i]);
 					max11254_sequence_enable_channel(&max, i, order++,
 							MAX11254_GPIO_None);
 				} else {
@@ -89,8 +328,7 @@ static void loadcelltask(void *ptr) {
 				}
 			}
 			if (order > 1) {
-				max11254_scan_conversion_static_gpio(&max, Loadcells::rate,
-						conversionComplete, nullptr);
+				startScan();
 			}
 		}
 	}
@@ -100,10 +338,15 @@ static void SetDefaultConfig() {
 	for (auto &i : Loadcells::cells) {
 		i.offset = 0;
 		i.scale = 1.0f;
+		calculateFixedScale(i);
 	}
 	for (auto &i : Loadcells::enabled) {
 		i = false;
 	}
+	for (auto &i : Loadcells::filter) {
+		i.type = Filter::Type::None;
+		i.length = 1;
+	}
 	Loadcells::invert_cell[(int) Loadcells::MeasCell::Force] = false;
 	Loadcells::invert_cell[(int) Loadcells::MeasCell::Torque1] = true;
 	Loadcells::invert_cell[(int) Loadcells::MeasCell::Torque2] = false;
@@ -111,10 +354,16 @@ static void SetDefaultConfig() {
 	Loadcells::select_cell[(int) Loadcells::MeasCell::Torque1] = 0;
 	Loadcells::select_cell[(int) Loadcells::MeasCell::Torque2] = 2;
 	Loadcells::factor_torque = 50;
+	Loadcells::acquisition = Loadcells::Acquisition::Continuous;
+	Loadcells::autoGain = false;
+	Loadcells::targetBits = 16;
 }
 
 static constexpr File::Entry configEntries[] = {
 		{"Loadcell::Samplerate", &Loadcells::rate, File::PointerType::INT8},
+		{"Loadcell::Acquisition", &Loadcells::acquisition, File::PointerType::INT8},
+		{"Loadcell::AutoGain", &Loadcells::autoGain, File::PointerType::BOOL},
+		{"Loadcell::TargetBits", &Loadcells::targetBits, File::PointerType::INT8},
 		{"Loadcell::Force::Cell", &Loadcells::select_cell[(int)Loadcells::MeasCell::Force], File::PointerType::INT8},
 		{"Loadcell::Force::Inv", &Loadcells::invert_cell[(int)Loadcells::MeasCell::Force], File::PointerType::BOOL},
 		{"Loadcell::Torque1::Cell", &Loadcells::select_cell[(int)Loadcells::MeasCell::Torque1], File::PointerType::INT8},
@@ -122,9 +371,21 @@ static constexpr File::Entry configEntries[] = {
 		{"Loadcell::Torque2::Cell", &Loadcells::select_cell[(int)Loadcells::MeasCell::Torque2], File::PointerType::INT8},
 		{"Loadcell::Torque2::Inv", &Loadcells::invert_cell[(int)Loadcells::MeasCell::Torque2], File::PointerType::BOOL},
 		{"Loadcell::Torque::Factor", &Loadcells::factor_torque, File::PointerType::INT32},
+		{"Loadcell::0::FilterType", &Loadcells::filter[0].type, File::PointerType::INT8},
+		{"Loadcell::0::FilterLength", &Loadcells::filter[0].length, File::PointerType::INT16},
+		{"Loadcell::1::FilterType", &Loadcells::filter[1].type, File::PointerType::INT8},
+		{"Loadcell::1::FilterLength", &Loadcells::filter[1].length, File::PointerType::INT16},
+		{"Loadcell::2::FilterType", &Loadcells::filter[2].type, File::PointerType::INT8},
+		{"Loadcell::2::FilterLength", &Loadcells::filter[2].length, File::PointerType::INT16},
+		{"Loadcell::3::FilterType", &Loadcells::filter[3].type, File::PointerType::INT8},
+		{"Loadcell::3::FilterLength", &Loadcells::filter[3].length, File::PointerType::INT16},
+		{"Loadcell::4::FilterType", &Loadcells::filter[4].type, File::PointerType::INT8},
+		{"Loadcell::4::FilterLength", &Loadcells::filter[4].length, File::PointerType::INT16},
+		{"Loadcell::5::FilterType", &Loadcells::filter[5].type, File::PointerType::INT8},
+		{"Loadcell::5::FilterLength", &Loadcells::filter[5].length, File::PointerType::INT16},
 };
 
-static bool ReadConfig(void *ptr) {
+static bool ReadConfig(void *ptr, File::Handle &file) {
 	SetDefaultConfig();
 	for (uint8_t i = 0; i < Loadcells::MaxCells; i++) {
 		char enabled[] = "Loadcell::X::Enabled";
@@ -137,11 +398,12 @@ static bool ReadConfig(void *ptr) {
 				File::PointerType::BOOL }, { offset,
 				&Loadcells::cells[i].offset, File::PointerType::INT32 }, {
 				scale, &Loadcells::cells[i].scale, File::PointerType::FLOAT }, };
-		if(File::ReadParameters(entries, 3) == File::ParameterResult::Error) {
+		if(file.ReadParameters(entries, 3) == File::ParameterResult::Error) {
 			return false;
 		}
+		calculateFixedScale(Loadcells::cells[i]);
 	}
-	if (File::ReadParameters(configEntries,
+	if (file.ReadParameters(configEntries,
 			sizeof(configEntries) / sizeof(configEntries[0]))
 			== File::ParameterResult::Error) {
 		return false;
@@ -150,8 +412,8 @@ static bool ReadConfig(void *ptr) {
 	return true;
 }
 
-static bool WriteConfig(void *ptr) {
-	File::Write("# Loadcell configuration and calibration\n");
+static bool WriteConfig(void *ptr, File::Handle &file) {
+	file.Write("# Loadcell configuration and calibration\n");
 	for (uint8_t i = 0; i < Loadcells::MaxCells; i++) {
 		char enabled[] = "Loadcell::X::Enabled";
 		char offset[] = "Loadcell::X::Offset";
@@ -163,9 +425,9 @@ static bool WriteConfig(void *ptr) {
 				File::PointerType::BOOL }, { offset,
 				&Loadcells::cells[i].offset, File::PointerType::INT32 }, {
 				scale, &Loadcells::cells[i].scale, File::PointerType::FLOAT }, };
-		File::WriteParameters(entries, 3);
+		file.WriteParameters(entries, 3);
 	}
-	File::WriteParameters(configEntries,
+	file.WriteParameters(configEntries,
 			sizeof(configEntries) / sizeof(configEntries[0]));
 	return true;
 }
@@ -184,6 +446,7 @@ bool Loadcells::Init() {
 	}
 
 	SetDefaultConfig();
+	ResetRateStats();
 	Config::AddParseFunctions(WriteConfig, ReadConfig, nullptr);
 
 	if(xTaskCreate(loadcelltask, "MAX11254", 256, nullptr, 4, &handle)
@@ -194,21 +457,135 @@ bool Loadcells::Init() {
 	return true;
 }
 
+void Loadcells::SetScale(uint8_t cell, float scale) {
+	cells[cell].scale = scale;
+	calculateFixedScale(cells[cell]);
+}
+
 void Loadcells::UpdateSettings() {
 	if (handle) {
-		xTaskNotify(handle, (uint32_t ) Notification::NewSettings,
-				eSetValueWithOverwrite);
+		xTaskNotify(handle, (uint32_t ) Notification::NewSettings, eSetBits);
+	}
+}
+
+Loadcells::Reader::Reader() {
+	overruns = 0;
+	Flush();
+}
+
+void Loadcells::Reader::Flush() {
+	Sample s;
+	uint32_t head;
+	do {
+		head = samplesWritten;
+		if (!head) {
+			s.forceSum = 0;
+			s.torqueSum = 0;
+			break;
+		}
+	} while (!fetchSample(head - 1, s));
+	cursor = head;
+	avgIndex = head;
+	avgForce = s.forceSum;
+	avgTorque = s.torqueSum;
+}
+
+uint32_t Loadcells::Reader::Available() {
+	uint32_t available = samplesWritten - cursor;
+	if (available >= SampleBufferSize) {
+		available = SampleBufferSize - 1;
+	}
+	return available;
+}
+
+bool Loadcells::Reader::Read(Sample &s) {
+	while (1) {
+		uint32_t head = samplesWritten;
+		if (cursor == head) {
+			return false;
+		}
+		if (head - cursor >= SampleBufferSize) {
+			// oldest unread samples have already been overwritten
+			uint32_t skip = head - cursor - (SampleBufferSize - 1);
+			overruns += skip;
+			cursor += skip;
+		}
+		if (fetchSample(cursor, s)) {
+			cursor++;
+			stats.force.Add(s.meas.force);
+			stats.torque.Add(s.meas.torque);
+			return true;
+		}
+	}
+}
+
+void Loadcells::Reader::ResetStats() {
+	stats.force.Reset();
+	stats.torque.Reset();
+}
+
+uint32_t Loadcells::Reader::Average(Meas &m, uint32_t *timestamp) {
+	Sample s;
+	uint32_t head;
+	do {
+		head = samplesWritten;
+		if (head == avgIndex) {
+			m.force = 0;
+			m.torque = 0;
+			return 0;
+		}
+	} while (!fetchSample(head - 1, s));
+	uint32_t n = head - avgIndex;
+	if (timestamp) {
+		*timestamp = s.timestamp;
 	}
+	m.force = (s.forceSum - avgForce) / n;
+	m.torque = (s.torqueSum - avgTorque) / n;
+	avgIndex = head;
+	avgForce = s.forceSum;
+	avgTorque = s.torqueSum;
+	return n;
 }
 
-Loadcells::Meas Loadcells::Get() {
-	Meas ret;
+Loadcells::RateStats Loadcells::GetRateStats(max11254_rate_t rate) {
+	RateStats ret;
 	portENTER_CRITICAL();
-	ret.force = forceIntegral / samples;
-	ret.torque = torqueIntegral / samples;
-	samples = 0;
-	forceIntegral = 0;
-	torqueIntegral = 0;
+	ret = rateStats[rate];
 	portEXIT_CRITICAL();
 	return ret;
 }
+
+uint32_t Loadcells::ScanInterval() {
+	return avgInterval >> 4;
+}
+
+void Loadcells::ResetRateStats() {
+	portENTER_CRITICAL();
+	for (auto &s : rateStats) {
+		s.scans = 0;
+		s.overruns = 0;
+		s.minInterval = UINT32_MAX;
+		s.maxInterval = 0;
+		s.sumInterval = 0;
+	}
+	lastScanValid = false;
+	portEXIT_CRITICAL();
+}
+
+Loadcells::Timing Loadcells::GetTiming() {
+	Timing ret;
+	portENTER_CRITICAL();
+	ret = scanTiming;
+	portEXIT_CRITICAL();
+	return ret;
+}
+
+void Loadcells::ResetTiming() {
+	portENTER_CRITICAL();
+	memset(&scanTiming, 0, sizeof(scanTiming));
+	portEXIT_CRITICAL();
+}
+
+max11254_pga_gain_t Loadcells::GetGain() {
+	return gain;
+}
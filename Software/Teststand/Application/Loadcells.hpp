@@ -3,6 +3,8 @@
 #include <cstdint>
 #include <array>
 #include "max11254.h"
+#include "Filter.hpp"
+#include "Statistics.hpp"
 
 namespace Loadcells {
 
@@ -13,29 +15,125 @@ using Cell = struct cell {
 	int32_t offset;
 	float scale;
 	int32_t uNewton;
+	// scale as fixed point: uNewton = ((raw - offset) * scaleMul) >> scaleShift
+	int32_t scaleMul;
+	uint8_t scaleShift;
 };
 
 extern std::array<Cell, MaxCells> cells;
 extern std::array<bool, MaxCells> enabled;
 extern max11254_rate_t rate;
 
+enum class Acquisition : uint8_t {
+	SingleScan = 0,	// re-arm the sequencer after every scan
+	Continuous = 1,	// let the sequencer rescan freely (CTRL1:CONTSC)
+};
+
+extern Acquisition acquisition;
+
+// The PGA gain is shared by all channels. With autoGain the highest gain
+// that leaves headroom on every enabled channel is used, otherwise 128.
+// Raw values are always scaled to gain 128, so calibrations stay valid
+extern bool autoGain;
+// resolution the rate characterization is aiming for
+extern int8_t targetBits;
+
+// Scan timing as seen by the RDYB interrupt, intervals in us
+using RateStats = struct ratestats {
+	uint32_t scans;
+	uint32_t overruns;
+	uint32_t minInterval;
+	uint32_t maxInterval;
+	uint64_t sumInterval;
+};
+
 using Meas = struct meas {
 	int32_t force;
 	int32_t torque;
 };
 
+using MeasStats = struct measstats {
+	Statistics force;
+	Statistics torque;
+};
+
+constexpr uint8_t HistogramBins = 16;
+
+// Histograms in us: bin 0 counts values below 1us, bin n values from
+// 2^(n-1) up to 2^n - 1, the last bin everything above
+using Timing = struct timing {
+	// deviation of the scan interval from its running average
+	uint32_t jitter[HistogramBins];
+	// RDYB until the loadcell task handles the scan
+	uint32_t latency[HistogramBins];
+};
+
+using Sample = struct sample {
+	uint32_t index;		// running scan number
+	uint32_t timestamp;	// in us, taken at RDYB
+	int32_t raw[MaxCells];
+	Meas meas;
+	// running sums of meas over all samples up to and including this one
+	int64_t forceSum;
+	int64_t torqueSum;
+};
+
+// Number of scans kept in the sample buffer
+constexpr uint8_t SampleBufferSize = 32;
+
+// Independent view into the sample buffer. The loadcell task is the only
+// writer, any number of readers may consume the same samples without
+// locking. Readers that fall behind by more than the buffer size lose the
+// oldest samples, which is counted in Overruns().
+class Reader {
+public:
+	Reader();
+	// skip all samples received so far
+	void Flush();
+	uint32_t Available();
+	// fetch the oldest unread sample, false if there is none. Every sample
+	// read is also added to the statistics of this reader
+	bool Read(Sample &s);
+	const MeasStats& Stats() { return stats; };
+	void ResetStats();
+	// average of all samples since the last call or Flush(), returns the
+	// number of averaged samples and optionally the timestamp of the newest
+	// one. Independent of Read() and not affected by overruns
+	uint32_t Average(Meas &m, uint32_t *timestamp = nullptr);
+	uint32_t Overruns() { return overruns; };
+private:
+	uint32_t cursor;
+	uint32_t overruns;
+	uint32_t avgIndex;
+	int64_t avgForce;
+	int64_t avgTorque;
+	MeasStats stats;
+};
+
 enum class MeasCell : uint8_t {
 	Force = 0,
 	Torque1 = 1,
 	Torque2 = 2,
 };
 
+// applied to the raw values of each cell before conversion
+extern Filter::Settings filter[MaxCells];
+
 extern bool invert_cell[3];
 extern int32_t select_cell[3];
 extern int32_t factor_torque;
 
 bool Init();
 void UpdateSettings();
-Meas Get();
+// Changes the calibration of a cell, always use this instead of writing scale
+void SetScale(uint8_t cell, float scale);
+RateStats GetRateStats(max11254_rate_t rate);
+// running average of the scan interval in us, 0 until it has been measured
+// after the last (re)start of the ADC
+uint32_t ScanInterval();
+void ResetRateStats();
+Timing GetTiming();
+void ResetTiming();
+max11254_pga_gain_t GetGain();
 
 }
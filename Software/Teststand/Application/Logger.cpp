@@ -0,0 +1,219 @@
+#include "Logger.hpp"
+
+#include <cstring>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
+#include "semphr.h"
+#include "log.h"
+
+static FIL file;
+static bool opened;
+alignas(4) static uint8_t buffers[Logger::Buffers][Logger::BufferSize];
+static uint16_t length[Logger::Buffers];
+// buffer the producers append to
+static uint8_t current;
+static constexpr uint8_t NoBuffer = 0xFF;
+// queued after the last buffer of a log
+static constexpr uint8_t CloseRequest = 0xFE;
+static QueueHandle_t freeBuffers;
+static QueueHandle_t fullBuffers;
+static SemaphoreHandle_t bufferAccess;
+static SemaphoreHandle_t closed;
+static FRESULT closeResult;
+static Logger::Stats logStats;
+// cluster link map for fast seek mode, [0] is the table size
+static DWORD linkMap[32];
+
+static void writerTask(void*) {
+	LOG(Log_File, LevelInfo, "Logger task start");
+	while (1) {
+		uint8_t index;
+		xQueueReceive(fullBuffers, &index, portMAX_DELAY);
+		if (index == CloseRequest) {
+			if (logStats.preallocated) {
+				// release the unused part of the pre-allocation
+				file.cltbl = nullptr;
+				f_truncate(&file);
+			}
+			closeResult = f_close(&file);
+			xSemaphoreGive(closed);
+			continue;
+		}
+		uint32_t start = getRunTimeCounterValue();
+		UINT written;
+		FRESULT res = f_write(&file, buffers[index], length[index], &written);
+		if (res == FR_OK && written != length[index] && file.cltbl) {
+			// end of the link map, continue with normal cluster allocation
+			file.cltbl = nullptr;
+			UINT rest;
+			res = f_write(&file, &buffers[index][written],
+					length[index] - written, &rest);
+			written += rest;
+		}
+		if (res != FR_OK || written != length[index]) {
+			logStats.writeErrors++;
+		}
+		uint32_t duration = getRunTimeCounterValue() - start;
+		if (duration > logStats.maxWriteTime) {
+			logStats.maxWriteTime = duration;
+		}
+		xQueueSend(freeBuffers, &index, 0);
+	}
+}
+
+// Hands the current buffer to the writer, bufferAccess must be held
+static void submit() {
+	if (current == NoBuffer || !length[current]) {
+		return;
+	}
+	// can not be full, there are only Buffers + the close request
+	xQueueSend(fullBuffers, &current, 0);
+	uint8_t waiting = uxQueueMessagesWaiting(fullBuffers);
+	if (waiting > logStats.highWater) {
+		logStats.highWater = waiting;
+	}
+	current = NoBuffer;
+}
+
+// Allocates the clusters for size bytes and switches the file to fast seek
+// mode. Sizes that do not fit on the card are clipped by FatFs.
+static FRESULT preallocate(uint32_t size) {
+	FRESULT res = f_lseek(&file, size);
+	if (res == FR_OK) {
+		// commit the FAT now instead of with the first log data
+		res = f_sync(&file);
+	}
+	if (res == FR_OK) {
+		res = f_lseek(&file, 0);
+	}
+	if (res != FR_OK) {
+		return res;
+	}
+	logStats.preallocated = f_size(&file);
+	file.cltbl = linkMap;
+	linkMap[0] = sizeof(linkMap) / sizeof(linkMap[0]);
+	res = f_lseek(&file, CREATE_LINKMAP);
+	if (res == FR_OK) {
+		logStats.fragments = (linkMap[0] - 2) / 2;
+	} else {
+		// too fragmented for the map, clusters are still allocated
+		file.cltbl = nullptr;
+		logStats.fragments = 0xFF;
+	}
+	return FR_OK;
+}
+
+bool Logger::Init() {
+	freeBuffers = xQueueCreate(Buffers, sizeof(uint8_t));
+	fullBuffers = xQueueCreate(Buffers + 1, sizeof(uint8_t));
+	bufferAccess = xSemaphoreCreateMutex();
+	closed = xSemaphoreCreateBinary();
+	if (!freeBuffers || !fullBuffers || !bufferAccess || !closed) {
+		return false;
+	}
+	for (uint8_t i = 0; i < Buffers; i++) {
+		xQueueSend(freeBuffers, &i, 0);
+	}
+	current = NoBuffer;
+	opened = false;
+	return xTaskCreate(writerTask, "LOGGER", 256, nullptr, 2, nullptr)
+			== pdPASS;
+}
+
+FRESULT Logger::Open(const char *filename, uint32_t expectedSize) {
+	xSemaphoreTake(bufferAccess, portMAX_DELAY);
+	FRESULT res = FR_LOCKED;
+	if (!opened) {
+		memset(&logStats, 0, sizeof(logStats));
+		res = f_open(&file, filename, FA_CREATE_ALWAYS | FA_WRITE);
+		if (res == FR_OK && expectedSize) {
+			uint32_t start = getRunTimeCounterValue();
+			res = preallocate(expectedSize);
+			if (res == FR_OK) {
+				LOG(Log_File, LevelInfo,
+						"Pre-allocated %lu bytes in %d fragments, took %luus",
+						logStats.preallocated, logStats.fragments,
+						getRunTimeCounterValue() - start);
+			} else {
+				f_close(&file);
+			}
+		}
+		if (res == FR_OK) {
+			opened = true;
+		}
+	}
+	xSemaphoreGive(bufferAccess);
+	return res;
+}
+
+bool Logger::Write(const char *record) {
+	return Write(record, strlen(record));
+}
+
+bool Logger::Write(const void *data, uint16_t len) {
+	auto record = (const uint8_t*) data;
+	bool stored = false;
+	xSemaphoreTake(bufferAccess, portMAX_DELAY);
+	if (opened) {
+		// the writer only ever adds free buffers, so this space is guaranteed
+		uint32_t space = uxQueueMessagesWaiting(freeBuffers) * BufferSize;
+		if (current != NoBuffer) {
+			space += BufferSize - length[current];
+		}
+		if (len <= space) {
+			logStats.records++;
+			logStats.bytes += len;
+			while (len) {
+				if (current == NoBuffer) {
+					xQueueReceive(freeBuffers, &current, 0);
+					length[current] = 0;
+				}
+				uint16_t n = BufferSize - length[current];
+				if (n > len) {
+					n = len;
+				}
+				memcpy(&buffers[current][length[current]], record, n);
+				length[current] += n;
+				record += n;
+				len -= n;
+				if (length[current] == BufferSize) {
+					submit();
+				}
+			}
+			stored = true;
+		} else {
+			logStats.dropped++;
+		}
+	}
+	xSemaphoreGive(bufferAccess);
+	return stored;
+}
+
+FRESULT Logger::Close() {
+	xSemaphoreTake(bufferAccess, portMAX_DELAY);
+	if (!opened) {
+		xSemaphoreGive(bufferAccess);
+		return FR_NO_FILE;
+	}
+	submit();
+	uint8_t request = CloseRequest;
+	xQueueSend(fullBuffers, &request, portMAX_DELAY);
+	opened = false;
+	xSemaphoreGive(bufferAccess);
+	xSemaphoreTake(closed, portMAX_DELAY);
+	LOG(Log_File, LevelInfo,
+			"Log closed: %lu records, %lu bytes, %lu dropped, high water %d/%d buffers, max write %luus, %lu errors, %lu bytes pre-allocated",
+			logStats.records, logStats.bytes, logStats.dropped,
+			logStats.highWater, Buffers, logStats.maxWriteTime,
+			logStats.writeErrors, logStats.preallocated);
+	return closeResult;
+}
+
+bool Logger::IsOpen() {
+	return opened;
+}
+
+Logger::Stats Logger::GetStats() {
+	return logStats;
+}
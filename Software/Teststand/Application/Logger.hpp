@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include "fatfs.h"
+
+// Buffered measurement logging to a file of its own. Producers only copy
+// records into RAM, a low priority task writes full sector buffers to the
+// card, so SD latency never reaches the producing task.
+namespace Logger {
+
+// one sector, keeps the file position aligned for direct multi block writes
+constexpr uint16_t BufferSize = 512;
+constexpr uint8_t Buffers = 4;
+
+using Stats = struct stats {
+	uint32_t records;
+	// records that did not fit into the free buffer space
+	uint32_t dropped;
+	uint32_t bytes;
+	// most buffers waiting for the writer at the same time
+	uint8_t highWater;
+	uint32_t maxWriteTime;	// us for a single buffer
+	uint32_t writeErrors;
+	// bytes allocated when opening, 0 if the file grows while logging
+	uint32_t preallocated;
+	// contiguous cluster runs of the pre-allocated area
+	uint8_t fragments;
+};
+
+bool Init();
+// Creates filename (overwriting it), fails if a log is already open. With
+// expectedSize the clusters are allocated up front and written through a
+// link map, so no FAT updates happen while logging. The file is truncated to
+// the logged data when closing, writing past expectedSize is still possible.
+FRESULT Open(const char *filename, uint32_t expectedSize = 0);
+// Appends a record. It is either stored completely or dropped (returns false)
+bool Write(const char *record);
+bool Write(const void *data, uint16_t len);
+// Writes the remaining data and closes the file, blocks until done
+FRESULT Close();
+bool IsOpen();
+Stats GetStats();
+
+}
@@ -9,8 +9,23 @@ enum class Notification : uint32_t {
 	LoadConfig,
 	StoreConfig,
 	CalibrateTouch,
+	LogSource,
+	LogLevel,
 };
 
+// entries of the level chooser, the lowest level logged
+static const char * const logLevels[] = { "Debug", "Info", "Warn", "Error",
+		"Crit", "Off", nullptr };
+static constexpr uint8_t LogLevelOff = 5;
+
+static uint8_t levelFromMask(uint8_t mask) {
+	return mask ? __builtin_ctz(mask) : LogLevelOff;
+}
+
+static uint8_t maskFromLevel(uint8_t level) {
+	return level >= LogLevelOff ? 0 : LevelAll & ~((1 << level) - 1);
+}
+
 void Setup::Task(void *a) {
 	App *app = (App*) a;
 	LOG(Log_App, LevelInfo, "Settings task");
@@ -32,6 +47,31 @@ void Setup::Task(void *a) {
 				eSetValueWithOverwrite);
 	}, xTaskGetCurrentTaskHandle()), COORDS(10, 70));
 
+	// runtime log levels of the individual sources
+	const char *logSources[LOG_SOURCES + 1];
+	for (uint8_t i = 0; i < LOG_SOURCES; i++) {
+		logSources[i] = log_source_name(i);
+	}
+	logSources[LOG_SOURCES] = nullptr;
+	uint8_t logSource = 0;
+	uint8_t logLevel = levelFromMask(log_get_mask(logSource));
+	c->attach(new Label("Log level:", Font_Big), COORDS(10, 105));
+	auto iSource = new ItemChooser(logSources, &logSource, Font_Big, 6);
+	iSource->setCallback([](void *ptr, Widget*) {
+		xTaskNotify(ptr, (uint32_t ) Notification::LogSource,
+				eSetValueWithOverwrite);
+	}, xTaskGetCurrentTaskHandle());
+	c->attach(iSource, COORDS(10, 123));
+	auto iLevel = new ItemChooser(logLevels, &logLevel, Font_Big, 6);
+	iLevel->setCallback([](void *ptr, Widget*) {
+		xTaskNotify(ptr, (uint32_t ) Notification::LogLevel,
+				eSetValueWithOverwrite);
+	}, xTaskGetCurrentTaskHandle());
+	c->attach(iLevel, COORDS(140, 123));
+	auto lCounters = new Label(45, Font_Medium, Label::Orientation::LEFT);
+	c->attach(lCounters, COORDS(10, 226));
+	log_source_stats_t shown = { UINT32_MAX, UINT32_MAX };
+
 	app->StartComplete(c);
 
 	while (1) {
@@ -45,6 +85,8 @@ void Setup::Task(void *a) {
 					if (Config::Load(filename)) {
 						LOG(Log_App, LevelInfo, "Configuration %s loaded",
 								filename);
+						// imported configuration is used from now on
+						Config::StoreSnapshot();
 					} else {
 						LOG(Log_App, LevelError,
 								"Failed to load configuration %s", filename);
@@ -62,6 +104,7 @@ void Setup::Task(void *a) {
 						== Dialog::Result::OK) {
 					/* add file extension */
 					strcat(filename, ".CFG");
+					Config::StoreSnapshot();
 					if (Config::Store(filename)) {
 						LOG(Log_App, LevelInfo, "Configuration %s stored",
 								filename);
@@ -78,8 +121,27 @@ void Setup::Task(void *a) {
 			case Notification::CalibrateTouch:
 				Input::Calibrate();
 				break;
+			case Notification::LogSource:
+				logLevel = levelFromMask(log_get_mask(logSource));
+				iLevel->requestRedraw();
+				shown.emitted = UINT32_MAX;
+				break;
+			case Notification::LogLevel:
+				log_set_mask(logSource, maskFromLevel(logLevel));
+				LOG(Log_App, LevelInfo, "Log level of %s set to %s",
+						log_source_name(logSource), logLevels[logLevel]);
+				break;
 			}
 		}
+		log_source_stats_t stats;
+		log_get_source_stats(logSource, &stats);
+		if (stats.emitted != shown.emitted || stats.dropped != shown.dropped) {
+			char str[46];
+			snprintf(str, sizeof(str), "%lu emitted, %lu dropped", stats.emitted,
+					stats.dropped);
+			lCounters->setText(str);
+			shown = stats;
+		}
 		if (app->Closed()) {
 			app->Exit();
 			vTaskDelete(nullptr);
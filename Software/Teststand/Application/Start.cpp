@@ -4,24 +4,22 @@
 #include "max11254.h"
 #include "display.h"
 #include "FreeRTOS.h"
-#include "semphr.h"
+#include "spibus.h"
 #include "input.hpp"
 #include "desktop.hpp"
 #include "gui.hpp"
 #include "file.hpp"
 #include "touch.hpp"
 #include "Loadcells.hpp"
+#include "Logger.hpp"
 #include "LoadcellSetup.hpp"
 #include "DriverControl.hpp"
 #include "Config.hpp"
 #include "Setup.hpp"
 
 extern ADC_HandleTypeDef hadc1;
-//extern SPI_HandleTypeDef hspi1;
+extern SPI_HandleTypeDef hspi1;
 //static max11254_t max;
-// global mutex controlling access to SPI1 (used for touch, loadcell ADC + SD card)
-SemaphoreHandle_t xMutexSPI1;
-static StaticSemaphore_t xSemSPI1;
 
 static bool VCCRail() {
 	HAL_ADC_Start(&hadc1);
@@ -86,11 +84,18 @@ constexpr uint8_t nTests = sizeof(Selftests) / sizeof(Selftests[0]);
 
 
 void Start() {
+	// the HAL tick starts with the reset, the selftest prompt is not counted
+	uint32_t promptTime = 0;
 	log_init();
 	LOG(Log_App, LevelInfo, "Start");
 	Config::Init();
 
-	xMutexSPI1 = xSemaphoreCreateMutexStatic(&xSemSPI1);
+	// SPI1 is shared by touch, loadcell ADC + SD card
+	spibus_init(&hspi1);
+	Touch::Init();
+	if (!Logger::Init()) {
+		LOG(Log_App, LevelError, "Failed to start logger");
+	}
 
 	// initialize display
 	display_Init();
@@ -125,10 +130,12 @@ void Start() {
 			"Press screen to continue");
 	{
 		coords_t dummy;
+		uint32_t waitStart = HAL_GetTick();
 		while (!Touch::GetCoordinates(dummy))
 			;
 		while (Touch::GetCoordinates(dummy))
 			;
+		promptTime = HAL_GetTick() - waitStart;
 	}
 
 //	Loadcells::Setup(0x3F, MAX11254_RATE_CONT1_9_SINGLE50);
@@ -162,7 +169,16 @@ void Start() {
 	GUI::Init(d);
 
 
-	Config::Load("default.cfg");
+	// flash snapshot first, the SD card is only needed to import a config
+	const char *source = "snapshot";
+	if (!Config::LoadSnapshot()) {
+		source = "default.cfg";
+		if (Config::Load(source)) {
+			Config::StoreSnapshot();
+		}
+	}
+	LOG(Log_App, LevelInfo, "Ready %lums after reset (config from %s)",
+			HAL_GetTick() - promptTime, source);
 
 	while(1) {
 		vTaskDelay(1000);
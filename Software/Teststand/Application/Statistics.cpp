@@ -0,0 +1,85 @@
+#include "Statistics.hpp"
+
+static int64_t clamp32(int64_t v) {
+	if (v > INT32_MAX) {
+		return INT32_MAX;
+	} else if (v < INT32_MIN) {
+		return INT32_MIN;
+	}
+	return v;
+}
+
+static uint32_t isqrt64(uint64_t v) {
+	uint64_t res = 0;
+	uint64_t bit = 1ULL << 62;
+	while (bit > v) {
+		bit >>= 2;
+	}
+	while (bit) {
+		if (v >= res + bit) {
+			v -= res + bit;
+			res = (res >> 1) + bit;
+		} else {
+			res >>= 1;
+		}
+		bit >>= 2;
+	}
+	return res;
+}
+
+void Statistics::Reset() {
+	n = 0;
+	min = INT32_MAX;
+	max = INT32_MIN;
+	mean = 0;
+	rem = 0;
+	M2 = 0;
+}
+
+void Statistics::Add(int32_t value) {
+	if (value < min) {
+		min = value;
+	}
+	if (value > max) {
+		max = value;
+	}
+	n++;
+	int64_t scaled = (int64_t) value << meanShift;
+	int64_t delta = scaled - mean;
+	// n * mean + rem is the sum of all values, add this one to it
+	int64_t t = delta + rem;
+	int64_t step = t / n;
+	int64_t r = t % n;
+	if (r < 0) {
+		step--;
+		r += n;
+	}
+	mean += step;
+	rem = r;
+	int64_t delta2 = scaled - mean;
+	int64_t inc;
+	if (delta == clamp32(delta) && delta2 == clamp32(delta2)) {
+		// small deviations, keep the fractional bits
+		inc = (delta * delta2 + (1LL << (2 * meanShift - 1)))
+				>> (2 * meanShift);
+	} else {
+		// both deviations clamped, so the product always fits
+		inc = clamp32(delta >> meanShift) * clamp32(delta2 >> meanShift);
+	}
+	if (inc > 0) {
+		// saturate instead of wrapping around
+		M2 = M2 + inc < M2 ? UINT64_MAX : M2 + inc;
+	}
+}
+
+int32_t Statistics::PeakToPeak() const {
+	return n ? clamp32((int64_t) max - min) : 0;
+}
+
+int32_t Statistics::Mean() const {
+	return (mean + (1 << (meanShift - 1))) >> meanShift;
+}
+
+uint32_t Statistics::StdDev() const {
+	return isqrt64(Variance());
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+
+// Running count/min/max/mean/variance of a signal (Welford), integer only.
+// Deviations from the mean are limited to the int32 range.
+class Statistics {
+public:
+	Statistics() { Reset(); };
+
+	void Reset();
+	void Add(int32_t value);
+
+	uint32_t Count() const { return n; };
+	int32_t Min() const { return n ? min : 0; };
+	int32_t Max() const { return n ? max : 0; };
+	// saturates at INT32_MAX
+	int32_t PeakToPeak() const;
+	int32_t Mean() const;
+	// population variance in units of value squared
+	uint64_t Variance() const { return n ? M2 / n : 0; };
+	uint32_t StdDev() const;
+private:
+	static constexpr uint8_t meanShift = 8;
+	uint32_t n;
+	int32_t min;
+	int32_t max;
+	// mean with meanShift fractional bits, rounded down. The exact mean is
+	// mean + rem / n, keeping rem avoids a drift of the truncated updates
+	int64_t mean;
+	uint32_t rem;
+	// sum of squared deviations from the mean
+	uint64_t M2;
+};
@@ -2,66 +2,227 @@
 
 #include "FreeRTOS.h"
 #include "semphr.h"
+#include "log.h"
 #include <cstring>
 #include <cstdlib>
 
-SemaphoreHandle_t fileAccess;
-static FIL file;
-static bool fileOpened = false;
+static FIL pool[File::MaxOpenFiles];
+static bool inUse[File::MaxOpenFiles];
+// counts the free entries of the pool
+static SemaphoreHandle_t freeFiles;
+static File::Stats fileStats;
 static FATFS fatfs;
 
+/* Binary parameter record, followed by len bytes of value */
+using Record = struct __attribute__((packed)) record {
+	uint32_t hash;
+	uint8_t type;
+	uint8_t len;
+};
+
+/* FNV-1a */
+static uint32_t hashKey(const char *key) {
+	uint32_t hash = 2166136261UL;
+	while (*key) {
+		hash ^= (uint8_t) *key++;
+		hash *= 16777619UL;
+	}
+	return hash;
+}
+
+/* Writes and reads back a scratch file to log the sustained card throughput.
+ * Whole, aligned sectors go directly to the card as multi block transfers */
+void File::MeasureThroughput() {
+	constexpr uint16_t chunkSize = 4096;
+	constexpr uint8_t chunks = 8;
+	constexpr const char *name = "0:/speed.tmp";
+	auto buf = (uint8_t*) pvPortMalloc(chunkSize);
+	if (!buf) {
+		return;
+	}
+	memset(buf, 0x55, chunkSize);
+	File::Handle f;
+	if (f.Open(name, FA_CREATE_ALWAYS | FA_WRITE | FA_READ) == FR_OK) {
+		auto file = f.Get();
+		UINT n;
+		uint32_t total = 0;
+		uint32_t start = getRunTimeCounterValue();
+		for (uint8_t i = 0; i < chunks; i++) {
+			if (f_write(file, buf, chunkSize, &n) != FR_OK || n != chunkSize) {
+				break;
+			}
+			total += n;
+		}
+		f_sync(file);
+		uint32_t writeTime = getRunTimeCounterValue() - start;
+		f_lseek(file, 0);
+		start = getRunTimeCounterValue();
+		for (uint8_t i = 0; i < chunks; i++) {
+			if (f_read(file, buf, chunkSize, &n) != FR_OK || n != chunkSize) {
+				break;
+			}
+		}
+		uint32_t readTime = getRunTimeCounterValue() - start;
+		f.Close();
+		f_unlink(name);
+		if (writeTime && readTime) {
+			/* bytes per us * 1000 = kB/s */
+			LOG(Log_File, LevelInfo, "SD card: write %lukB/s, read %lukB/s",
+					total * 1000 / writeTime, total * 1000 / readTime);
+		}
+	}
+	vPortFree(buf);
+}
+
 FRESULT File::Init() {
-	fileAccess = xSemaphoreCreateMutex();
-	if (!fileAccess) {
+	freeFiles = xSemaphoreCreateCounting(MaxOpenFiles, MaxOpenFiles);
+	if (!freeFiles) {
 		return FR_INT_ERR;
 	}
 
 	/* Check SD card */
-	return f_mount(&fatfs, "0:/", 1);
+	FRESULT res = f_mount(&fatfs, "0:/", 1);
+#ifdef FILE_MEASURE_THROUGHPUT
+	if (res == FR_OK) {
+		MeasureThroughput();
+	}
+#endif
+	return res;
 }
 
-FRESULT File::Open(const char* filename, BYTE mode) {
-	if (xSemaphoreTake(fileAccess, 100)) {
-		FRESULT res = f_open(&file, filename, mode);
-		if (res == FR_OK) {
-			fileOpened = true;
-		} else {
-			xSemaphoreGive(fileAccess);
+FRESULT File::Handle::Open(const char* filename, BYTE mode) {
+	if (IsOpen()) {
+		return FR_LOCKED;
+	}
+	if (!xSemaphoreTake(freeFiles, 0)) {
+		fileStats.contended++;
+		if (!xSemaphoreTake(freeFiles, 100)) {
+			fileStats.exhausted++;
+			LOG(Log_File, LevelWarn, "No free file for %s", filename);
+			return FR_TOO_MANY_OPEN_FILES;
+		}
+	}
+	uint8_t used = 0;
+	taskENTER_CRITICAL();
+	for (uint8_t i = 0; i < MaxOpenFiles; i++) {
+		if (!inUse[i] && !fil) {
+			inUse[i] = true;
+			fil = &pool[i];
+		}
+		if (inUse[i]) {
+			used++;
 		}
-		return res;
-	} else {
-		return FR_DENIED;
 	}
+	fileStats.opened++;
+	if (used > fileStats.maxInUse) {
+		fileStats.maxInUse = used;
+	}
+	taskEXIT_CRITICAL();
+	FRESULT res = f_open(fil, filename, mode);
+	if (res != FR_OK) {
+		release();
+	}
+	return res;
+}
+
+void File::Handle::release() {
+	taskENTER_CRITICAL();
+	inUse[fil - pool] = false;
+	taskEXIT_CRITICAL();
+	fil = nullptr;
+	xSemaphoreGive(freeFiles);
+}
+
+void File::Handle::CreateBuffer(uint8_t *buf, uint16_t size) {
+	Close();
+	buffer = buf;
+	bufferSize = size;
+	bufferUsed = 0;
+	overflow = false;
+	collision = false;
+}
+
+void File::Handle::OpenBuffer(const uint8_t *data, uint16_t len) {
+	Close();
+	/* never written, bufferSize stays 0 */
+	buffer = const_cast<uint8_t*>(data);
+	bufferSize = 0;
+	bufferUsed = len;
+	overflow = false;
+	collision = false;
 }
 
-FRESULT File::Close(void) {
-	FRESULT res;
-	if (fileOpened) {
-		res = f_close(&file);
-		fileOpened = false;
-		xSemaphoreGive(fileAccess);
-	} else {
+FRESULT File::Handle::Close() {
+	if (buffer) {
+		buffer = nullptr;
+		return FR_OK;
+	}
+	if (!fil) {
 		return FR_NO_FILE;
 	}
+	dropIndex();
+	FRESULT res = f_close(fil);
+	release();
 	return res;
 }
 
-bool File::ReadLine(char* dest, uint16_t maxLen) {
-	return f_gets(dest, maxLen, &file) != nullptr;
+bool File::Handle::ReadLine(char* dest, uint16_t maxLen) {
+	return fil && f_gets(dest, maxLen, fil) != nullptr;
 }
 
-int File::Write(const char* line) {
-	return f_puts(line, &file);
+int File::Handle::Write(const char* line) {
+	return fil ? f_puts(line, fil) : EOF;
 }
 
-void File::WriteParameters(const Entry *paramList,
+/* Size of the binary value, 0 if it can not be stored */
+static uint16_t valueSize(const File::Entry &e) {
+	switch (e.type) {
+	case File::PointerType::INT8:
+	case File::PointerType::BOOL:
+		return 1;
+	case File::PointerType::INT16:
+		return 2;
+	case File::PointerType::INT32:
+	case File::PointerType::FLOAT:
+		return 4;
+	case File::PointerType::STRING: {
+		uint16_t len = strlen((const char*) e.ptr) + 1;
+		return len <= UINT8_MAX ? len : 0;
+	}
+	}
+	return 0;
+}
+
+void File::Handle::WriteParameters(const Entry *paramList,
 		uint8_t length) {
-	if (fileOpened) {
+	if (buffer) {
+		for (uint8_t i = 0; i < length; i++) {
+			uint16_t len = valueSize(paramList[i]);
+			if (!len || !bufferSize
+					|| bufferUsed + sizeof(Record) + len > bufferSize) {
+				overflow = true;
+				return;
+			}
+			Record r = { hashKey(paramList[i].name),
+					(uint8_t) paramList[i].type, (uint8_t) len };
+			if (findHash(r.hash)) {
+				/* records only keep the hash, the reader could not tell
+				 * both keys apart */
+				LOG(Log_File, LevelError, "Hash collision of %s",
+						paramList[i].name);
+				collision = true;
+				return;
+			}
+			memcpy(&buffer[bufferUsed], &r, sizeof(r));
+			memcpy(&buffer[bufferUsed + sizeof(r)], paramList[i].ptr, len);
+			bufferUsed += sizeof(r) + len;
+		}
+	} else if (fil) {
 		/* opened file, now write parameters */
 		uint8_t i;
 		for (i = 0; i < length; i++) {
-			f_puts(paramList[i].name, &file);
-			f_puts(" = ", &file);
+			f_puts(paramList[i].name, fil);
+			f_puts(" = ", fil);
 #define		MAX_PARAM_LENGTH		16
 			char buf[MAX_PARAM_LENGTH + 2];
 			switch (paramList[i].type) {
@@ -92,21 +253,216 @@ void File::WriteParameters(const Entry *paramList,
 			default:
 				strcpy(buf, "UNKNOWN TYPE\n");
 			}
-			f_puts(buf, &file);
+			f_puts(buf, fil);
+		}
+	}
+}
+
+/* Stores a value string in the format of the parameter, returns false if it
+ * is not valid for the type */
+static bool storeValue(const File::Entry &e, const char *value) {
+	switch (e.type) {
+	case File::PointerType::INT8:
+		*(int8_t*) e.ptr = (int8_t) strtol(value, NULL, 0);
+		break;
+	case File::PointerType::INT16:
+		*(int16_t*) e.ptr = (int16_t) strtol(value, NULL, 0);
+		break;
+	case File::PointerType::INT32:
+		*(int32_t*) e.ptr = (int32_t) strtol(value, NULL, 0);
+		break;
+	case File::PointerType::FLOAT:
+		*(float*) e.ptr = strtof(value, NULL);
+		break;
+	case File::PointerType::STRING:
+		strcpy((char*) e.ptr, value);
+		break;
+	case File::PointerType::BOOL:
+		if (!strncmp(value, "true", 4)) {
+			*(bool*) e.ptr = true;
+		} else if (!strncmp(value, "false", 5)) {
+			*(bool*) e.ptr = false;
+		} else {
+			return false;
+		}
+	}
+	return true;
+}
+
+FRESULT File::Handle::BuildIndex() {
+	if (!fil) {
+		return FR_INVALID_OBJECT;
+	}
+	dropIndex();
+	uint32_t size = f_size(fil);
+	if (size > MaxIndexedSize) {
+		return FR_NOT_ENOUGH_CORE;
+	}
+	text = (char*) pvPortMalloc(size + 1);
+	if (!text) {
+		return FR_NOT_ENOUGH_CORE;
+	}
+	UINT n;
+	FRESULT res = f_lseek(fil, 0);
+	if (res == FR_OK) {
+		res = f_read(fil, text, size, &n);
+	}
+	if (res != FR_OK) {
+		dropIndex();
+		return res;
+	}
+	text[n] = 0;
+	uint16_t lines = 1;
+	for (char *c = text; *c; c++) {
+		if (*c == '\n') {
+			lines++;
+		}
+	}
+	index = (IndexEntry*) pvPortMalloc(lines * sizeof(IndexEntry));
+	if (!index) {
+		dropIndex();
+		return FR_NOT_ENOUGH_CORE;
+	}
+	/* split into "key = value" lines, terminating keys and values in place */
+	char *line = text;
+	while (*line) {
+		char *next = strchr(line, '\n');
+		if (next) {
+			*next++ = 0;
+		} else {
+			next = line + strlen(line);
+		}
+		char *start = strchr(line, '=');
+		if (line[0] != '#' && start) {
+			char *end = start;
+			while (end > line && end[-1] == ' ') {
+				end--;
+			}
+			*end = 0;
+			/* Skip leading spaces */
+			while (*++start == ' ')
+				;
+			char *cr = strchr(start, '\r');
+			if (cr) {
+				*cr = 0;
+			}
+			IndexEntry e = { hashKey(line), (uint16_t) (line - text),
+					(uint16_t) (start - text) };
+			/* insertion sort by hash, keeps the file order of equal keys */
+			uint16_t i = indexed++;
+			while (i > 0 && index[i - 1].hash > e.hash) {
+				index[i] = index[i - 1];
+				i--;
+			}
+			index[i] = e;
+		}
+		line = next;
+	}
+	return FR_OK;
+}
+
+const char* File::Handle::lookup(const char *key) {
+	uint32_t hash = hashKey(key);
+	uint16_t low = 0, high = indexed;
+	while (low < high) {
+		uint16_t mid = (low + high) / 2;
+		if (index[mid].hash < hash) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	for (; low < indexed && index[low].hash == hash; low++) {
+		if (!strcmp(&text[index[low].key], key)) {
+			return &text[index[low].value];
+		}
+	}
+	return nullptr;
+}
+
+void File::Handle::dropIndex() {
+	vPortFree(text);
+	vPortFree(index);
+	text = nullptr;
+	index = nullptr;
+	indexed = 0;
+}
+
+/* Returns the first record with the hash, its value follows the Record */
+const uint8_t* File::Handle::findHash(uint32_t hash) {
+	uint16_t pos = 0;
+	while (pos + sizeof(Record) <= bufferUsed) {
+		Record r;
+		memcpy(&r, &buffer[pos], sizeof(r));
+		if (pos + sizeof(r) + r.len > bufferUsed) {
+			break;
+		}
+		if (r.hash == hash) {
+			return &buffer[pos];
 		}
+		pos += sizeof(r) + r.len;
+	}
+	return nullptr;
+}
+
+/* Returns the value of the record matching name and type of e. The writer
+ * rejects colliding hashes, so the hash stands for the name */
+const uint8_t* File::Handle::findRecord(const Entry &e, uint8_t *len) {
+	auto record = findHash(hashKey(e.name));
+	if (!record) {
+		return nullptr;
+	}
+	Record r;
+	memcpy(&r, record, sizeof(r));
+	if (r.type != (uint8_t) e.type) {
+		return nullptr;
 	}
+	*len = r.len;
+	return record + sizeof(r);
 }
 
-File::ParameterResult File::ReadParameters(const Entry *paramList,
+File::ParameterResult File::Handle::ReadParameters(const Entry *paramList,
 		uint8_t length) {
-	if (fileOpened) {
+	if (buffer) {
+		uint8_t found = 0;
+		for (uint8_t i = 0; i < length; i++) {
+			uint8_t len;
+			auto value = findRecord(paramList[i], &len);
+			if (!value) {
+				continue;
+			}
+			if (paramList[i].type == PointerType::STRING) {
+				if (!len || value[len - 1]) {
+					/* not terminated */
+					return ParameterResult::Error;
+				}
+			} else if (len != valueSize(paramList[i])) {
+				return ParameterResult::Error;
+			}
+			memcpy(paramList[i].ptr, value, len);
+			found++;
+		}
+		return found == length ? ParameterResult::OK : ParameterResult::Partial;
+	} else if (fil && index) {
+		uint8_t found = 0;
+		for (uint8_t i = 0; i < length; i++) {
+			const char *value = lookup(paramList[i].name);
+			if (value) {
+				if (!storeValue(paramList[i], value)) {
+					return ParameterResult::Error;
+				}
+				found++;
+			}
+		}
+		return found == length ? ParameterResult::OK : ParameterResult::Partial;
+	} else if (fil) {
 		/* always start at beginning of file */
-		f_lseek(&file, 0);
+		f_lseek(fil, 0);
 		/* opened file, now read parameters */
 		char line[50];
 		uint8_t valueSet[length];
 		memset(valueSet, 0, sizeof(valueSet));
-		while (f_gets(line, sizeof(line), &file)) {
+		while (f_gets(line, sizeof(line), fil)) {
 			if (line[0] == '#') {
 				/* skip comment lines */
 				continue;
@@ -114,11 +470,16 @@ File::ParameterResult File::ReadParameters(const Entry *paramList,
 			/* find matching parameter */
 			uint8_t i;
 			for (i = 0; i < length; i++) {
-				if (!strncmp(line, paramList[i].name,
-						strlen(paramList[i].name))) {
-					/* found a match */
-					char *start = strchr(line, '=');
-					if (start) {
+				uint16_t nameLen = strlen(paramList[i].name);
+				if (!valueSet[i]
+						&& !strncmp(line, paramList[i].name, nameLen)) {
+					/* same rules as the index: the key has to match exactly
+					 * and its first occurrence counts */
+					char *start = line + nameLen;
+					while (*start == ' ') {
+						start++;
+					}
+					if (*start == '=') {
 						/* Skip leading spaces */
 						while (*++start == ' ')
 							;
@@ -132,34 +493,8 @@ File::ParameterResult File::ReadParameters(const Entry *paramList,
 							*cr = 0;
 						}
 						/* store value in correct format */
-						switch (paramList[i].type) {
-						case PointerType::INT8:
-							*(int8_t*) paramList[i].ptr = (int8_t) strtol(start,
-									NULL, 0);
-							break;
-						case PointerType::INT16:
-							*(int16_t*) paramList[i].ptr = (int16_t) strtol(
-									start, NULL, 0);
-							break;
-						case PointerType::INT32:
-							*(int32_t*) paramList[i].ptr = (int32_t) strtol(
-									start, NULL, 0);
-							break;
-						case PointerType::FLOAT:
-							*(float*) paramList[i].ptr = strtof(start,
-							NULL);
-							break;
-						case PointerType::STRING:
-							strcpy((char*) paramList[i].ptr, start);
-							break;
-						case PointerType::BOOL:
-							if (!strncmp(start, "true", 4)) {
-								*(bool*) paramList[i].ptr = true;
-							} else if (!strncmp(start, "false", 5)) {
-								*(bool*) paramList[i].ptr = false;
-							} else {
-								return ParameterResult::Error;
-							}
+						if (!storeValue(paramList[i], start)) {
+							return ParameterResult::Error;
 						}
 						/* mark parameter as set */
 						valueSet[i] = 1;
@@ -183,3 +518,7 @@ File::ParameterResult File::ReadParameters(const Entry *paramList,
 	/* file ended before all parameters have been set */
 	return ParameterResult::Partial;
 }
+
+File::Stats File::GetStats() {
+	return fileStats;
+}
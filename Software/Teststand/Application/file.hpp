@@ -3,10 +3,20 @@
 #include <cstdint>
 #include "fatfs.h"
 
-extern SemaphoreHandle_t fileAccess;
-
 namespace File {
 
+// FIL objects shared by all handles, the Logger has its own
+constexpr uint8_t MaxOpenFiles = 2;
+// larger files are not indexed and scanned for every ReadParameters()
+constexpr uint16_t MaxIndexedSize = 8192;
+
+/*
+ * Uncomment to measure the SD card throughput after mounting. Writes, reads
+ * back and deletes a 32kB scratch file on every boot, only meant for debug
+ * builds. MeasureThroughput() can also be called directly.
+ */
+//#define FILE_MEASURE_THROUGHPUT
+
 enum class PointerType : uint8_t {
 	INT8,
 	INT16,
@@ -28,12 +38,89 @@ using Entry = struct entry {
 	PointerType type;
 };
 
+using Stats = struct stats {
+	uint32_t opened;
+	// opens that had to wait for a free FIL
+	uint32_t contended;
+	// opens that failed because all FILs stayed in use
+	uint32_t exhausted;
+	uint8_t maxInUse;
+};
+
+// An open file, closed when the handle goes out of scope. Several handles can
+// be open at the same time from different tasks, FatFs serializes the access
+class Handle {
+public:
+	Handle() : fil(nullptr), text(nullptr), index(nullptr), indexed(0),
+			buffer(nullptr), bufferSize(0), bufferUsed(0), overflow(false),
+			collision(false) {
+	}
+	~Handle() {
+		Close();
+	}
+	Handle(const Handle&) = delete;
+	Handle& operator=(const Handle&) = delete;
+
+	// Waits up to 100 ticks for a free FIL
+	FRESULT Open(const char *filename, BYTE mode);
+	// Binary parameter records in memory instead of a file. Write() and
+	// ReadLine() do nothing, parameters are stored by the hash of their name
+	void CreateBuffer(uint8_t *buf, uint16_t size);
+	void OpenBuffer(const uint8_t *data, uint16_t len);
+	uint16_t BufferUsed() const {
+		return bufferUsed;
+	}
+	// true if parameters did not fit into the buffer
+	bool BufferOverflow() const {
+		return overflow;
+	}
+	// true if two parameter names had the same hash, the buffer misses the
+	// second one and must not be read back
+	bool BufferCollision() const {
+		return collision;
+	}
+	FRESULT Close();
+	bool IsOpen() const {
+		return fil != nullptr || buffer != nullptr;
+	}
+	FIL* Get() {
+		return fil;
+	}
+	bool ReadLine(char *dest, uint16_t maxLen);
+	int Write(const char *line);
+	void WriteParameters(const Entry *paramList, uint8_t length);
+	// Reads the whole file once into a key -> value index, following
+	// ReadParameters() calls are answered from RAM until the file is closed
+	FRESULT BuildIndex();
+	ParameterResult ReadParameters(const Entry *paramList, uint8_t length);
+private:
+	using IndexEntry = struct indexEntry {
+		uint32_t hash;
+		// offsets into text
+		uint16_t key;
+		uint16_t value;
+	};
+	void release();
+	void dropIndex();
+	const char* lookup(const char *key);
+	const uint8_t* findHash(uint32_t hash);
+	const uint8_t* findRecord(const Entry &e, uint8_t *len);
+	FIL *fil;
+	char *text;
+	// sorted by hash
+	IndexEntry *index;
+	uint16_t indexed;
+	uint8_t *buffer;
+	// 0 for a read only buffer
+	uint16_t bufferSize;
+	uint16_t bufferUsed;
+	bool overflow;
+	bool collision;
+};
+
 FRESULT Init();
-FRESULT Open(const char *filename, BYTE mode);
-FRESULT Close(void);
-bool ReadLine(char *dest, uint16_t maxLen);
-int Write(const char *line);
-void WriteParameters(const Entry *paramList, uint8_t length);
-ParameterResult ReadParameters(const Entry *paramList, uint8_t length);
+Stats GetStats();
+// Logs the sustained write and read speed of the card, see above
+void MeasureThroughput();
 
 }
@@ -8,6 +8,7 @@
 #include "log.h"
 #include "fatfs.h"
 #include "file.hpp"
+#include "Config.hpp"
 #include "display.h"
 
 #include "gui.hpp"
@@ -24,6 +25,24 @@ static constexpr File::Entry touchCal[4] = {
 		{"yfactor", &scaleY, File::PointerType::FLOAT},
 		{"yoffset", &offsetY, File::PointerType::INT32},
 };
+// same values as part of the configuration (and its flash snapshot)
+static constexpr File::Entry touchConfig[4] = {
+		{"Touch::xfactor", &scaleX, File::PointerType::FLOAT},
+		{"Touch::xoffset", &offsetX, File::PointerType::INT32},
+		{"Touch::yfactor", &scaleY, File::PointerType::FLOAT},
+		{"Touch::yoffset", &offsetY, File::PointerType::INT32},
+};
+static int configIndex = -1;
+
+static bool WriteConfig(void*, File::Handle &file) {
+	file.Write("# Touch calibration\n");
+	file.WriteParameters(touchConfig, 4);
+	return true;
+}
+
+static bool ReadConfig(void*, File::Handle &file) {
+	return file.ReadParameters(touchConfig, 4) != File::ParameterResult::Error;
+}
 
 static void penirq(void *ptr) {
 	TaskHandle_t h = (TaskHandle_t) ptr;
@@ -162,12 +181,13 @@ static coords_t GetCalibrationPoint(bool top, coords_t cross) {
 }
 
 static bool SaveCalibration(void) {
-	if (File::Open("TOUCH.CAL", FA_CREATE_ALWAYS | FA_WRITE) != FR_OK) {
+	File::Handle file;
+	if (file.Open("TOUCH.CAL", FA_CREATE_ALWAYS | FA_WRITE) != FR_OK) {
 		LOG(Log_Input, LevelError, "Failed to create calibration file");
 		return false;
 	}
-	File::WriteParameters(touchCal, 4);
-	File::Close();
+	file.WriteParameters(touchCal, 4);
+	file.Close();
 	LOG(Log_Input, LevelInfo, "Created calibration file");
 	return true;
 }
@@ -193,7 +213,9 @@ void Input::Calibrate() {
 	ev.type = EVENT_WINDOW_CLOSE;
 	GUI::SendEvent(&ev);
 
-	if(!SaveCalibration()) {
+	// the snapshot keeps the calibration without SD card
+	bool stored = Config::StoreSnapshot();
+	if(!SaveCalibration() && !stored) {
 		Dialog::MessageBox("ERROR", Font_Big,
 				"Failed to save\ntouch calibration", Dialog::MsgBox::OK, nullptr,
 				true);
@@ -204,16 +226,25 @@ void Input::Calibrate() {
 }
 
 bool Input::LoadCalibration() {
-	if (File::Open("TOUCH.CAL", FA_OPEN_EXISTING | FA_READ) != FR_OK) {
+	if (configIndex < 0) {
+		configIndex = Config::AddParseFunctions(WriteConfig, ReadConfig,
+				nullptr);
+	}
+	File::Handle file;
+	if (Config::OpenSnapshot(file)
+			&& file.ReadParameters(touchConfig, 4) == File::ParameterResult::OK) {
+		LOG(Log_Input, LevelInfo, "Loaded calibration from snapshot");
+		return true;
+	}
+	file.Close();
+	if (file.Open("TOUCH.CAL", FA_OPEN_EXISTING | FA_READ) != FR_OK) {
 		LOG(Log_Input, LevelError, "Failed to open calibration file");
 		return false;
 	}
-	if (File::ReadParameters(touchCal, 4) != File::ParameterResult::OK) {
+	if (file.ReadParameters(touchCal, 4) != File::ParameterResult::OK) {
 		LOG(Log_Input, LevelError, "Calibration file incomplete");
-		File::Close();
 		return false;
 	} else {
-		File::Close();
 		return true;
 	}
 }
@@ -1,5 +1,7 @@
 #include "display.h"
 
+#include <stdlib.h>
+
 #define RST_HIGH()			(DISPLAY_RST_GPIO_Port->BSRR = DISPLAY_RST_Pin)
 #define RST_LOW()			(DISPLAY_RST_GPIO_Port->BSRR = DISPLAY_RST_Pin<<16u)
 #define CS_HIGH()			(DISPLAY_CS_GPIO_Port->BSRR = DISPLAY_CS_Pin)
@@ -14,6 +16,15 @@
 color_t foreground;
 color_t background;
 font_t font;
+/* colors in the bit order of the data bus */
+static uint32_t foregroundBus;
+static uint32_t backgroundBus;
+/* text without background pixels */
+static uint8_t transparent;
+/* bus values of the four pixels of every glyph nibble, leftmost first. Built
+ * for the colors below */
+static uint16_t nibblePixels[16][4];
+static uint32_t nibbleForeground = UINT32_MAX, nibbleBackground = UINT32_MAX;
 
 typedef struct  {
 	uint16_t minX;
@@ -24,16 +35,42 @@ typedef struct  {
 
 static activeArea_t active;
 
-inline void setData(uint16_t data) {
+/* The data lines are wired with reversed bit order within each byte */
+static inline uint32_t busValue(uint16_t data) {
 	uint32_t buf = data;
+#ifdef __arm__
 	asm("rev %0, %0\n\t"
 		"rbit %0, %0"
-		: "=r" (buf)
-		: "r" (buf));
-	GPIOD->ODR = buf;
+		: "+r" (buf));
+#else
+	/* host build of the driver (Software/HostTests) */
+	buf = (buf & 0xF0F0) >> 4 | (buf & 0x0F0F) << 4;
+	buf = (buf & 0xCCCC) >> 2 | (buf & 0x3333) << 2;
+	buf = (buf & 0xAAAA) >> 1 | (buf & 0x5555) << 1;
+#endif
+	return buf;
+}
+
+static inline void setData(uint16_t data) {
+	GPIOD->ODR = busValue(data);
+}
+
+/* Latches the data bus, CS has to be low and RS high */
+static inline void strobe(void) {
+	WR_LOW();
+	asm volatile("nop");
+	asm volatile("nop");
+	asm volatile("nop");
+	asm volatile("nop");
+	asm volatile("nop");
+	WR_HIGH();
+	/* minimum WR high time before the next strobe */
+	asm volatile("nop");
+	asm volatile("nop");
+	asm volatile("nop");
 }
 
-inline void selectRegister(uint8_t reg) {
+static inline void selectRegister(uint8_t reg) {
 	RS_LOW();
 	setData(reg);
 	CS_LOW();
@@ -47,7 +84,7 @@ inline void selectRegister(uint8_t reg) {
 	CS_HIGH();
 }
 
-inline void writeData(uint16_t data) {
+static inline void writeData(uint16_t data) {
 	RS_HIGH();
 	setData(data);
 	CS_LOW();
@@ -133,6 +170,51 @@ void setXY(uint16_t x0, uint16_t y0, uint16_t x1, uint16_t y1) {
 	selectRegister(0x22);
 }
 
+void display_BeginStream(int16_t x0, int16_t y0, int16_t x1, int16_t y1) {
+	setXY(x0, y0, x1, y1);
+	RS_HIGH();
+	CS_LOW();
+}
+
+void display_StreamPixels(const uint16_t *pixels, uint32_t count) {
+	for (; count > 0; count--) {
+		GPIOD->ODR = busValue(*pixels++);
+		strobe();
+	}
+}
+
+/* Continues writing at x, y inside the current window */
+static void streamAt(int16_t x, int16_t y) {
+	/* landscape mode, see setXY */
+	writeRegister(0x4e, DISPLAY_HEIGHT - y - 1);
+	writeRegister(0x4f, x);
+	selectRegister(0x22);
+	RS_HIGH();
+	CS_LOW();
+}
+
+void display_EndStream(void) {
+	CS_HIGH();
+}
+
+/* Writes the same bus value count times, the data lines are only set once */
+static void streamFill(uint32_t bus, uint32_t count) {
+	GPIOD->ODR = bus;
+	for (; count >= 8; count -= 8) {
+		strobe();
+		strobe();
+		strobe();
+		strobe();
+		strobe();
+		strobe();
+		strobe();
+		strobe();
+	}
+	for (; count > 0; count--) {
+		strobe();
+	}
+}
+
 void SSD1289_Init(void) {
 	RST_HIGH();
 	HAL_Delay(5);
@@ -207,8 +289,8 @@ void SSD1289_Init(void) {
 
 void display_Init(void){
 	SSD1289_Init();
-	background = COLOR_BG_DEFAULT;
-	foreground = COLOR_FG_DEFAULT;
+	display_SetBackground(COLOR_BG_DEFAULT);
+	display_SetForeground(COLOR_FG_DEFAULT);
 	font = Font_Big;
 	display_SetDefaultArea();
 }
@@ -219,6 +301,7 @@ void display_SetFont(font_t f) {
 
 void display_SetForeground(color_t c) {
 	foreground = c;
+	foregroundBus = busValue(c);
 }
 
 color_t display_GetForeground(void) {
@@ -227,25 +310,29 @@ color_t display_GetForeground(void) {
 
 void display_SetBackground(color_t c) {
 	background = c;
+	backgroundBus = busValue(c);
 }
 
 color_t display_GetBackground(void) {
 	return background;
 }
 
+void display_SetTransparent(uint8_t t) {
+	transparent = t;
+}
+
 void display_Clear() {
-	setXY(0, 0, DISPLAY_WIDTH - 1, DISPLAY_HEIGHT - 1);
-	uint32_t i = DISPLAY_WIDTH * DISPLAY_HEIGHT;
-	for (; i > 0; i--) {
-		writeData(background);
-	}
+	display_BeginStream(0, 0, DISPLAY_WIDTH - 1, DISPLAY_HEIGHT - 1);
+	streamFill(backgroundBus, DISPLAY_WIDTH * DISPLAY_HEIGHT);
+	display_EndStream();
 }
 
 void display_Pixel(int16_t x, int16_t y, uint16_t color) {
 	if (x >= active.minX && x <= active.maxX && y >= active.minY
 			&& y <= active.maxY) {
-		setXY(x, y, x, y);
-		writeData(color);
+		display_BeginStream(x, y, x, y);
+		streamFill(busValue(color), 1);
+		display_EndStream();
 	}
 }
 
@@ -258,10 +345,9 @@ void display_HorizontalLine(int16_t x, int16_t y, uint16_t length) {
 		if (x + length - 1 > active.maxX) {
 			length = active.maxX - x + 1;
 		}
-		setXY(x, y, x + length - 1, y);
-		for (; length > 0; length--) {
-			writeData(foreground);
-		}
+		display_BeginStream(x, y, x + length - 1, y);
+		streamFill(foregroundBus, length);
+		display_EndStream();
 	}
 }
 
@@ -274,22 +360,35 @@ void display_VerticalLine(int16_t x, int16_t y, uint16_t length) {
 		if (y + length - 1 > active.maxY) {
 			length = active.maxY - y + 1;
 		}
-		setXY(x, y, x, y + length - 1);
-		for (; length > 0; length--) {
-			writeData(foreground);
-		}
+		display_BeginStream(x, y, x, y + length - 1);
+		streamFill(foregroundBus, length);
+		display_EndStream();
+	}
+}
+
+/* Draws the straight run between two points with the same x or y */
+static void run(int16_t xa, int16_t ya, int16_t xb, int16_t yb) {
+	if (ya == yb) {
+		display_HorizontalLine(xa < xb ? xa : xb, ya, abs(xb - xa) + 1);
+	} else {
+		display_VerticalLine(xa, ya < yb ? ya : yb, abs(yb - ya) + 1);
 	}
 }
 
 void display_Line(int16_t x0, int16_t y0, int16_t x1, int16_t y1) {
-	uint16_t dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
-	uint16_t dy = abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+	int16_t dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+	int16_t dy = abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
 	int16_t err = (dx > dy ? dx : -dy) / 2, e2;
+	/* consecutive pixels along the major axis are drawn as one run */
+	uint8_t horizontal = dx >= dy;
+	int16_t startX = x0, startY = y0;
 
 	for (;;) {
-		display_Pixel(x0, y0, foreground);
-		if (x0 == x1 && y0 == y1)
+		if (x0 == x1 && y0 == y1) {
+			run(startX, startY, x0, y0);
 			break;
+		}
+		int16_t lastX = x0, lastY = y0;
 		e2 = err;
 		if (e2 > -dx) {
 			err -= dy;
@@ -299,6 +398,11 @@ void display_Line(int16_t x0, int16_t y0, int16_t x1, int16_t y1) {
 			err += dx;
 			y0 += sy;
 		}
+		if (horizontal ? y0 != lastY : x0 != lastX) {
+			run(startX, startY, lastX, lastY);
+			startX = x0;
+			startY = y0;
+		}
 	}
 }
 
@@ -326,11 +430,22 @@ void display_RectangleFull(int16_t x0, int16_t y0, int16_t x1, int16_t y1){
 	if (y1 > active.maxY) {
 		y1 = active.maxY;
 	}
-	setXY(x0, y0, x1, y1);
-	uint32_t i = (x1 - x0 + 1) * (y1 - y0 + 1);
-	for (; i > 0; i--) {
-		writeData(foreground);
-	}
+	display_BeginStream(x0, y0, x1, y1);
+	streamFill(foregroundBus, (x1 - x0 + 1) * (y1 - y0 + 1));
+	display_EndStream();
+}
+
+/* Draws the points (x, y) for y from ya to yb in all eight octants */
+static void circleRuns(int16_t x0, int16_t y0, int x, int ya, int yb) {
+	uint16_t length = yb - ya + 1;
+	display_VerticalLine(x0 + x, y0 + ya, length);
+	display_VerticalLine(x0 - x, y0 + ya, length);
+	display_VerticalLine(x0 + x, y0 - yb, length);
+	display_VerticalLine(x0 - x, y0 - yb, length);
+	display_HorizontalLine(x0 + ya, y0 + x, length);
+	display_HorizontalLine(x0 - yb, y0 + x, length);
+	display_HorizontalLine(x0 + ya, y0 - x, length);
+	display_HorizontalLine(x0 - yb, y0 - x, length);
 }
 
 void display_Circle(int16_t x0, int16_t y0, uint16_t radius)
@@ -338,17 +453,12 @@ void display_Circle(int16_t x0, int16_t y0, uint16_t radius)
     int x = radius;
     int y = 0;
     int err = 0;
+    /* first y of the current x, the points in between form straight runs */
+    int start = 0;
 
     while (x >= y)
     {
-    	display_Pixel(x0 + x, y0 + y, foreground);
-    	display_Pixel(x0 + y, y0 + x, foreground);
-    	display_Pixel(x0 - y, y0 + x, foreground);
-    	display_Pixel(x0 - x, y0 + y, foreground);
-    	display_Pixel(x0 - x, y0 - y, foreground);
-    	display_Pixel(x0 - y, y0 - x, foreground);
-    	display_Pixel(x0 + y, y0 - x, foreground);
-    	display_Pixel(x0 + x, y0 - y, foreground);
+    	int lastX = x, lastY = y;
 
         y += 1;
         if (err <= 0)
@@ -358,17 +468,142 @@ void display_Circle(int16_t x0, int16_t y0, uint16_t radius)
             x -= 1;
             err += 2 * (y - x) + 1;
         }
+
+        if (x != lastX || x < y) {
+        	circleRuns(x0, y0, lastX, start, lastY);
+        	start = y;
+        }
     }
 }
 
 void display_CircleFull(int16_t x0, int16_t y0, uint16_t radius) {
-	for (int y = -radius; y <= radius; y++)
-		for (int x = -radius; x <= radius; x++)
-			if (x * x + y * y <= radius * radius)
-				display_Pixel(x0 + x, y0 + y, foreground);
+	/* one horizontal span per row, x shrinks with increasing y */
+	int x = radius;
+	for (int y = 0; y <= radius; y++) {
+		while (x * x + y * y > radius * radius) {
+			x--;
+		}
+		display_HorizontalLine(x0 - x, y0 + y, 2 * x + 1);
+		if (y) {
+			display_HorizontalLine(x0 - x, y0 - y, 2 * x + 1);
+		}
+	}
 }
 
 
+/* Glyph row of a character, the leftmost pixel is bit font.width - 1 */
+static uint32_t glyphRow(uint8_t c, uint8_t row, uint8_t rowBytes) {
+	const uint8_t *p = font.data + (c * font.height + row) * rowBytes;
+	uint32_t bits = 0;
+	for (uint8_t b = rowBytes; b > 0; b--) {
+		bits = bits << 8 | p[b - 1];
+	}
+	return bits;
+}
+
+/* Expands a nibble of a glyph row through the lookup table */
+static inline void streamNibble(uint8_t nibble, uint8_t count) {
+	const uint16_t *pixels = nibblePixels[nibble];
+	for (uint8_t k = 0; k < count; k++) {
+		GPIOD->ODR = pixels[k];
+		strobe();
+	}
+}
+
+static void updateNibblePixels(void) {
+	if (nibbleForeground == foregroundBus && nibbleBackground == backgroundBus) {
+		return;
+	}
+	for (uint8_t n = 0; n < 16; n++) {
+		for (uint8_t k = 0; k < 4; k++) {
+			nibblePixels[n][k] = n & (0x08 >> k) ? foregroundBus : backgroundBus;
+		}
+	}
+	nibbleForeground = foregroundBus;
+	nibbleBackground = backgroundBus;
+}
+
+/*
+ * Draws n characters in one window. The skip values clip the text box (in
+ * pixels) to the active area. Transparent text only writes the runs of
+ * foreground pixels of every row.
+ */
+static void drawText(int16_t x, int16_t y, const uint8_t *s, uint16_t n,
+		uint16_t skipLeft, uint16_t skipRight, uint16_t skipTop,
+		uint16_t skipBottom) {
+	uint16_t width = n * font.width;
+	if (skipLeft + skipRight >= width || skipTop + skipBottom >= font.height) {
+		return;
+	}
+	/* number of bytes in font per row */
+	uint8_t rowBytes = (font.width - 1) / 8 + 1;
+	uint16_t lastColumn = width - skipRight;
+	if (transparent) {
+		setXY(x + skipLeft, y + skipTop, x + lastColumn - 1,
+				y + font.height - 1 - skipBottom);
+		for (uint8_t i = skipTop; i < font.height - skipBottom; i++) {
+			int16_t run = -1;
+			uint16_t col = 0;
+			for (uint16_t c = 0; c < n; c++) {
+				uint32_t bits = glyphRow(s[c], i, rowBytes);
+				for (int8_t j = font.width - 1; j >= 0; j--, col++) {
+					uint8_t set = col >= skipLeft && col < lastColumn
+							&& (bits & (1UL << j));
+					if (set && run < 0) {
+						run = col;
+					} else if (!set && run >= 0) {
+						streamAt(x + run, y + i);
+						streamFill(foregroundBus, col - run);
+						display_EndStream();
+						run = -1;
+					}
+				}
+			}
+			if (run >= 0) {
+				streamAt(x + run, y + i);
+				streamFill(foregroundBus, col - run);
+				display_EndStream();
+			}
+		}
+		return;
+	}
+	updateNibblePixels();
+	display_BeginStream(x + skipLeft, y + skipTop, x + lastColumn - 1,
+			y + font.height - 1 - skipBottom);
+	/* glyph rows padded to whole nibbles */
+	uint8_t pad = (4 - font.width % 4) % 4;
+	uint8_t nibbles = (font.width + pad) / 4;
+	for (uint8_t i = skipTop; i < font.height - skipBottom; i++) {
+		if (!skipLeft && !skipRight) {
+			for (uint16_t c = 0; c < n; c++) {
+				uint32_t bits = glyphRow(s[c], i, rowBytes) << pad;
+				for (uint8_t k = nibbles - 1; k > 0; k--) {
+					streamNibble((bits >> (4 * k)) & 0x0F, 4);
+				}
+				streamNibble(bits & 0x0F, 4 - pad);
+			}
+		} else {
+			/* clipped, bit by bit */
+			uint16_t col = 0;
+			for (uint16_t c = 0; c < n; c++) {
+				uint32_t bits = glyphRow(s[c], i, rowBytes);
+				for (int8_t j = font.width - 1; j >= 0; j--, col++) {
+					if (col < skipLeft || col >= lastColumn) {
+						continue;
+					}
+					if (bits & (1UL << j)) {
+						GPIOD->ODR = foregroundBus;
+					} else {
+						GPIOD->ODR = backgroundBus;
+					}
+					strobe();
+				}
+			}
+		}
+	}
+	display_EndStream();
+}
+
 void display_Char(int16_t x, int16_t y, uint8_t c) {
 	if(x > active.maxX || y > active.maxY || x + font.width < active.minX || y + font.height < active.minY) {
 		/* Character completely out of active area, skip */
@@ -384,41 +619,33 @@ void display_Char(int16_t x, int16_t y, uint8_t c) {
 	if (y + font.height > active.maxY + 1)
 		skipBottom = y + font.height - active.maxY - 1;
 
-	setXY(x + skipLeft, y + skipTop, x + font.width - 1 - skipRight, y + font.height - 1 - skipBottom);
-	/* number of bytes in font per row */
-	uint8_t yInc = (font.width - 1) / 8 + 1;
-	const uint8_t *charIndex = font.data + c * yInc * font.height;
-	uint8_t i, j;
-	uint8_t startMask = 0x80 >> (yInc * 8 - font.width);
-	for (i = skipTop; i < font.height - skipBottom; i++) {
-		uint8_t offset = (i + 1) * yInc - 1;
-		uint8_t bitMask = startMask;
-		for (j = 0; j < font.width - skipRight; j++) {
-			if (j >= skipLeft) {
-				uint16_t color;
-				if (charIndex[offset] & bitMask) {
-					color = foreground;
-				} else {
-					color = background;
-				}
-				writeData(color);
-			}
-			bitMask >>= 1;
-			if (!bitMask) {
-				bitMask = 0x80;
-				offset--;
-			}
-		}
-	}
+	drawText(x, y, &c, 1, skipLeft, skipRight, skipTop, skipBottom);
 }
 
 void display_String(int16_t x, int16_t y, const char *s) {
-	while (*s) {
-		display_Char(x, y, *s++);
-		x += font.width;
-		if (x > active.maxX)
-			break;
+	/* characters starting inside the active area */
+	uint16_t n = 0;
+	while (s[n] && x + n * font.width <= active.maxX) {
+		n++;
+	}
+	int16_t width = n * font.width;
+	if (!n || y > active.maxY || x + width < active.minX
+			|| y + font.height < active.minY) {
+		/* String completely out of active area, skip */
+		return;
 	}
+	uint16_t skipLeft = 0, skipRight = 0, skipTop = 0, skipBottom = 0;
+	if (x < active.minX)
+		skipLeft = active.minX - x;
+	if (y < active.minY)
+		skipTop = active.minY - y;
+	if (x + width > active.maxX + 1)
+		skipRight = x + width - active.maxX - 1;
+	if (y + font.height > active.maxY + 1)
+		skipBottom = y + font.height - active.maxY - 1;
+
+	drawText(x, y, (const uint8_t*) s, n, skipLeft, skipRight, skipTop,
+			skipBottom);
 }
 
 void display_Image(int16_t x, int16_t y, const Image_t *im) {
@@ -426,30 +653,28 @@ void display_Image(int16_t x, int16_t y, const Image_t *im) {
 //	usb_DisplayCommand(1, y);
 //	usb_DisplayCommand(2, x + im->width - 1);
 //	usb_DisplayCommand(3, y + im->height - 1);
-	setXY(x, y, x + im->width - 1, y + im->height - 1);
-	uint32_t i = im->width * im->height;
-	const uint16_t *ptr = im->data;
-	for (; i > 0; i--) {
-		writeData(*ptr++);
-//		usb_DisplayCommand(4, *ptr++);
-	}
+	display_BeginStream(x, y, x + im->width - 1, y + im->height - 1);
+	display_StreamPixels(im->data, im->width * im->height);
+	display_EndStream();
 }
 void display_ImageGrayscale(int16_t x, int16_t y, const Image_t *im){
 	//	usb_DisplayCommand(0, x);
 	//	usb_DisplayCommand(1, y);
 	//	usb_DisplayCommand(2, x + im->width - 1);
 	//	usb_DisplayCommand(3, y + im->height - 1);
-	setXY(x, y, x + im->width - 1, y + im->height - 1);
+	display_BeginStream(x, y, x + im->width - 1, y + im->height - 1);
 	uint32_t i = im->width * im->height;
 	const uint16_t *ptr = im->data;
 	for (; i > 0; i--) {
 		/* convert to grayscale */
 		uint16_t gray = COLOR_R(*ptr) + COLOR_G(*ptr) + COLOR_B(*ptr);
 		gray /= 3;
-		writeData(COLOR(gray, gray, gray));
+		uint16_t pixel = COLOR(gray, gray, gray);
+		display_StreamPixels(&pixel, 1);
 //		usb_DisplayCommand(4, COLOR(gray, gray, gray));
 		ptr++;
 	}
+	display_EndStream();
 }
 
 void display_SetActiveArea(uint16_t minx, uint16_t maxx, uint16_t miny,
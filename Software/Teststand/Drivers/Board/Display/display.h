@@ -25,6 +25,8 @@ void display_SetForeground(color_t c);
 color_t display_GetForeground(void);
 void display_SetBackground(color_t c);
 color_t display_GetBackground(void);
+/* Characters and strings only draw their foreground pixels */
+void display_SetTransparent(uint8_t t);
 void display_Clear();
 void display_Pixel(int16_t x, int16_t y, uint16_t color);
 void display_HorizontalLine(int16_t x, int16_t y, uint16_t length);
@@ -41,6 +43,15 @@ void display_ImageGrayscale(int16_t x, int16_t y, const Image_t *im);
 void display_SetActiveArea(uint16_t minx, uint16_t maxx, uint16_t miny, uint16_t maxy);
 void display_SetDefaultArea();
 
+/*
+ * Writes the pixels of a window in rows from the top left corner, keeping CS
+ * low and RS high in between. No other display function may be called until
+ * display_EndStream. The window is not clipped to the active area.
+ */
+void display_BeginStream(int16_t x0, int16_t y0, int16_t x1, int16_t y1);
+void display_StreamPixels(const uint16_t *pixels, uint32_t count);
+void display_EndStream(void);
+
 #ifdef __cplusplus
 }
 #endif
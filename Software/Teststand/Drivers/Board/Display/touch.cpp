@@ -1,6 +1,7 @@
 #include "touch.hpp"
-#include "FreeRTOS.h"
-#include "semphr.h"
+#include "spibus.h"
+#include "log.h"
+#include <cstdlib>
 
 #define CS_LOW()			(TOUCH_CS_GPIO_Port->BSRR = TOUCH_CS_Pin<<16u)
 #define CS_HIGH()			(TOUCH_CS_GPIO_Port->BSRR = TOUCH_CS_Pin)
@@ -27,20 +28,17 @@
 
 
 extern SPI_HandleTypeDef hspi1;
-extern SemaphoreHandle_t xMutexSPI1;
+static spibus_device_t bus;
 
 void Touch::Init(void) {
 	CS_HIGH();
+	/* Minimum CLK frequency is 2.5MHz, this could be achieved with a prescaler of 16
+	 * (2.25MHz). For reliability, a prescaler of 32 is used. The bus applies it
+	 * whenever the touch controller gets access */
+	spibus_register(&bus, "Touch", SPI_BAUDRATEPRESCALER_32, SPIBUS_PRIO_LOW);
 }
 
 static uint16_t ADS7843_Read(uint8_t control) {
-	/* SPI3 is also used for the SD card. Reduce speed now to properly work with
-	 * ADS7843 */
-	uint16_t cr1 = hspi1.Instance->CR1;
-	/* Minimum CLK frequency is 2.5MHz, this could be achieved with a prescaler of 16
-	 * (2.25MHz). For reliability, a prescaler of 32 is used */
-	hspi1.Instance->CR1 = (hspi1.Instance->CR1 & ~SPI_BAUDRATEPRESCALER_256 )
-			| SPI_BAUDRATEPRESCALER_32;
 	CS_LOW();
 	/* highest bit in control must always be one */
 	control |= 0x80;
@@ -55,47 +53,131 @@ static uint16_t ADS7843_Read(uint8_t control) {
 	res >>= 3;
 	res &= 0x0FFF;
 	CS_HIGH();
-	/* Reset SPI speed to previous value */
-	hspi1.Instance->CR1 = cr1;
 	return 4095 - res;
 }
 
-static bool touch_SampleADC(int16_t *rawX, int16_t *rawY, uint16_t samples) {
-	uint16_t i;
+/* Samples per axis and chunk, the bus is released between chunks */
+constexpr uint8_t MinChunk = 4;
+constexpr uint8_t MaxChunk = 16;
+constexpr uint8_t MaxChunks = 6;
+/* Consecutive chunk results closer than this end the sampling early */
+constexpr int16_t Agreement = 6;
+/* Range of the samples within a chunk above which the touch is considered
+ * unstable */
+constexpr uint16_t MaxSpread = 500;
+
+/* Running estimate of the reading noise, selects the chunk size */
+static uint16_t noise = 16;
+/* Bus usage of the touch controller, counted in windows of one second */
+constexpr uint32_t BusWindow = 1000000UL;
+static uint32_t busTime;
+static uint32_t busWindowStart;
+static uint32_t busTimePerSecond;
+
+/* Closes the current window if it is over, must be called from within a
+ * critical section. Time is only added to open windows, so a window closed
+ * late is still exact. If more than one window has passed, the last one had
+ * no touch traffic. Returns true if a window has been closed */
+static bool closeBusWindow() {
+	uint32_t elapsed = getRunTimeCounterValue() - busWindowStart;
+	if (elapsed < BusWindow) {
+		return false;
+	}
+	busTimePerSecond = elapsed < 2 * BusWindow ? busTime : 0;
+	busTime = 0;
+	busWindowStart += elapsed - elapsed % BusWindow;
+	return true;
+}
+
+static void accountBusTime(uint32_t us) {
+	taskENTER_CRITICAL();
+	bool closed = closeBusWindow();
+	busTime += us;
+	uint32_t perSecond = busTimePerSecond;
+	taskEXIT_CRITICAL();
+	if (closed) {
+		LOG(Log_Input, LevelDebug, "Touch bus time: %luus/s", perSecond);
+	}
+}
+
+/* Reads n samples of one channel and returns the mean of the middle half.
+ * range is set to the range of all samples, spread to the range of the
+ * middle half */
+static int16_t touch_SampleChannel(uint8_t control, uint8_t n,
+		uint16_t &range, uint16_t &spread) {
+	int16_t v[MaxChunk];
+	for (uint8_t i = 0; i < n; i++) {
+		int16_t sample = ADS7843_Read(control);
+		/* insertion sort */
+		uint8_t j = i;
+		for (; j > 0 && v[j - 1] > sample; j--) {
+			v[j] = v[j - 1];
+		}
+		v[j] = sample;
+	}
+	uint8_t lo = n / 4;
+	uint8_t hi = n - n / 4;
+	int32_t sum = 0;
+	for (uint8_t i = lo; i < hi; i++) {
+		sum += v[i];
+	}
+	range = v[n - 1] - v[0];
+	spread = v[hi - 1] - v[lo];
+	return sum / (hi - lo);
+}
+
+static bool touch_SampleADC(int16_t *rawX, int16_t *rawY) {
+	/* use more samples per chunk if the readings are noisy */
+	uint8_t chunk = MinChunk;
+	while (chunk < MaxChunk && noise > chunk * 2) {
+		chunk *= 2;
+	}
 	int32_t X = 0;
 	int32_t Y = 0;
-	int16_t Xmax = INT16_MIN, Ymax = INT16_MIN;
-	int16_t Xmin = INT16_MAX, Ymin = INT16_MAX;
-	for (i = 0; i < samples; i++) {
-		int16_t xsample = ADS7843_Read(
-		CHANNEL_X | DIFFERENTIAL | BITS12 | PD_PENIRQ);
-		X += xsample;
-		if (xsample > Xmax) {
-			Xmax = xsample;
+	int16_t lastX = 0, lastY = 0;
+	uint16_t maxSpread = 0;
+	uint8_t chunks = 0;
+	bool settled = false;
+	while (chunks < MaxChunks && !settled) {
+		/* Acquire SPI resource */
+		if (!spibus_acquire(&bus, 10)) {
+			/* SPI is busy */
+			return false;
 		}
-		if (xsample < Xmin) {
-			Xmin = xsample;
+		uint32_t start = getRunTimeCounterValue();
+		uint16_t rangeX, rangeY, spreadX, spreadY;
+		int16_t x = touch_SampleChannel(
+				CHANNEL_X | DIFFERENTIAL | BITS12 | PD_PENIRQ, chunk, rangeX,
+				spreadX);
+		int16_t y = touch_SampleChannel(
+				CHANNEL_Y | DIFFERENTIAL | BITS12 | PD_PENIRQ, chunk, rangeY,
+				spreadY);
+		uint32_t duration = getRunTimeCounterValue() - start;
+		/* Release SPI resource */
+		spibus_release(&bus);
+		accountBusTime(duration);
+		if (rangeX > MaxSpread || rangeY > MaxSpread) {
+			return false;
 		}
-	}
-	for (i = 0; i < samples; i++) {
-		int16_t ysample = ADS7843_Read(
-		CHANNEL_Y | DIFFERENTIAL | BITS12 | PD_PENIRQ);
-		Y += ysample;
-		if (ysample > Ymax) {
-			Ymax = ysample;
+		if (spreadX > maxSpread) {
+			maxSpread = spreadX;
 		}
-		if (ysample < Ymin) {
-			Ymin = ysample;
+		if (spreadY > maxSpread) {
+			maxSpread = spreadY;
 		}
+		if (chunks && abs(x - lastX) <= Agreement && abs(y - lastY) <= Agreement) {
+			settled = true;
+		}
+		lastX = x;
+		lastY = y;
+		X += x;
+		Y += y;
+		chunks++;
 	}
-	*rawX = X / samples;
-	*rawY = Y / samples;
-	constexpr uint16_t maxDiff = 500;
-	if (Xmax - Xmin > maxDiff || Ymax - Ymin > maxDiff) {
-		return false;
-	} else {
-		return true;
-	}
+	noise += ((int32_t) maxSpread - noise) / 4;
+	*rawX = X / chunks;
+	*rawY = Y / chunks;
+	return true;
 }
 
 bool Touch::GetCoordinates(coords_t &c) {
@@ -104,14 +186,7 @@ bool Touch::GetCoordinates(coords_t &c) {
 		bool valid = false;
 		/* screen is being touched */
 		/* Acquire SPI resource */
-		if (xSemaphoreTake(xMutexSPI1, 10)) {
-			 valid = touch_SampleADC(&c.x, &c.y, 50);
-			/* Release SPI resource */
-			xSemaphoreGive(xMutexSPI1);
-		} else {
-			/* SPI is busy */
-			return false;
-		}
+		valid = touch_SampleADC(&c.x, &c.y);
 		if (!PENIRQ()) {
 			/* touch has been released during measurement */
 			return false;
@@ -133,6 +208,15 @@ bool Touch::GetCoordinates(coords_t &c) {
 	}
 }
 
+uint32_t Touch::BusTimePerSecond() {
+	/* no touch samples are taken while idle, the window is closed here */
+	taskENTER_CRITICAL();
+	closeBusWindow();
+	uint32_t ret = busTimePerSecond;
+	taskEXIT_CRITICAL();
+	return ret;
+}
+
 bool Touch::SetPENCallback(exti_callback_t cb, void* ptr) {
 	return exti_set_callback(TOUCH_IRQ_GPIO_Port, TOUCH_IRQ_Pin,
 			EXTI_TYPE_FALLING, EXTI_PULL_UP, cb, ptr) == EXTI_RES_OK;
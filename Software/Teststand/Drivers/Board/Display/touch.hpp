@@ -12,6 +12,9 @@ namespace Touch {
 
 void Init(void);
 bool GetCoordinates(coords_t &c);
+// bus time spent on touch sampling in us per second (last full second, 0
+// without touch traffic)
+uint32_t BusTimePerSecond();
 bool SetPENCallback(exti_callback_t cb, void *ptr);
 bool ClearPENCallback(void);
 }
@@ -4,56 +4,98 @@
 #include "log.h"
 #include "FreeRTOS.h"
 #include "task.h"
-#include "semphr.h"
+#include <string.h>
 
-extern SemaphoreHandle_t xMutexSPI1;
-
-static max11254_result_t SPIWrite(max11254_t *m, uint8_t *data, uint8_t length) {
-	xSemaphoreTake(xMutexSPI1, portMAX_DELAY);
-	m->CSgpio->BSRR = m->CSpin << 16;
-	// Start the transmission
-#if MAX11254_MODE == MAX11254_MODE_POLLING
-	HAL_SPI_Transmit(m->spi, data, length, 1000);
-#elif MAX11254_MODE == MAX11254_MODE_IT
-	m->SPIdone = false;
-	HAL_SPI_Transmit_IT(m->spi, data, length);
-#elif MAX11254_MODE == MAX11254_MODE_DMA
-	m->SPIdone = false;
-	HAL_SPI_Transmit_DMA(m->spi, data, length);
-#endif
 #if MAX11254_MODE != MAX11254_MODE_POLLING
-	// Wait for transmission to finish
-	while (!m->SPIdone) {
-		vTaskDelay(1);
+// Starts the transfer, max11254_on_SPI_complete() is called when it is done
+static HAL_StatusTypeDef StartTransfer(max11254_t *m, uint8_t *write,
+		uint8_t *read, uint8_t length) {
+#if MAX11254_MODE == MAX11254_MODE_IT
+	if (read) {
+		return HAL_SPI_TransmitReceive_IT(m->spi, write, read, length);
+	} else {
+		return HAL_SPI_Transmit_IT(m->spi, write, length);
+	}
+#elif MAX11254_MODE == MAX11254_MODE_DMA
+	if (read) {
+		return HAL_SPI_TransmitReceive_DMA(m->spi, write, read, length);
+	} else {
+		return HAL_SPI_Transmit_DMA(m->spi, write, length);
 	}
 #endif
-	m->CSgpio->BSRR = m->CSpin;
-	xSemaphoreGive(xMutexSPI1);
-	return MAX11254_RES_OK;
 }
 
-static max11254_result_t SPIWriteRead(max11254_t *m, uint8_t *write, uint8_t *read, uint8_t length) {
-	xSemaphoreTake(xMutexSPI1, portMAX_DELAY);
+static void SPIComplete(void *ptr) {
+	max11254_on_SPI_complete((max11254_t*) ptr);
+}
+
+static max11254_result_t WaitTransfer(max11254_t *m) {
+	max11254_result_t res = MAX11254_RES_OK;
+	uint32_t notified = 0;
+	uint32_t other = 0;
+	while (!(notified & MAX11254_NOTIFY_SPI)) {
+		if (xTaskNotifyWait(0, MAX11254_NOTIFY_SPI, &notified,
+				pdMS_TO_TICKS(100)) != pdTRUE) {
+			LOG(Log_MAX11254, LevelError, "SPI transfer timed out");
+			HAL_SPI_Abort(m->spi);
+			res = MAX11254_RES_ERROR;
+			break;
+		}
+		other |= notified & ~MAX11254_NOTIFY_SPI;
+	}
+	m->task = NULL;
+	// the error interrupt completes the transfer as well
+	if (res == MAX11254_RES_OK && m->spi->ErrorCode != HAL_SPI_ERROR_NONE) {
+		LOG(Log_MAX11254, LevelError, "SPI transfer failed: %lx",
+				m->spi->ErrorCode);
+		res = MAX11254_RES_ERROR;
+	}
+	if (other) {
+		// waking up on other bits took away their pending state, restore it
+		xTaskNotify(xTaskGetCurrentTaskHandle(), 0, eSetBits);
+	}
+	return res;
+}
+#endif
+
+static max11254_result_t Transfer(max11254_t *m, uint8_t *write, uint8_t *read,
+		uint8_t length) {
+	max11254_result_t res = MAX11254_RES_OK;
+	m->transactions++;
 	m->CSgpio->BSRR = m->CSpin << 16;
 	// Start the transmission
 #if MAX11254_MODE == MAX11254_MODE_POLLING
-	HAL_SPI_TransmitReceive(m->spi, write, read, length, 1000);
-#elif MAX11254_MODE == MAX11254_MODE_IT
-	m->SPIdone = false;
-	HAL_SPI_TransmitReceive_IT(m->spi, write, read, length);
-#elif MAX11254_MODE == MAX11254_MODE_DMA
-	m->SPIdone = false;
-	HAL_SPI_TransmitReceive_DMA(m->spi, write, read, length);
-#endif
-#if MAX11254_MODE != MAX11254_MODE_POLLING
-	// Wait for transmission to finish
-	while (!m->SPIdone) {
-		vTaskDelay(1);
+	if (read) {
+		HAL_SPI_TransmitReceive(m->spi, write, read, length, 1000);
+	} else {
+		HAL_SPI_Transmit(m->spi, write, length, 1000);
+	}
+#else
+	m->task = xTaskGetCurrentTaskHandle();
+	if (StartTransfer(m, write, read, length) != HAL_OK) {
+		m->task = NULL;
+		res = MAX11254_RES_ERROR;
+	} else {
+		// Block until the completion interrupt notifies this task
+		res = WaitTransfer(m);
 	}
 #endif
 	m->CSgpio->BSRR = m->CSpin;
-	xSemaphoreGive(xMutexSPI1);
-	return MAX11254_RES_OK;
+	return res;
+}
+
+static max11254_result_t SPIWrite(max11254_t *m, uint8_t *data, uint8_t length) {
+	spibus_acquire(&m->bus, portMAX_DELAY);
+	max11254_result_t res = Transfer(m, data, NULL, length);
+	spibus_release(&m->bus);
+	return res;
+}
+
+static max11254_result_t SPIWriteRead(max11254_t *m, uint8_t *write, uint8_t *read, uint8_t length) {
+	spibus_acquire(&m->bus, portMAX_DELAY);
+	max11254_result_t res = Transfer(m, write, read, length);
+	spibus_release(&m->bus);
+	return res;
 }
 
 static max11254_result_t Command(max11254_t *m, max11254_mode_t mode, max11254_rate_t rate) {
@@ -164,13 +206,28 @@ static uint32_t Extract(max11254_reg_t reg, uint8_t *src) {
 	return ret;
 }
 
+static uint8_t IsShadowed(max11254_reg_t reg) {
+	return reg >= MAX11254_REG_CTRL1 && reg <= MAX11254_REG_SEQ;
+}
+
+static void UpdateShadow(max11254_t *m, max11254_reg_t reg, uint32_t value) {
+	if (IsShadowed(reg)) {
+		m->shadow[reg - 1] = value;
+		m->shadowValid |= 1 << (reg - 1);
+	}
+}
+
 static max11254_result_t Write(max11254_t *m, max11254_reg_t reg, uint32_t data) {
 	uint8_t d[4];
 	// build register address + write command
 	d[0] = 0xC0 | ((uint8_t) reg << 1);
 	// copy necessary data bytes
 	uint8_t length = PrepareData(reg, &d[1], data);
-	return SPIWrite(m, d, length + 1);
+	max11254_result_t res = SPIWrite(m, d, length + 1);
+	if (res == MAX11254_RES_OK) {
+		UpdateShadow(m, reg, data);
+	}
+	return res;
 }
 
 static uint32_t Read(max11254_t *m, max11254_reg_t reg) {
@@ -181,31 +238,58 @@ static uint32_t Read(max11254_t *m, max11254_reg_t reg) {
 	if (SPIWriteRead(m, snd, rec, length + 1) != MAX11254_RES_OK) {
 		return 0;
 	}
-	return Extract(reg, &rec[1]);
+	uint32_t val = Extract(reg, &rec[1]);
+	UpdateShadow(m, reg, val);
+	return val;
 }
 
-static max11254_result_t SetBits(max11254_t *m, max11254_reg_t reg, uint32_t mask) {
-	uint32_t val = Read(m, reg);
-	val |= mask;
-	return Write(m, reg, val);
-}
-
-static max11254_result_t ClearBits(max11254_t *m, max11254_reg_t reg, uint32_t mask) {
-	uint32_t val = Read(m, reg);
-	val &= ~mask;
-	return Write(m, reg, val);
+// Returns the register value from the shadow if possible, reads it otherwise
+static uint32_t ReadCached(max11254_t *m, max11254_reg_t reg) {
+	if (IsShadowed(reg) && (m->shadowValid & (1 << (reg - 1)))) {
+		return m->shadow[reg - 1];
+	}
+	return Read(m, reg);
 }
 
 static uint8_t ModifyReg(max11254_t *m, max11254_reg_t reg, uint32_t mask, uint32_t value) {
-	uint32_t val = Read(m, reg);
+	uint32_t old = ReadCached(m, reg);
 	// clear bits indicated by mask
-	val &= ~mask;
+	uint32_t val = old & ~mask;
 	// set bits depending on mask and value
 	val |= (mask & value);
+	if (val == old && IsShadowed(reg)) {
+		// register already holds the requested value
+		return MAX11254_RES_OK;
+	}
 	return Write(m, reg, val);
 }
 
+static max11254_result_t SetBits(max11254_t *m, max11254_reg_t reg, uint32_t mask) {
+	return ModifyReg(m, reg, mask, mask);
+}
+
+static max11254_result_t ClearBits(max11254_t *m, max11254_reg_t reg, uint32_t mask) {
+	return ModifyReg(m, reg, mask, 0);
+}
+
+void max11254_invalidate_shadow(max11254_t *m) {
+	m->shadowValid = 0;
+}
+
 max11254_result_t max11254_init(max11254_t *m){
+	// register content is unknown after (re)initialization
+	max11254_invalidate_shadow(m);
+	m->transactions = 0;
+	// conversion results have to be fetched before the next scan completes,
+	// always served first
+	spibus_register(&m->bus, "MAX11254", SPI_BAUDRATEPRESCALER_8,
+			SPIBUS_PRIO_HIGH);
+#if MAX11254_MODE != MAX11254_MODE_POLLING
+	m->task = NULL;
+	m->asyncCb = NULL;
+	spibus_set_complete_callback(&m->bus, SPIComplete, m);
+#endif
+
 	// initialize GPIO pins
 	GPIO_InitTypeDef gpio;
 	gpio.Mode = GPIO_MODE_OUTPUT_PP;
@@ -243,7 +327,7 @@ max11254_state_t max11254_get_state(max11254_t *m) {
 	return Read(m, MAX11254_REG_STAT);
 }
 uint8_t max11254_out_of_range(max11254_state_t s) {
-	return (s & 0x000300);
+	return (s & 0x000300) != 0x000000;
 }
 max11254_pdmode_t max11254_pdmode_from_state(max11254_state_t s) {
 	return (max11254_pdmode_t) ((s & 0x00000C) >> 2);
@@ -254,6 +338,10 @@ uint8_t max11254_has_error(max11254_state_t s) {
 
 void max11254_set_pdmode(max11254_t *m, max11254_pdmode_t pdmode) {
 	ModifyReg(m, MAX11254_REG_CTRL1, 0x30, (uint8_t) pdmode << 4);
+	if (pdmode == MAX11254_PDMODE_RESET) {
+		// all registers return to their default values
+		max11254_invalidate_shadow(m);
+	}
 }
 void max11254_power_down(max11254_t *m) {
 	Command(m, MAX11254_MODE_POWERDOWN, MAX11254_RATE_CONT1_9_SINGLE50);
@@ -263,6 +351,83 @@ int32_t max11254_read_result(max11254_t *m, uint8_t channel) {
 	int32_t ret = Read(m, (max11254_reg_t) ((int) MAX11254_REG_DATA0 + channel));
 	return util_sign_extend_32(ret, 24);
 }
+// Builds one read frame (command + 3 data bytes) per selected data register
+static uint8_t PrepareResultFrames(uint8_t channelMask, uint8_t snd[6][4],
+		uint8_t channels[6]) {
+	ASSERT(!(channelMask & ~0x3F));
+	uint8_t n = 0;
+	for (uint8_t i = 0; i < 6; i++) {
+		if (channelMask & (1 << i)) {
+			memset(snd[n], 0, sizeof(snd[n]));
+			snd[n][0] = 0xC1 | (((uint8_t) MAX11254_REG_DATA0 + i) << 1);
+			channels[n++] = i;
+		}
+	}
+	return n;
+}
+
+static void ExtractResults(uint8_t rec[6][4], const uint8_t channels[6],
+		uint8_t n, int32_t out[6]) {
+	for (uint8_t i = 0; i < n; i++) {
+		int32_t raw = Extract(MAX11254_REG_DATA0, &rec[i][1]);
+		out[channels[i]] = util_sign_extend_32(raw, 24);
+	}
+}
+
+max11254_result_t max11254_read_results(max11254_t *m, uint8_t channelMask,
+		int32_t out[6]) {
+	uint8_t snd[6][4], rec[6][4];
+	uint8_t channels[6];
+	uint8_t n = PrepareResultFrames(channelMask, snd, channels);
+	if (!n) {
+		return MAX11254_RES_OK;
+	}
+	// clock out all frames back to back while holding the bus only once
+	max11254_result_t res = MAX11254_RES_OK;
+	spibus_acquire(&m->bus, portMAX_DELAY);
+	for (uint8_t i = 0; i < n && res == MAX11254_RES_OK; i++) {
+		res = Transfer(m, snd[i], rec[i], 4);
+	}
+	spibus_release(&m->bus);
+	if (res == MAX11254_RES_OK) {
+		ExtractResults(rec, channels, n, out);
+	}
+	return res;
+}
+
+max11254_result_t max11254_read_results_async(max11254_t *m,
+		uint8_t channelMask, int32_t out[6], max11254_callback_t cb,
+		void *ptr) {
+	ASSERT(cb);
+#if MAX11254_MODE == MAX11254_MODE_POLLING
+	max11254_result_t res = max11254_read_results(m, channelMask, out);
+	cb(res, ptr);
+	return res;
+#else
+	uint8_t n = PrepareResultFrames(channelMask, m->asyncSnd,
+			m->asyncChannels);
+	if (!n) {
+		cb(MAX11254_RES_OK, ptr);
+		return MAX11254_RES_OK;
+	}
+	spibus_acquire(&m->bus, portMAX_DELAY);
+	m->asyncFrames = n;
+	m->asyncPos = 0;
+	m->asyncOut = out;
+	m->asyncPtr = ptr;
+	m->asyncCb = cb;
+	m->transactions++;
+	m->CSgpio->BSRR = m->CSpin << 16;
+	// the remaining frames are started from the completion interrupt
+	if (StartTransfer(m, m->asyncSnd[0], m->asyncRec[0], 4) != HAL_OK) {
+		m->CSgpio->BSRR = m->CSpin;
+		m->asyncCb = NULL;
+		spibus_release(&m->bus);
+		return MAX11254_RES_ERROR;
+	}
+	return MAX11254_RES_OK;
+#endif
+}
 
 // Sequence Mode 1 functions
 int32_t max11254_single_conversion(max11254_t *m, uint8_t channel,
@@ -387,6 +552,36 @@ max11254_result_t max11254_scan_conversion_static_gpio(max11254_t *m,
 
 	return MAX11254_RES_OK;
 }
+
+max11254_result_t max11254_scan_conversion_continuous(max11254_t *m,
+		max11254_rate_t rate, exti_callback_t cb, void *ptr) {
+	// select sequencer mode 2: SEQ:MODE = 01
+	ModifyReg(m, MAX11254_REG_SEQ, 0x18, 0x08);
+
+	// RDBY asserted only at end of sequence: SEQ:RDYBEN = 1
+	SetBits(m, MAX11254_REG_SEQ, 0x01);
+
+	// select continuous scan: CTRL1:SCYCLE, CTRL1:CONTSC
+	ModifyReg(m, MAX11254_REG_CTRL1, 0x03, 0x03);
+
+	// Enable finished conversion callback
+	if (exti_set_callback(m->RDYBgpio, m->RDYBpin, EXTI_TYPE_FALLING,
+			EXTI_PULL_UP, cb, ptr) != EXTI_RES_OK) {
+		return MAX11254_RES_ERROR;
+	}
+
+	if (max11254_has_error(max11254_get_state(m))) {
+		LOG(Log_MAX11254, LevelError,
+				"Unable to start continuous sequencer mode 2 due to error");
+		return MAX11254_RES_ERROR;
+	}
+
+	// start conversion, the sequencer keeps scanning until powered down
+	Command(m, MAX11254_MODE_SEQUENCER, rate);
+
+	return MAX11254_RES_OK;
+}
+
 max11254_result_t max11254_scan_conversion_dynamic_gpio(max11254_t *m,
 		max11254_rate_t rate, exti_callback_t cb, void *ptr) {
 	// select sequencer mode 3: SEQ:MODE = 10
@@ -511,6 +706,35 @@ uint8_t max11254_get_GPIO(max11254_t *m, max11254_gpio_t gpio) {
 
 #if MAX11254_MODE != MAX11254_MODE_POLLING
 void max11254_on_SPI_complete(max11254_t *m) {
-	m->SPIdone = 1;
+	BaseType_t woken = pdFALSE;
+	if (m->asyncCb) {
+		max11254_result_t res = MAX11254_RES_OK;
+		m->CSgpio->BSRR = m->CSpin;
+		if (m->spi->ErrorCode != HAL_SPI_ERROR_NONE) {
+			// the error interrupt ends the chain, the frame is garbage
+			res = MAX11254_RES_ERROR;
+		} else if (++m->asyncPos < m->asyncFrames) {
+			// next data register
+			m->transactions++;
+			m->CSgpio->BSRR = m->CSpin << 16;
+			if (StartTransfer(m, m->asyncSnd[m->asyncPos],
+					m->asyncRec[m->asyncPos], 4) == HAL_OK) {
+				return;
+			}
+			// give up, the bus must not stay blocked
+			m->CSgpio->BSRR = m->CSpin;
+			res = MAX11254_RES_ERROR;
+		} else {
+			ExtractResults(m->asyncRec, m->asyncChannels, m->asyncFrames,
+					m->asyncOut);
+		}
+		max11254_callback_t cb = m->asyncCb;
+		m->asyncCb = NULL;
+		spibus_release_from_isr(&m->bus, &woken);
+		cb(res, m->asyncPtr);
+	} else if (m->task) {
+		xTaskNotifyFromISR(m->task, MAX11254_NOTIFY_SPI, eSetBits, &woken);
+	}
+	portYIELD_FROM_ISR(woken);
 }
 #endif
@@ -5,23 +5,57 @@
 #define MAX11254_MODE_IT			1
 #define MAX11254_MODE_DMA			2
 
-#define MAX11254_MODE				MAX11254_MODE_POLLING
+#define MAX11254_MODE				MAX11254_MODE_DMA
+
+// In IT/DMA mode the calling task blocks on this bit of its notification value
+// until the transfer has finished. Tasks using the driver must treat their
+// notification value as bit field and leave this bit alone
+#define MAX11254_NOTIFY_SPI			0x80000000UL
+
+// number of configuration registers (CTRL1..SEQ) kept in the register shadow
+#define MAX11254_SHADOW_REGS		8
 
 #include "stm.h"
 #include "exti.h"
+#include "spibus.h"
+#include "task.h"
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+typedef enum {
+	MAX11254_RES_OK,
+	MAX11254_RES_ERROR,
+} max11254_result_t;
+
+// res is MAX11254_RES_ERROR if a transfer could not be started or failed
+typedef void(*max11254_callback_t)(max11254_result_t res, void *ptr);
+
 typedef struct {
 	SPI_HandleTypeDef *spi;
 	GPIO_TypeDef *CSgpio;
 	uint16_t CSpin;
+	spibus_device_t bus;
 	GPIO_TypeDef *RDYBgpio;
 	uint16_t RDYBpin;
+	// write-through copies of CTRL1..SEQ, valid if bit (reg - 1) is set
+	uint32_t shadow[MAX11254_SHADOW_REGS];
+	uint8_t shadowValid;
+	// number of SPI transactions (CS frames) since init
+	uint32_t transactions;
 #if MAX11254_MODE != MAX11254_MODE_POLLING
-	uint8_t SPIdone;
+	// task waiting for the current transfer
+	TaskHandle_t task;
+	// state of max11254_read_results_async()
+	max11254_callback_t asyncCb;
+	void *asyncPtr;
+	int32_t *asyncOut;
+	uint8_t asyncFrames;
+	uint8_t asyncPos;
+	uint8_t asyncChannels[6];
+	uint8_t asyncSnd[6][4];
+	uint8_t asyncRec[6][4];
 #endif
 } max11254_t;
 
@@ -111,11 +145,6 @@ typedef enum {
 	MAX11254_PINSTATE_ALTERNATIVE,
 } max11254_pinstate_t;
 
-typedef enum {
-	MAX11254_RES_OK,
-	MAX11254_RES_ERROR,
-} max11254_result_t;
-
 typedef uint32_t max11254_state_t;
 
 max11254_result_t max11254_init(max11254_t *m);
@@ -125,9 +154,23 @@ uint8_t max11254_out_of_range(max11254_state_t s);
 max11254_pdmode_t max11254_pdmode_from_state(max11254_state_t s);
 uint8_t max11254_has_error(max11254_state_t s);
 
+void max11254_invalidate_shadow(max11254_t *m);
 void max11254_set_pdmode(max11254_t *m, max11254_pdmode_t pdmode);
 void max11254_power_down(max11254_t *m);
 int32_t max11254_read_result(max11254_t *m, uint8_t channel);
+// Reads all data registers selected in channelMask (bit n = DATAn) while
+// holding the SPI bus only once. Unselected entries in out are left untouched
+max11254_result_t max11254_read_results(max11254_t *m, uint8_t channelMask,
+		int32_t out[6]);
+// Like max11254_read_results but returns as soon as the first frame has been
+// started. cb is called from the SPI completion interrupt once all results
+// are in out (directly in polling mode). If a later frame cannot be started
+// or a transfer fails, cb is called with MAX11254_RES_ERROR and out is left
+// untouched. No other driver function may be called for this device until
+// then
+max11254_result_t max11254_read_results_async(max11254_t *m,
+		uint8_t channelMask, int32_t out[6], max11254_callback_t cb,
+		void *ptr);
 
 // Sequence Mode 1 functions
 int32_t max11254_single_conversion(max11254_t *m, uint8_t channel, max11254_rate_t rate);
@@ -139,6 +182,8 @@ void max11254_sequence_disable_channel(max11254_t *m, uint8_t channel);
 
 max11254_result_t max11254_scan_conversion_static_gpio(max11254_t *m, max11254_rate_t rate, exti_callback_t cb, void *ptr);
 max11254_result_t max11254_scan_conversion_dynamic_gpio(max11254_t *m, max11254_rate_t rate, exti_callback_t cb, void *ptr);
+// Like static_gpio but the sequencer rescans freely until max11254_power_down()
+max11254_result_t max11254_scan_conversion_continuous(max11254_t *m, max11254_rate_t rate, exti_callback_t cb, void *ptr);
 
 void max11254_enable_MUX_delay(max11254_t *m, uint8_t enable);
 void max11254_enable_GPO_delay(max11254_t *m, uint8_t enable);
@@ -79,7 +79,8 @@ void HardFault_Handler()
 #endif
 
 #if configGENERATE_RUN_TIME_STATS
-#define TIM 				2
+// TIM2 is used by the PPM driver, TIM7 is the HAL timebase
+#define TIM 				6
 
 /* Automatically build register names based on timer selection */
 #define TIM_M2(y) 					TIM ## y
@@ -113,6 +114,9 @@ void configureTimerForRunTimeStats(void)
 	uint32_t timerFreq = APB1_freq == AHB_freq ? APB1_freq : APB1_freq * 2;
 
 	TIM_BASE->PSC = (timerFreq / 1000000UL) - 1;
+	// load the prescaler now instead of after the first (slow) overflow
+	TIM_BASE->EGR = TIM_EGR_UG;
+	TIM_BASE->SR = ~TIM_SR_UIF;
 
 	HAL_NVIC_SetPriority(TIM_NVIC_ISR, 0, 0);
 	HAL_NVIC_EnableIRQ(TIM_NVIC_ISR);
@@ -4,6 +4,7 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include "FreeRTOS.h"
 #include "semphr.h"
 #include "freertos_hooks.h"
@@ -27,7 +28,12 @@
 
 #define CLK_DISABLE_M2(x) 	__HAL_RCC_USART ## x ## _CLK_DISABLE()
 #define CLK_DISABLE_M1(x)  	CLK_DISABLE_M2(x)
+#ifdef LOG_CONSOLE
+// the receiver has to stay enabled
+#define CLK_DISABLE()
+#else
 #define CLK_DISABLE()		CLK_DISABLE_M1(LOG_USART)
+#endif
 
 
 #define MAX_LINE_LENGTH		256
@@ -48,14 +54,6 @@
 #define USART_WRITE			TDR
 #endif
 
-static char fifo[LOG_SENDBUF_LENGTH + MAX_LINE_LENGTH];
-static uint16_t fifo_write, fifo_read;
-
-#ifdef LOG_USE_MUTEXES
-static StaticSemaphore_t xMutex;
-static SemaphoreHandle_t mutex;
-#endif
-
 static const char lvl_strings[][4] = {
 	"DBG",
 	"INF",
@@ -64,6 +62,89 @@ static const char lvl_strings[][4] = {
 	"CRT",
 };
 
+static const char source_names[LOG_SOURCES_TOTAL][16] = {
+	"Log_System",
+	"Log_Exti",
+	"Log_App",
+	"Log_MAX11254",
+	"Log_Input",
+	"Log_GUI",
+	"Log_Loadcell",
+	"Log_Config",
+	"Log_Desktop",
+	"Log_SPI",
+	"Log_File",
+	"Log_Log",
+	"Log_ASSERT",
+	"Log_FreeRTOS",
+};
+
+uint8_t log_masks[LOG_SOURCES] = {
+	[0 ... LOG_SOURCES - 1] = LOG_DEFAULT_MASK
+};
+
+static log_stats_t stats;
+static log_source_stats_t sourceStats[LOG_SOURCES_TOTAL];
+// polled output of log_force and log_flush, apart from the buffers in use by
+// the interrupt or the DMA
+static char pollLine[MAX_LINE_LENGTH];
+
+/* Not atomic against other callers, only used for statistics */
+static void account(uint32_t start) {
+	uint32_t cycles = DWT->CYCCNT - start;
+	stats.calls++;
+	stats.cycles += cycles;
+	if (cycles > stats.maxCycles) {
+		stats.maxCycles = cycles;
+	}
+}
+
+static void cycle_counter_init() {
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+void log_get_stats(log_stats_t *s) {
+	*s = stats;
+}
+
+void log_get_source_stats(uint8_t source, log_source_stats_t *s) {
+	*s = sourceStats[source];
+}
+
+void log_reset_stats() {
+	memset(&stats, 0, sizeof(stats));
+	memset(sourceStats, 0, sizeof(sourceStats));
+}
+
+const char* log_source_name(uint8_t source) {
+	return source_names[source] + 4;
+}
+
+void log_set_mask(uint8_t source, uint8_t mask) {
+	log_masks[source] = mask & LevelAll;
+}
+
+uint8_t log_get_mask(uint8_t source) {
+	return log_masks[source];
+}
+
+#ifdef LOG_CONSOLE
+static void console_init();
+static void console_receive();
+#endif
+
+#ifndef LOG_DEFERRED
+
+static char fifo[LOG_SENDBUF_LENGTH + MAX_LINE_LENGTH];
+static uint16_t fifo_write, fifo_read;
+
+#ifdef LOG_USE_MUTEXES
+static StaticSemaphore_t xMutex;
+static SemaphoreHandle_t mutex;
+#endif
+
 #define INC_FIFO_POS(pos, inc) do { pos = (pos + inc) % LOG_SENDBUF_LENGTH; } while(0)
 
 static uint16_t fifo_space() {
@@ -77,6 +158,7 @@ static uint16_t fifo_space() {
 }
 
 void log_init() {
+	cycle_counter_init();
 	fifo_write = 0;
 	fifo_read = 0;
 #ifdef LOG_USE_MUTEXES
@@ -84,11 +166,18 @@ void log_init() {
 #endif
 
 	/* USART interrupt Init */
+#ifdef LOG_CONSOLE
+	// notifies the console task
+	HAL_NVIC_SetPriority(NVIC_ISR, configLIBRARY_MAX_SYSCALL_INTERRUPT_PRIORITY, 0);
+	console_init();
+#else
 	HAL_NVIC_SetPriority(NVIC_ISR, 0, 0);
+#endif
 	HAL_NVIC_EnableIRQ(NVIC_ISR);
 }
 
-void log_write(const char *module, uint8_t level, const char *fmt, ...) {
+void log_write(uint8_t source, uint8_t level, const char *fmt, ...) {
+	uint32_t start = DWT->CYCCNT;
 	int written = 0;
 	va_list args;
 	va_start(args, fmt);
@@ -99,7 +188,7 @@ void log_write(const char *module, uint8_t level, const char *fmt, ...) {
 	}
 #endif
 	written = snprintf(&fifo[fifo_write], MAX_LINE_LENGTH, "%05lu [%6.6s,%s]: ",
-			HAL_GetTick(), module + 4, lvl_strings[lvl]);
+			HAL_GetTick(), log_source_name(source), lvl_strings[lvl]);
 	written += vsnprintf(&fifo[fifo_write + written], MAX_LINE_LENGTH - written,
 			fmt, args);
 	written += snprintf(&fifo[fifo_write + written], MAX_LINE_LENGTH - written,
@@ -112,11 +201,14 @@ void log_write(const char *module, uint8_t level, const char *fmt, ...) {
 #else
 	if (written > fifo_space()) {
 		// unable to fit line, skip
+		stats.dropped++;
+		sourceStats[source].dropped++;
 #ifdef LOG_USE_MUTEXES
 		if (!stm_in_interrupt()) {
 			xSemaphoreGive(mutex);
 		}
 #endif
+		account(start);
 		return;
 	}
 #endif
@@ -126,6 +218,7 @@ void log_write(const char *module, uint8_t level, const char *fmt, ...) {
 		memmove(&fifo[0], &fifo[LOG_SENDBUF_LENGTH], overflow);
 	}
 	INC_FIFO_POS(fifo_write, written);
+	sourceStats[source].emitted++;
 	// enable interrupt
 	CLK_ENABLE();
 	if (!(USART_BASE->CR1 & USART_CR1_TCIE)) {
@@ -138,6 +231,7 @@ void log_write(const char *module, uint8_t level, const char *fmt, ...) {
 		xSemaphoreGive(mutex);
 	}
 #endif
+	account(start);
 }
 
 void log_flush() {
@@ -145,28 +239,18 @@ void log_flush() {
 		;
 }
 
-void log_force(const char *fmt, ...) {
-	CLK_ENABLE();
-	// disable ISR
+/* Stops the interrupt driven output for polling */
+static void stop_output() {
 	USART_BASE->CR1 &= ~(USART_CR1_TXEIE|USART_CR1_TCIE);
-
-	int written = 0;
-	va_list args;
-	va_start(args, fmt);
-	written += vsnprintf(&fifo[written], MAX_LINE_LENGTH - written,
-			fmt, args);
-	written += snprintf(&fifo[written], MAX_LINE_LENGTH - written,
-			"\r\n");
-
-	for (uint16_t i = 0; i < written; i++) {
-		while (!(USART_BASE->USART_ISR_REG & USART_TXE));
-		USART_BASE->USART_WRITE = fifo[i];
-	}
 }
 
 /* Implemented directly here for speed reasons. Disable interrupt in CubeMX! */
 void HANDLER(void) {
-	if (USART_BASE->USART_ISR_REG & USART_TC) {
+#ifdef LOG_CONSOLE
+	console_receive();
+#endif
+	if ((USART_BASE->CR1 & USART_CR1_TCIE)
+			&& (USART_BASE->USART_ISR_REG & USART_TC)) {
 		// clear flag
 		USART_BASE->USART_ISR_REG &= ~USART_TC;
 		if (!(USART_BASE->CR1 & USART_CR1_TXEIE)) {
@@ -187,9 +271,696 @@ void HANDLER(void) {
 	}
 }
 
+#else
+
+#if LOG_USART != 1
+#error "Deferred logging uses the USART1 TX DMA channel"
+#endif
+
+#define RING_WORDS			(LOG_SENDBUF_LENGTH / 4)
+#define RECORD_PADDING		0x01
+#define SYNC_BYTE0			0xA5
+#define SYNC_BYTE1			0x5A
+// first byte of a string argument
+#define STRING_COPY			0x00
+#define STRING_POINTER		0x01
+
+typedef struct {
+	// in words including the header. Written last, the record is complete
+	// once it is not zero
+	uint16_t length;
+	// index into lvl_strings
+	uint8_t level;
+	uint8_t flags;
+	uint32_t timestamp;
+	const char *module;
+	const char *fmt;
+} record_t;
+
+#define HEADER_WORDS		(sizeof(record_t) / 4)
+
+typedef enum {
+	ARG_NONE,
+	ARG_INT,
+	ARG_LONGLONG,
+	ARG_DOUBLE,
+	ARG_STRING,
+} arg_t;
+
+// end of the constants in flash, start of the initial values of .data
+extern const char _sidata[];
+
+static uint32_t ring[RING_WORDS];
+// word positions, head is advanced by the producers, tail by the log task
+static uint32_t head, tail;
+static uint32_t droppedTotal;
+// set by the log task before it waits for a notification, the ring is empty
+static uint8_t idle;
+static TaskHandle_t logHandle;
+static char txbuf[2 * MAX_LINE_LENGTH];
+static DMA_HandleTypeDef dma;
+static StaticSemaphore_t xDmaDone;
+static SemaphoreHandle_t dmaDone;
+
+static void put_polled(const char *data, uint16_t len);
+
+/* Finds the next conversion in fmt, returns the position behind it or NULL if
+ * there is none. *start points to its '%', stars counts '*' widths/precisions */
+static const char* next_conversion(const char *fmt, const char **start,
+		arg_t *type, uint8_t *stars) {
+	while (*fmt) {
+		if (*fmt++ != '%') {
+			continue;
+		}
+		if (*fmt == '%') {
+			fmt++;
+			continue;
+		}
+		*start = fmt - 1;
+		*stars = 0;
+		uint8_t longs = 0;
+		while (*fmt && strchr("-+ #0123456789.*hlzjtL", *fmt)) {
+			if (*fmt == '*') {
+				(*stars)++;
+			} else if (*fmt == 'l') {
+				longs++;
+			} else if (*fmt == 'j') {
+				longs = 2;
+			}
+			fmt++;
+		}
+		switch (*fmt) {
+		case 's':
+			*type = ARG_STRING;
+			break;
+		case 'f': case 'F': case 'e': case 'E':
+		case 'g': case 'G': case 'a': case 'A':
+			*type = ARG_DOUBLE;
+			break;
+		case 'n':
+		case 0:
+			*type = ARG_NONE;
+			break;
+		default:
+			*type = longs >= 2 ? ARG_LONGLONG : ARG_INT;
+			break;
+		}
+		if (*fmt) {
+			fmt++;
+		}
+		return fmt;
+	}
+	return NULL;
+}
+
+/* Strings in flash stay valid, only their address is stored */
+static uint8_t is_constant(const char *str) {
+	return (uint32_t) str >= FLASH_BASE && str < _sidata;
+}
+
+/* Copies the arguments of fmt into dst, stops at the first one that does not
+ * fit. Strings start with STRING_POINTER and their address if they are
+ * constant, RAM strings with STRING_COPY and are truncated to LOG_MAX_STRING.
+ * Returns the number of bytes used */
+static uint16_t capture_args(uint8_t *dst, const char *fmt, va_list ap) {
+	uint16_t len = 0;
+	const char *start;
+	arg_t type;
+	uint8_t stars;
+	while ((fmt = next_conversion(fmt, &start, &type, &stars))) {
+		union {
+			int32_t i;
+			uint64_t ll;
+			double d;
+		} v;
+		uint8_t size = 0;
+		const char *str = NULL;
+		for (uint8_t i = 0; i < stars; i++) {
+			v.i = va_arg(ap, int);
+			if (len + sizeof(v.i) > LOG_MAX_ARGS_LENGTH) {
+				return len;
+			}
+			memcpy(&dst[len], &v.i, sizeof(v.i));
+			len += sizeof(v.i);
+		}
+		switch (type) {
+		case ARG_INT:
+			v.i = va_arg(ap, int32_t);
+			size = sizeof(v.i);
+			break;
+		case ARG_LONGLONG:
+			v.ll = va_arg(ap, uint64_t);
+			size = sizeof(v.ll);
+			break;
+		case ARG_DOUBLE:
+			v.d = va_arg(ap, double);
+			size = sizeof(v.d);
+			break;
+		case ARG_STRING:
+			str = va_arg(ap, const char*);
+			if (!str) {
+				str = "(null)";
+			}
+			size = is_constant(str) ? 1 + sizeof(str) :
+					2 + strnlen(str, LOG_MAX_STRING - 1);
+			break;
+		case ARG_NONE:
+			if (fmt[-1] == 'n') {
+				(void) va_arg(ap, void*);
+			}
+			continue;
+		}
+		if (len + size > LOG_MAX_ARGS_LENGTH) {
+			return len;
+		}
+		if (str && is_constant(str)) {
+			dst[len] = STRING_POINTER;
+			memcpy(&dst[len + 1], &str, sizeof(str));
+		} else if (str) {
+			dst[len] = STRING_COPY;
+			memcpy(&dst[len + 1], str, size - 2);
+			dst[len + size - 1] = 0;
+		} else {
+			memcpy(&dst[len], &v, size);
+		}
+		len += size;
+	}
+	return len;
+}
+
+/* Reserves words in the ring, returns 0 if there is not enough space. A record
+ * never wraps around, the rest of the ring is filled with padding instead */
+static uint8_t reserve(uint16_t words, uint32_t *pos) {
+	uint32_t h, next, pad;
+	do {
+		h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+		uint32_t t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+		uint32_t used = (h + RING_WORDS - t) % RING_WORDS;
+		pad = h + words > RING_WORDS ? RING_WORDS - h : 0;
+		if (pad + words > RING_WORDS - used - 1) {
+			return 0;
+		}
+		*pos = pad ? 0 : h;
+		next = (*pos + words) % RING_WORDS;
+	} while (!__atomic_compare_exchange_n(&head, &h, next, 0, __ATOMIC_ACQ_REL,
+			__ATOMIC_RELAXED));
+	if (pad) {
+		record_t *p = (record_t*) &ring[h];
+		p->flags = RECORD_PADDING;
+		__atomic_store_n(&p->length, pad, __ATOMIC_RELEASE);
+	}
+	return 1;
+}
+
+/* The ring went from empty to non-empty */
+static void wake_task() {
+	if (stm_in_interrupt()) {
+		BaseType_t woken = pdFALSE;
+		vTaskNotifyGiveFromISR(logHandle, &woken);
+		portYIELD_FROM_ISR(woken);
+	} else {
+		xTaskNotifyGive(logHandle);
+	}
+}
+
+void log_write(uint8_t source, uint8_t level, const char *fmt, ...) {
+	uint32_t start = DWT->CYCCNT;
+	uint8_t args[LOG_MAX_ARGS_LENGTH];
+	va_list ap;
+	va_start(ap, fmt);
+	uint16_t len = capture_args(args, fmt, ap);
+	va_end(ap);
+	uint16_t words = HEADER_WORDS + (len + 3) / 4;
+	uint32_t pos;
+	if (!reserve(words, &pos)) {
+		stats.dropped++;
+		sourceStats[source].dropped++;
+		droppedTotal++;
+		account(start);
+		return;
+	}
+	record_t *r = (record_t*) &ring[pos];
+	r->level = 31 - __builtin_clz(level);
+	r->flags = 0;
+	r->timestamp = HAL_GetTick();
+	r->module = source_names[source];
+	r->fmt = fmt;
+	memcpy(&r[1], args, len);
+	__atomic_store_n(&r->length, words, __ATOMIC_RELEASE);
+	// either the log task sees the record before it waits or idle is set here
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&idle, 0, __ATOMIC_ACQ_REL)) {
+		wake_task();
+	}
+	sourceStats[source].emitted++;
+	account(start);
+}
+
+/* Returns the oldest complete record, NULL if there is none */
+static record_t* next_record() {
+	while (tail != __atomic_load_n(&head, __ATOMIC_ACQUIRE)) {
+		record_t *r = (record_t*) &ring[tail];
+		if (!__atomic_load_n(&r->length, __ATOMIC_ACQUIRE)) {
+			// reserved but not written yet
+			return NULL;
+		}
+		if (!(r->flags & RECORD_PADDING)) {
+			return r;
+		}
+		uint16_t len = r->length;
+		memset(r, 0, len * 4);
+		__atomic_store_n(&tail, (tail + len) % RING_WORDS, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+static void release_record(record_t *r) {
+	uint16_t len = r->length;
+	// a later record may start anywhere in here, its length has to read zero
+	memset(r, 0, len * 4);
+	__atomic_store_n(&tail, (tail + len) % RING_WORDS, __ATOMIC_RELEASE);
+}
+
+#ifdef LOG_DEFERRED_HOST
+/* Binary record with sync bytes, decoded by Software/logdecode.py */
+static uint16_t output_record(char *dst, uint16_t size, const record_t *r) {
+	uint16_t len = r->length * 4;
+	if (len + 2 > size) {
+		return 0;
+	}
+	dst[0] = SYNC_BYTE0;
+	dst[1] = SYNC_BYTE1;
+	memcpy(&dst[2], r, len);
+	return len + 2;
+}
+#else
+/* Formats the record the same way as immediate logging */
+static uint16_t output_record(char *dst, uint16_t size, const record_t *r) {
+	const uint8_t *arg = (const uint8_t*) &r[1];
+	const uint8_t *end = (const uint8_t*) r + r->length * 4;
+	const char *fmt = r->fmt;
+	int n = snprintf(dst, size, "%05lu [%6.6s,%s]: ", r->timestamp,
+			r->module + 4, lvl_strings[r->level]);
+	// keep room for the line end
+	size -= 2;
+	while (*fmt && n < size) {
+		const char *start, *next;
+		arg_t type;
+		uint8_t stars;
+		next = next_conversion(fmt, &start, &type, &stars);
+		const char *literal = next ? start : fmt + strlen(fmt);
+		while (fmt < literal && n < size) {
+			if (fmt[0] == '%' && fmt[1] == '%') {
+				fmt++;
+			}
+			dst[n++] = *fmt++;
+		}
+		if (!next || n >= size) {
+			break;
+		}
+		fmt = next;
+		char spec[16];
+		if (next - start >= (int) sizeof(spec)) {
+			continue;
+		}
+		memcpy(spec, start, next - start);
+		spec[next - start] = 0;
+		int star[2] = { 0, 0 };
+		for (uint8_t i = 0; i < stars; i++) {
+			if (arg + sizeof(int32_t) > end || i >= 2) {
+				break;
+			}
+			memcpy(&star[i], arg, sizeof(int32_t));
+			arg += sizeof(int32_t);
+		}
+		union {
+			int32_t i;
+			uint64_t ll;
+			double d;
+		} v;
+		const char *str = NULL;
+		uint8_t len = 0;
+		switch (type) {
+		case ARG_INT:
+			len = sizeof(v.i);
+			break;
+		case ARG_LONGLONG:
+			len = sizeof(v.ll);
+			break;
+		case ARG_DOUBLE:
+			len = sizeof(v.d);
+			break;
+		case ARG_STRING:
+			if (arg < end && *arg == STRING_POINTER) {
+				len = 1 + sizeof(str);
+				if (arg + len <= end) {
+					memcpy(&str, &arg[1], sizeof(str));
+				}
+			} else if (arg < end) {
+				str = (const char*) &arg[1];
+				len = 1 + strnlen(str, end - arg - 1) + 1;
+			} else {
+				len = 1;
+			}
+			break;
+		case ARG_NONE:
+			continue;
+		}
+		if (arg + len > end) {
+			// argument did not fit into the record
+			break;
+		}
+		if (!str) {
+			memcpy(&v, arg, len);
+		}
+		arg += len;
+		int w;
+#define PRINT(value) (stars == 0 ? snprintf(&dst[n], size - n, spec, value) : \
+		stars == 1 ? snprintf(&dst[n], size - n, spec, star[0], value) : \
+		snprintf(&dst[n], size - n, spec, star[0], star[1], value))
+		switch (type) {
+		case ARG_INT:
+			w = PRINT(v.i);
+			break;
+		case ARG_LONGLONG:
+			w = PRINT(v.ll);
+			break;
+		case ARG_DOUBLE:
+			w = PRINT(v.d);
+			break;
+		default:
+			w = PRINT(str);
+			break;
+		}
+#undef PRINT
+		if (w > 0) {
+			n += w;
+		}
+	}
+	if (n > size) {
+		n = size;
+	}
+	dst[n++] = '\r';
+	dst[n++] = '\n';
+	return n;
+}
+#endif
+
+static void dma_complete(DMA_HandleTypeDef *hdma) {
+	BaseType_t woken = pdFALSE;
+	xSemaphoreGiveFromISR(dmaDone, &woken);
+	portYIELD_FROM_ISR(woken);
+}
+
+void DMA1_Channel4_IRQHandler(void) {
+	HAL_DMA_IRQHandler(&dma);
+}
+
+static void send(const char *data, uint16_t len) {
+	PD_PREVENT_STOP();
+	CLK_ENABLE();
+	USART_BASE->CR3 |= USART_CR3_DMAT;
+	if (HAL_DMA_Start_IT(&dma, (uint32_t) data,
+			(uint32_t) &USART_BASE->USART_WRITE, len) == HAL_OK) {
+		// 512 bytes take ~45ms at 115200 baud
+		if (!xSemaphoreTake(dmaDone, 200)) {
+			HAL_DMA_Abort(&dma);
+		}
+		// wait for the last byte to leave the shift register
+		while (!(USART_BASE->USART_ISR_REG & USART_TC))
+			;
+	}
+	USART_BASE->CR3 &= ~USART_CR3_DMAT;
+	CLK_DISABLE();
+	PD_ALLOW_STOP();
+}
+
+/* Reports dropped messages like a regular record */
+static uint16_t output_drops(char *dst, uint16_t size, uint32_t dropped) {
+	static const char fmt[] = "%lu messages dropped";
+	struct {
+		record_t r;
+		uint32_t dropped;
+	} d;
+	d.r.length = sizeof(d) / 4;
+	d.r.level = 2;
+	d.r.flags = 0;
+	d.r.timestamp = HAL_GetTick();
+	d.r.module = source_names[Log_Log_Index];
+	d.r.fmt = fmt;
+	d.dropped = dropped;
+	return output_record(dst, size, &d.r);
+}
+
+static void logTask(void *unused) {
+	uint32_t reported = 0;
+	while (1) {
+		uint16_t n = 0;
+		uint32_t dropped = droppedTotal;
+		if (dropped != reported) {
+			n += output_drops(txbuf, sizeof(txbuf), dropped - reported);
+			reported = dropped;
+		}
+		record_t *r;
+		while (sizeof(txbuf) - n >= MAX_LINE_LENGTH && (r = next_record())) {
+			n += output_record(&txbuf[n], sizeof(txbuf) - n, r);
+			release_record(r);
+		}
+		if (n) {
+			send(txbuf, n);
+			continue;
+		}
+		__atomic_store_n(&idle, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		// check again, a record might have been completed in the meantime
+		if (!next_record()) {
+			ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		}
+		__atomic_store_n(&idle, 0, __ATOMIC_RELAXED);
+	}
+}
+
+void log_init() {
+	cycle_counter_init();
+	head = tail = 0;
+	memset(ring, 0, sizeof(ring));
+	dmaDone = xSemaphoreCreateBinaryStatic(&xDmaDone);
+
+	__HAL_RCC_DMA1_CLK_ENABLE();
+	dma.Instance = DMA1_Channel4;
+	dma.Init.Direction = DMA_MEMORY_TO_PERIPH;
+	dma.Init.PeriphInc = DMA_PINC_DISABLE;
+	dma.Init.MemInc = DMA_MINC_ENABLE;
+	dma.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+	dma.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+	dma.Init.Mode = DMA_NORMAL;
+	dma.Init.Priority = DMA_PRIORITY_LOW;
+	HAL_DMA_Init(&dma);
+	dma.XferCpltCallback = dma_complete;
+	HAL_NVIC_SetPriority(DMA1_Channel4_IRQn, 5, 0);
+	HAL_NVIC_EnableIRQ(DMA1_Channel4_IRQn);
+
+	xTaskCreate(logTask, "LOG", 256, NULL, 1, &logHandle);
+#ifdef LOG_CONSOLE
+	HAL_NVIC_SetPriority(NVIC_ISR, configLIBRARY_MAX_SYSCALL_INTERRUPT_PRIORITY, 0);
+	HAL_NVIC_EnableIRQ(NVIC_ISR);
+	console_init();
+#endif
+}
+
+/* Takes the USART from the log task, a running transfer is cut off. The log
+ * task aborts it once its wait times out */
+static void stop_output() {
+	uint8_t running = (dma.Instance->CCR & DMA_CCR_EN) && dma.Instance->CNDTR;
+	__HAL_DMA_DISABLE(&dma);
+	USART_BASE->CR3 &= ~USART_CR3_DMAT;
+	if (running) {
+		// end the cut off line
+		put_polled("\r\n", 2);
+	}
+}
+
+/* Outputs everything pending without DMA or the log task (fault handlers) */
+void log_flush() {
+	CLK_ENABLE();
+	stop_output();
+	record_t *r;
+	while ((r = next_record())) {
+		uint16_t n = output_record(pollLine, sizeof(pollLine), r);
+		release_record(r);
+		put_polled(pollLine, n);
+	}
+	while (!(USART_BASE->USART_ISR_REG & USART_TC))
+		;
+}
+
+#endif
+
+static void put_polled(const char *data, uint16_t len) {
+	for (uint16_t i = 0; i < len; i++) {
+		while (!(USART_BASE->USART_ISR_REG & USART_TXE));
+		USART_BASE->USART_WRITE = data[i];
+	}
+}
+
+void log_force(const char *fmt, ...) {
+	CLK_ENABLE();
+	stop_output();
+
+	int written = 0;
+	va_list args;
+	va_start(args, fmt);
+	written += vsnprintf(&pollLine[written], MAX_LINE_LENGTH - written,
+			fmt, args);
+	va_end(args);
+	if (written > MAX_LINE_LENGTH - 3) {
+		written = MAX_LINE_LENGTH - 3;
+	}
+	written += snprintf(&pollLine[written], MAX_LINE_LENGTH - written,
+			"\r\n");
+
+	put_polled(pollLine, written);
+}
+
+#ifdef LOG_CONSOLE
+
+#define CONSOLE_LINE_LENGTH	40
+
+static char rxLine[CONSOLE_LINE_LENGTH];
+static uint8_t rxLength;
+// set while the console task handles rxLine, further input is ignored
+static volatile uint8_t lineReady;
+static TaskHandle_t consoleHandle;
+
+static const char level_names[][6] = {
+	"debug",
+	"info",
+	"warn",
+	"error",
+	"crit",
+};
+
+/* Called from the USART interrupt */
+static void console_receive() {
+	if (!(USART_BASE->USART_ISR_REG & USART_RXNE)) {
+		return;
+	}
+	char c = USART_BASE->USART_READ;
+	if (lineReady) {
+		return;
+	}
+	if (c == '\r' || c == '\n') {
+		if (rxLength) {
+			rxLine[rxLength] = 0;
+			rxLength = 0;
+			lineReady = 1;
+			BaseType_t woken = pdFALSE;
+			vTaskNotifyGiveFromISR(consoleHandle, &woken);
+			portYIELD_FROM_ISR(woken);
+		}
+	} else if (rxLength < CONSOLE_LINE_LENGTH - 1) {
+		rxLine[rxLength++] = c;
+	}
+}
+
+#ifdef LOG_DEFERRED
+/* Only receives, sending uses DMA */
+void HANDLER(void) {
+	console_receive();
+}
+#endif
+
+/* Lowest enabled level of a mask */
+static const char* mask_name(uint8_t mask) {
+	if (!mask) {
+		return "off";
+	}
+	return level_names[__builtin_ctz(mask)];
+}
+
+static void console_list() {
+	for (uint8_t i = 0; i < LOG_SOURCES; i++) {
+		log_write(Log_Log_Index, LevelInfo, "%-8s %-5s %lu emitted, %lu dropped",
+				log_source_name(i), mask_name(log_masks[i]),
+				sourceStats[i].emitted, sourceStats[i].dropped);
+	}
+}
+
+static void console_command(char *line) {
+	char *cmd = strtok(line, " ");
+	char *source = strtok(NULL, " ");
+	char *level = strtok(NULL, " ");
+	if (!cmd || strcasecmp(cmd, "log")) {
+		log_write(Log_Log_Index, LevelWarn, "Unknown command: %s", cmd);
+		return;
+	}
+	if (!source) {
+		console_list();
+		return;
+	}
+	if (!level && !strcasecmp(source, "reset")) {
+		log_reset_stats();
+		return;
+	}
+	if (!level) {
+		log_write(Log_Log_Index, LevelWarn,
+				"Usage: log [reset | <source|all> <debug|info|warn|error|crit|off>]");
+		return;
+	}
+	uint8_t mask;
+	if (!strcasecmp(level, "off")) {
+		mask = 0;
+	} else {
+		uint8_t i;
+		for (i = 0; i < sizeof(level_names) / sizeof(level_names[0]); i++) {
+			if (!strcasecmp(level, level_names[i])) {
+				break;
+			}
+		}
+		if (i >= sizeof(level_names) / sizeof(level_names[0])) {
+			log_write(Log_Log_Index, LevelWarn, "Unknown level: %s", level);
+			return;
+		}
+		// this level and everything above
+		mask = LevelAll & ~((1 << i) - 1);
+	}
+	uint8_t found = 0;
+	for (uint8_t i = 0; i < LOG_SOURCES; i++) {
+		if (!strcasecmp(source, "all")
+				|| !strcasecmp(source, log_source_name(i))) {
+			log_set_mask(i, mask);
+			found = 1;
+		}
+	}
+	if (!found) {
+		log_write(Log_Log_Index, LevelWarn, "Unknown source: %s", source);
+		return;
+	}
+	log_write(Log_Log_Index, LevelInfo, "Level of %s set to %s", source,
+			mask_name(mask));
+}
+
+static void consoleTask(void *unused) {
+	while (1) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		console_command(rxLine);
+		lineReady = 0;
+	}
+}
+
+static void console_init() {
+	rxLength = 0;
+	lineReady = 0;
+	xTaskCreate(consoleTask, "CONSOLE", 192, NULL, 1, &consoleHandle);
+	CLK_ENABLE();
+	USART_BASE->CR1 |= USART_CR1_RXNEIE;
+}
+
+#endif
+
 #if configCHECK_FOR_STACK_OVERFLOW > 0
 void vApplicationStackOverflowHook(xTaskHandle xTask, signed char *pcTaskName) {
-	log_write("    FreeRTOS", LevelCrit, "Stack overflow in task: %s",
+	log_write(Log_FreeRTOS_Index, LevelCrit, "Stack overflow in task: %s",
 			pcTaskName);
 	log_flush();
 	__BKPT();
@@ -11,13 +11,41 @@ extern "C" {
 
 #define LOG_USART			1
 #define LOG_SENDBUF_LENGTH	1024
+/*
+ * Deferred logging: log_write only copies the timestamp, level, the module and
+ * format string pointers and the raw arguments into a lock-free ring buffer.
+ * Constant strings in flash are stored as pointers as well, strings in RAM are
+ * copied and truncated to LOG_MAX_STRING. A low priority task, woken by
+ * log_write once the ring is no longer empty, formats the messages and sends
+ * them with DMA. LOG_BLOCKING does not apply, messages that do not fit are
+ * dropped and counted.
+ *
+ * With LOG_DEFERRED_HOST the task sends the binary records instead and the
+ * host formats them, resolving the pointers from the ELF file
+ * (see Software/logdecode.py).
+ */
+#define LOG_DEFERRED
+//#define LOG_DEFERRED_HOST
+#define LOG_MAX_ARGS_LENGTH	64
+#define LOG_MAX_STRING		24
+
 /*
  * If the log message does not fit into the remaining buffer space it is
  * discarded to not block program flow. For debugging purposes this behaviour
  * might be irritating. In this case uncomment the following line. Whenever the
  * buffer is too full, a call to log_write blocks until enough space is available.
  */
+#ifndef LOG_DEFERRED
 #define LOG_BLOCKING
+#endif
+
+/*
+ * Serial console on the log USART: "log" lists the sources with their level
+ * and message counters, "log <source|all> <debug|info|warn|error|crit|off>"
+ * sets the lowest level logged for a source and "log reset" clears the
+ * counters. Keeps the USART clock enabled to receive.
+ */
+#define LOG_CONSOLE
 
 #define USE_ASSERT
 #define LOG_USE_MUTEXES
@@ -30,7 +58,8 @@ extern "C" {
 #define LevelCrit  0x10
 #define LevelAll   0x1F
 
-// enabled levels for individual log sources
+// levels compiled in for individual log sources, calls with other levels are
+// removed completely. Which of these are logged is set at runtime
 #define Log_System  	(LevelAll)
 #define Log_Exti		(LevelAll)
 #define Log_App		  	(LevelAll)
@@ -40,22 +69,53 @@ extern "C" {
 #define Log_Loadcell	(LevelAll)
 #define Log_Config		(LevelAll)
 #define Log_Desktop		(LevelAll)
+#define Log_SPI			(LevelAll)
+#define Log_File		(LevelAll)
 
 // if LevelDebug is omitted from this mask,
-// debug message will not be logged regardless
+// debug message will not be compiled in regardless
 // of individual source settings
-#define Global_Level_Mask (LevelAll&~LevelDebug)
+#define Global_Level_Mask (LevelAll)
+
+// levels logged after reset, can be changed with log_set_mask
+#define LOG_DEFAULT_MASK (LevelAll&~LevelDebug)
+
+// index of every log source, keep in sync with source_names in log.c
+enum {
+	Log_System_Index,
+	Log_Exti_Index,
+	Log_App_Index,
+	Log_MAX11254_Index,
+	Log_Input_Index,
+	Log_GUI_Index,
+	Log_Loadcell_Index,
+	Log_Config_Index,
+	Log_Desktop_Index,
+	Log_SPI_Index,
+	Log_File_Index,
+	// sources with a runtime mask
+	LOG_SOURCES,
+	// internal messages, always logged
+	Log_Log_Index = LOG_SOURCES,
+	Log_Assert_Index,
+	Log_FreeRTOS_Index,
+	LOG_SOURCES_TOTAL
+};
+
+// runtime masks, only read here to skip disabled calls before any formatting
+extern uint8_t log_masks[LOG_SOURCES];
 
 #define LOG(source, level, message, ...) do { \
-    if (source & level & Global_Level_Mask) { \
-       log_write(#source, level, message, ##__VA_ARGS__); \
+    if ((source & level & Global_Level_Mask) \
+    		&& (log_masks[source ## _Index] & level)) { \
+       log_write(source ## _Index, level, message, ##__VA_ARGS__); \
     } \
 } while (0)
 
 #ifdef USE_ASSERT
 #define ASSERT(x) do { \
 	if(!(x)) { \
-		log_write("    ASSERT", LevelCrit, "Assertion failed: %s, line %d", __FILE__, __LINE__); \
+		log_write(Log_Assert_Index, LevelCrit, "Assertion failed: %s, line %d", __FILE__, __LINE__); \
 		log_flush(); \
 		__BKPT(); \
 	} \
@@ -65,9 +125,32 @@ extern "C" {
 #endif
 
 
+typedef struct {
+	uint32_t calls;
+	// messages that did not fit into the buffer
+	uint32_t dropped;
+	// CPU cycles spent in log_write
+	uint32_t cycles;
+	uint32_t maxCycles;
+} log_stats_t;
+
+typedef struct {
+	uint32_t emitted;
+	// messages that did not fit into the buffer
+	uint32_t dropped;
+} log_source_stats_t;
+
 void log_init();
-void log_write(const char *module, uint8_t level, const char *fmt, ...);
+void log_write(uint8_t source, uint8_t level, const char *fmt, ...);
 void log_flush();
+void log_get_stats(log_stats_t *stats);
+void log_get_source_stats(uint8_t source, log_source_stats_t *stats);
+void log_reset_stats();
+
+// name without the "Log_" prefix
+const char* log_source_name(uint8_t source);
+void log_set_mask(uint8_t source, uint8_t mask);
+uint8_t log_get_mask(uint8_t source);
 
 void log_force(const char *fmt, ...);
 
@@ -0,0 +1,252 @@
+#include "spibus.h"
+
+#include "log.h"
+#include "task.h"
+#include <string.h>
+
+static SPI_HandleTypeDef *bus;
+static spibus_device_t *devices;
+static spibus_device_t *volatile owner;
+static uint32_t statsStart;
+
+void spibus_init(SPI_HandleTypeDef *spi) {
+	bus = spi;
+	devices = NULL;
+	owner = NULL;
+	statsStart = getRunTimeCounterValue();
+	if (bus->Instance == SPI1) {
+		// needed for IT transfers and to report errors of DMA transfers
+		HAL_NVIC_SetPriority(SPI1_IRQn, 5, 0);
+		HAL_NVIC_EnableIRQ(SPI1_IRQn);
+	}
+}
+
+void spibus_register(spibus_device_t *dev, const char *name, uint16_t prescaler,
+		spibus_priority_t priority) {
+	ASSERT(bus != NULL);
+	for (spibus_device_t *d = devices; d; d = d->next) {
+		if (d == dev) {
+			return;
+		}
+	}
+	dev->name = name;
+	dev->prescaler = prescaler;
+	dev->priority = priority;
+	dev->waiting = 0;
+	dev->complete = NULL;
+	dev->ptr = NULL;
+	dev->task = NULL;
+	dev->boosted = 0;
+	dev->grant = xSemaphoreCreateBinaryStatic(&dev->grantBuf);
+	memset(&dev->stats, 0, sizeof(dev->stats));
+	taskENTER_CRITICAL();
+	dev->next = devices;
+	devices = dev;
+	taskEXIT_CRITICAL();
+	LOG(Log_SPI, LevelDebug, "Registered %s, priority %d", name, priority);
+}
+
+void spibus_set_complete_callback(spibus_device_t *dev, void (*cb)(void*),
+		void *ptr) {
+	taskENTER_CRITICAL();
+	dev->complete = cb;
+	dev->ptr = ptr;
+	taskEXIT_CRITICAL();
+}
+
+// Selects the next owner, must be called from within a critical section
+static spibus_device_t* next_owner() {
+	spibus_device_t *next = NULL;
+	for (spibus_device_t *d = devices; d; d = d->next) {
+		if (d->waiting && (!next || d->priority > next->priority)) {
+			next = d;
+		}
+	}
+	return next;
+}
+
+// Raises the priority of the task owning the bus to the one of the calling
+// task, must be called from within a critical section
+static void inherit_priority() {
+	spibus_device_t *o = owner;
+	UBaseType_t prio = uxTaskPriorityGet(NULL);
+	if (o->task && uxTaskPriorityGet(o->task) < prio) {
+		vTaskPrioritySet(o->task, prio);
+		o->boosted = 1;
+	}
+}
+
+// Passes the priority of the tasks still waiting on to the task of the new
+// owner, must be called from within a critical section
+static void pass_priority(spibus_device_t *next) {
+	UBaseType_t prio = next->basePriority;
+	for (spibus_device_t *d = devices; d; d = d->next) {
+		if (d->waiting && d->task && uxTaskPriorityGet(d->task) > prio) {
+			prio = uxTaskPriorityGet(d->task);
+		}
+	}
+	if (next->task && prio > next->basePriority) {
+		vTaskPrioritySet(next->task, prio);
+		next->boosted = 1;
+	}
+}
+
+// Drops an inherited priority of the calling task
+static void restore_priority(spibus_device_t *dev) {
+	if (dev->boosted) {
+		dev->boosted = 0;
+		vTaskPrioritySet(NULL, dev->basePriority);
+	}
+}
+
+uint8_t spibus_acquire(spibus_device_t *dev, uint32_t timeout) {
+	ASSERT(owner != dev);
+	uint32_t start = getRunTimeCounterValue();
+	// still raised if the last release was done in an interrupt
+	restore_priority(dev);
+	dev->task = xTaskGetCurrentTaskHandle();
+	dev->basePriority = uxTaskPriorityGet(NULL);
+	taskENTER_CRITICAL();
+	if (!owner) {
+		owner = dev;
+		taskEXIT_CRITICAL();
+	} else {
+		dev->waiting = 1;
+		inherit_priority();
+		taskEXIT_CRITICAL();
+		if (xSemaphoreTake(dev->grant, timeout) != pdTRUE) {
+			taskENTER_CRITICAL();
+			uint8_t granted = owner == dev;
+			dev->waiting = 0;
+			taskEXIT_CRITICAL();
+			if (!granted) {
+				dev->stats.timeouts++;
+				return 0;
+			}
+			// handed over right after the timeout expired
+			xSemaphoreTake(dev->grant, 0);
+		}
+	}
+	uint32_t now = getRunTimeCounterValue();
+	uint32_t wait = now - start;
+	dev->stats.acquisitions++;
+	dev->stats.waitTime += wait;
+	if (wait > dev->stats.maxWait) {
+		dev->stats.maxWait = wait;
+	}
+	dev->acquiredAt = now;
+	bus->Instance->CR1 = (bus->Instance->CR1 & ~SPI_BAUDRATEPRESCALER_256)
+			| dev->prescaler;
+	return 1;
+}
+
+static void update_busy(spibus_device_t *dev) {
+	uint32_t busy = getRunTimeCounterValue() - dev->acquiredAt;
+	dev->stats.busyTime += busy;
+	if (busy > dev->stats.maxBusy) {
+		dev->stats.maxBusy = busy;
+	}
+}
+
+void spibus_release(spibus_device_t *dev) {
+	ASSERT(owner == dev);
+	update_busy(dev);
+	taskENTER_CRITICAL();
+	spibus_device_t *next = next_owner();
+	owner = next;
+	if (next) {
+		next->waiting = 0;
+		pass_priority(next);
+		// a context switch is only pended until the critical section is left
+		xSemaphoreGive(next->grant);
+	}
+	taskEXIT_CRITICAL();
+	restore_priority(dev);
+}
+
+// Priorities can not be changed from an interrupt, an inherited priority of
+// the device's task is dropped when it acquires the bus again
+void spibus_release_from_isr(spibus_device_t *dev, BaseType_t *woken) {
+	update_busy(dev);
+	UBaseType_t state = taskENTER_CRITICAL_FROM_ISR();
+	spibus_device_t *next = next_owner();
+	owner = next;
+	if (next) {
+		next->waiting = 0;
+		xSemaphoreGiveFromISR(next->grant, woken);
+	}
+	taskEXIT_CRITICAL_FROM_ISR(state);
+}
+
+uint8_t spibus_yield_requested(spibus_device_t *dev) {
+	uint8_t requested = 0;
+	taskENTER_CRITICAL();
+	spibus_device_t *next = next_owner();
+	if (next && next->priority > dev->priority) {
+		requested = 1;
+	}
+	taskEXIT_CRITICAL();
+	return requested;
+}
+
+void spibus_yield(spibus_device_t *dev) {
+	if (!spibus_yield_requested(dev)) {
+		return;
+	}
+	dev->stats.yields++;
+	spibus_release(dev);
+	spibus_acquire(dev, portMAX_DELAY);
+}
+
+void spibus_log_stats() {
+	// the us counter wraps after ~71 minutes, reset the stats more often
+	uint32_t elapsed = getRunTimeCounterValue() - statsStart;
+	if (!elapsed) {
+		return;
+	}
+	for (spibus_device_t *d = devices; d; d = d->next) {
+		spibus_stats_t s = d->stats;
+		// occupancy in 0.1%
+		uint32_t busy = s.busyTime * 1000 / elapsed;
+		uint32_t avgWait = s.acquisitions ? s.waitTime / s.acquisitions : 0;
+		LOG(Log_SPI, LevelInfo,
+				"%s: %lu acquisitions, busy %lu.%lu%% (max %luus), wait avg %luus max %luus, %lu yields, %lu timeouts",
+				d->name, s.acquisitions, busy / 10, busy % 10, s.maxBusy,
+				avgWait, s.maxWait, s.yields, s.timeouts);
+	}
+}
+
+void spibus_reset_stats() {
+	taskENTER_CRITICAL();
+	for (spibus_device_t *d = devices; d; d = d->next) {
+		memset(&d->stats, 0, sizeof(d->stats));
+	}
+	statsStart = getRunTimeCounterValue();
+	taskEXIT_CRITICAL();
+}
+
+static void transfer_complete(SPI_HandleTypeDef *hspi) {
+	spibus_device_t *dev = owner;
+	if (hspi == bus && dev && dev->complete) {
+		dev->complete(dev->ptr);
+	}
+}
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi) {
+	transfer_complete(hspi);
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi) {
+	transfer_complete(hspi);
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi) {
+	// the device has to be woken up either way, it checks hspi->ErrorCode
+	transfer_complete(hspi);
+}
+
+void SPI1_IRQHandler(void) {
+	if (bus) {
+		HAL_SPI_IRQHandler(bus);
+	}
+}
@@ -0,0 +1,93 @@
+#ifndef IOX_SPIBUS_H_
+#define IOX_SPIBUS_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "stm.h"
+#include "FreeRTOS.h"
+#include "semphr.h"
+#include "task.h"
+
+/*
+ * Arbitration of a shared SPI bus. Every device on the bus registers a
+ * descriptor with its own clock prescaler and priority. When the bus is
+ * released it is handed to the waiting device with the highest priority
+ * (instead of the highest priority task as with a plain mutex). Devices with
+ * long operations (SD card) can hand the bus over at safe points with
+ * spibus_yield().
+ *
+ * Like a mutex, the task owning the bus inherits the priority of the highest
+ * priority task waiting for it, so that a medium priority task cannot delay
+ * the waiter. A task whose bus was released from an interrupt keeps the
+ * inherited priority until it acquires the bus the next time.
+ */
+
+typedef enum {
+	SPIBUS_PRIO_LOW,
+	SPIBUS_PRIO_NORMAL,
+	SPIBUS_PRIO_HIGH,
+} spibus_priority_t;
+
+typedef struct {
+	uint32_t acquisitions;
+	uint32_t timeouts;
+	// bus handed over to a higher priority device in the middle of an operation
+	uint32_t yields;
+	// all times in us
+	uint64_t busyTime;
+	uint64_t waitTime;
+	uint32_t maxBusy;
+	uint32_t maxWait;
+} spibus_stats_t;
+
+typedef struct spibus_device {
+	const char *name;
+	// SPI_BAUDRATEPRESCALER_x, applied whenever the device gets the bus
+	uint16_t prescaler;
+	spibus_priority_t priority;
+	spibus_stats_t stats;
+	// called from the HAL completion/error interrupt of IT and DMA transfers
+	// while the device owns the bus. Errors leave ErrorCode of the SPI handle
+	// set, HAL_SPI_ERROR_NONE after a successful transfer
+	void (*complete)(void *ptr);
+	void *ptr;
+	// internal
+	struct spibus_device *next;
+	SemaphoreHandle_t grant;
+	StaticSemaphore_t grantBuf;
+	volatile uint8_t waiting;
+	uint32_t acquiredAt;
+	// task owning or waiting for the bus and its own priority
+	TaskHandle_t task;
+	UBaseType_t basePriority;
+	uint8_t boosted;
+} spibus_device_t;
+
+void spibus_init(SPI_HandleTypeDef *spi);
+// Adds a device to the bus, does nothing if it is already registered
+void spibus_register(spibus_device_t *dev, const char *name, uint16_t prescaler,
+		spibus_priority_t priority);
+void spibus_set_complete_callback(spibus_device_t *dev, void (*cb)(void*),
+		void *ptr);
+// Returns 1 if the bus has been acquired within timeout (in ticks)
+uint8_t spibus_acquire(spibus_device_t *dev, uint32_t timeout);
+void spibus_release(spibus_device_t *dev);
+// For transfers that finish in the completion interrupt
+void spibus_release_from_isr(spibus_device_t *dev, BaseType_t *woken);
+// Returns 1 if a device with higher priority is waiting for the bus
+uint8_t spibus_yield_requested(spibus_device_t *dev);
+// Hands the bus to a waiting higher priority device and takes it back
+// afterwards. The device has to be in a state where it tolerates other
+// traffic on the bus (CS high)
+void spibus_yield(spibus_device_t *dev);
+
+void spibus_log_stats();
+void spibus_reset_stats();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -64,6 +64,7 @@
 /* Includes ------------------------------------------------------------------*/
 #include <string.h>
 #include "ff_gen_drv.h"
+#include "spibus.h"
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
@@ -108,36 +109,89 @@ extern SPI_HandleTypeDef SPI_DISK;
 #define DMA_RX	hdma_spi1_rx
 #define DMA_TX	hdma_spi1_tx
 extern DMA_HandleTypeDef DMA_RX, DMA_TX;
-#define SEMPHR_DISK	xMutexSPI1
-extern SemaphoreHandle_t SEMPHR_DISK;
-static uint8_t mutexAcquired = 0;
+static spibus_device_t bus;
+static uint8_t busAcquired = 0;
+/* Given by the SPI completion interrupt of DMA transfers */
+static SemaphoreHandle_t dmaDone;
+static StaticSemaphore_t dmaDoneBuf;
+/* Transmit data while receiving, the DMA reads it without incrementing */
+static const BYTE dummyFF = 0xFF;
+/* Shorter transfers are polled, starting the DMA and blocking costs more */
+#define DMA_MIN_LENGTH	16
 /* Disk status */
 static volatile DSTATUS Stat = STA_NOINIT;
 
 /*-----------------------------------------------------------------------*/
-/* Transmit bytes to the card (bitbanging)                               */
+/* DMA completion                                                        */
 /*-----------------------------------------------------------------------*/
 
 static
-void xmit_mmc(const BYTE* buff, /* Data to be sent */
+void dma_complete(void *ptr) {
+	BaseType_t woken = pdFALSE;
+	xSemaphoreGiveFromISR(dmaDone, &woken);
+	portYIELD_FROM_ISR(woken);
+}
+
+static
+int wait_dma(void) /* 1:OK, 0:Timeout or transfer error */
+{
+	/* A 512 byte block takes less than 1ms */
+	if (xSemaphoreTake(dmaDone, pdMS_TO_TICKS(100)) != pdTRUE) {
+		HAL_SPI_Abort(&SPI_DISK);
+		return 0;
+	}
+	/* The error interrupt completes the transfer as well */
+	return SPI_DISK.ErrorCode == HAL_SPI_ERROR_NONE;
+}
+
+static
+void start_dma(void) {
+	/* A completion of a transfer that timed out must not end the next one */
+	xSemaphoreTake(dmaDone, 0);
+}
+
+/*-----------------------------------------------------------------------*/
+/* Transmit bytes to the card                                            */
+/*-----------------------------------------------------------------------*/
+
+static
+int xmit_mmc( /* 1:OK, 0:Failed */
+const BYTE* buff, /* Data to be sent */
 UINT bc /* Number of bytes to send */
 ) {
-	HAL_SPI_Transmit_DMA(&SPI_DISK, (uint8_t*) buff, bc);
-	while(HAL_DMA_GetState(&DMA_TX) != HAL_DMA_STATE_READY);
+	if (bc < DMA_MIN_LENGTH)
+		return HAL_SPI_Transmit(&SPI_DISK, (uint8_t*) buff, bc, 10) == HAL_OK;
+	start_dma();
+	if (HAL_SPI_Transmit_DMA(&SPI_DISK, (uint8_t*) buff, bc) != HAL_OK)
+		return 0;
+	return wait_dma();
 }
 
 /*-----------------------------------------------------------------------*/
-/* Receive bytes from the card (bitbanging)                              */
+/* Receive bytes from the card                                           */
 /*-----------------------------------------------------------------------*/
 
 static
-void rcvr_mmc(BYTE *buff, /* Pointer to read buffer */
+int rcvr_mmc( /* 1:OK, 0:Failed */
+BYTE *buff, /* Pointer to read buffer */
 UINT bc /* Number of bytes to receive */
 ) {
-	uint8_t dummyTX[bc];
-	memset(dummyTX, 0xFF, bc);
-	HAL_SPI_TransmitReceive_DMA(&SPI_DISK, dummyTX, buff, bc);
-	while(HAL_DMA_GetState(&DMA_RX) != HAL_DMA_STATE_READY);
+	int res = 0;
+
+	if (bc < DMA_MIN_LENGTH) {
+		/* Each byte is sent before its position is overwritten */
+		memset(buff, 0xFF, bc);
+		return HAL_SPI_TransmitReceive(&SPI_DISK, buff, buff, bc, 10) == HAL_OK;
+	}
+	start_dma();
+	/* Send the same 0xFF byte over and over */
+	DMA_TX.Instance->CCR &= ~DMA_CCR_MINC;
+	if (HAL_SPI_TransmitReceive_DMA(&SPI_DISK, (uint8_t*) &dummyFF, buff, bc)
+			== HAL_OK)
+		res = wait_dma();
+	__HAL_DMA_DISABLE(&DMA_TX);
+	DMA_TX.Instance->CCR |= DMA_CCR_MINC;
+	return res;
 }
 
 /*-----------------------------------------------------------------------*/
@@ -148,16 +202,18 @@ static
 int wait_ready(void) /* 1:OK, 0:Timeout */
 {
 	BYTE d;
-	UINT tmr;
+	UINT tmr, n;
 
 	for (tmr = 500; tmr; tmr--) { /* Wait for ready in timeout of 500ms */
-		rcvr_mmc(&d, 1);
-		if (d == 0xFF)
-			break;
-		HAL_Delay(1);
+		for (n = 32; n; n--) { /* Poll briefly before giving up the CPU */
+			rcvr_mmc(&d, 1);
+			if (d == 0xFF)
+				return 1;
+		}
+		vTaskDelay(1);
 	}
 
-	return tmr ? 1 : 0;
+	return 0;
 }
 
 /*-----------------------------------------------------------------------*/
@@ -171,9 +227,9 @@ void deselect(void) {
 	CS_H();
 	rcvr_mmc(&d, 1); /* Dummy clock (force DO hi-z for multiple slave SPI) */
 	/* Release SPI access */
-	if (mutexAcquired) {
-		osSemaphoreRelease(SEMPHR_DISK);
-		mutexAcquired = 0;
+	if (busAcquired) {
+		spibus_release(&bus);
+		busAcquired = 0;
 	}
 }
 
@@ -185,8 +241,8 @@ static
 int selectCard(void) /* 1:OK, 0:Timeout */
 {
 	BYTE d;
-	if (osSemaphoreWait(SEMPHR_DISK, 10) == osOK) {
-		mutexAcquired = 1;
+	if (spibus_acquire(&bus, 10)) {
+		busAcquired = 1;
 		CS_L();
 		rcvr_mmc(&d, 1); /* Dummy clock (force DO enabled) */
 
@@ -197,6 +253,24 @@ int selectCard(void) /* 1:OK, 0:Timeout */
 	return 0; /* Failed */
 }
 
+/*-----------------------------------------------------------------------*/
+/* Hand the bus to a waiting higher priority device between data blocks */
+/*-----------------------------------------------------------------------*/
+
+static
+void yield_bus(void) {
+	BYTE d;
+
+	if (!spibus_yield_requested(&bus))
+		return;
+	/* The card only moves data while clocked, it waits with CS high */
+	CS_H();
+	rcvr_mmc(&d, 1); /* Dummy clock (force DO hi-z for multiple slave SPI) */
+	spibus_yield(&bus);
+	CS_L();
+	rcvr_mmc(&d, 1); /* Dummy clock (force DO enabled) */
+}
+
 /*-----------------------------------------------------------------------*/
 /* Receive a data packet from the card                                   */
 /*-----------------------------------------------------------------------*/
@@ -207,19 +281,25 @@ BYTE *buff, /* Data buffer to store received data */
 UINT btr /* Byte count */
 ) {
 	BYTE d[2];
-	UINT tmr;
-
-	for (tmr = 100; tmr; tmr--) { /* Wait for data packet in timeout of 100ms */
-		rcvr_mmc(d, 1);
-		if (d[0] != 0xFF)
-			break;
-		HAL_Delay(1);
+	UINT tmr, n;
+
+	d[0] = 0xFF;
+	for (tmr = 100; tmr && d[0] == 0xFF; tmr--) { /* Wait for data packet in timeout of 100ms */
+		for (n = 32; n; n--) { /* Poll briefly before giving up the CPU */
+			rcvr_mmc(d, 1);
+			if (d[0] != 0xFF)
+				break;
+		}
+		if (d[0] == 0xFF)
+			vTaskDelay(1);
 	}
 	if (d[0] != 0xFE)
 		return 0; /* If not valid data token, return with error */
 
-	rcvr_mmc(buff, btr); /* Receive the data block into buffer */
-	rcvr_mmc(d, 2); /* Discard CRC */
+	if (!rcvr_mmc(buff, btr)) /* Receive the data block into buffer */
+		return 0; /* Incomplete, the card runs without CRC check */
+	if (!rcvr_mmc(d, 2)) /* Discard CRC */
+		return 0;
 
 	return 1; /* Return with success */
 }
@@ -239,11 +319,15 @@ BYTE token /* Data/Stop token */
 		return 0;
 
 	d[0] = token;
-	xmit_mmc(d, 1); /* Xmit a token */
+	if (!xmit_mmc(d, 1)) /* Xmit a token */
+		return 0;
 	if (token != 0xFD) { /* Is it data token? */
-		xmit_mmc(buff, 512); /* Xmit the 512 byte data block to MMC */
-		rcvr_mmc(d, 2); /* Xmit dummy CRC (0xFF,0xFF) */
-		rcvr_mmc(d, 1); /* Receive data response */
+		if (!xmit_mmc(buff, 512)) /* Xmit the 512 byte data block to MMC */
+			return 0;
+		if (!rcvr_mmc(d, 2)) /* Xmit dummy CRC (0xFF,0xFF) */
+			return 0;
+		if (!rcvr_mmc(d, 1)) /* Receive data response */
+			return 0;
 		if ((d[0] & 0x1F) != 0x05) /* If not accepted, return with error */
 			return 0;
 	}
@@ -287,7 +371,8 @@ DWORD arg /* Argument */
 	if (cmd == CMD8)
 		n = 0x87; /* (valid CRC for CMD8(0x1AA)) */
 	buf[5] = n;
-	xmit_mmc(buf, 6);
+	if (!xmit_mmc(buf, 6))
+		return 0xFF;
 
 	/* Receive command response */
 	if (cmd == CMD12)
@@ -346,10 +431,19 @@ DSTATUS USER_initialize (
 	if (pdrv)
 		return RES_NOTRDY;
 
+	/* The card shares the bus with the loadcell ADC, which always goes first */
+	spibus_register(&bus, "SD card", SPI_BAUDRATEPRESCALER_8, SPIBUS_PRIO_NORMAL);
+	if (!dmaDone)
+		dmaDone = xSemaphoreCreateBinaryStatic(&dmaDoneBuf);
+	spibus_set_complete_callback(&bus, dma_complete, NULL);
+
 	CS_H();
 
+	if (!spibus_acquire(&bus, 100))
+		return STA_NOINIT;
 	for (n = 10; n; n--)
 		rcvr_mmc(buf, 1); /* Apply 80 dummy clocks and the card gets ready to receive command */
+	spibus_release(&bus);
 
 	ty = 0;
 	if (send_cmd(CMD0, 0) == 1) { /* Enter Idle state */
@@ -440,6 +534,8 @@ DRESULT USER_read (
 				if (!rcvr_datablock(buff, 512))
 					break;
 				buff += 512;
+				if (count > 1)
+					yield_bus();
 			} while (--count);
 			send_cmd(CMD12, 0); /* STOP_TRANSMISSION */
 		}
@@ -485,6 +581,7 @@ DRESULT USER_write (
 				if (!xmit_datablock(buff, 0xFC))
 					break;
 				buff += 512;
+				yield_bus(); /* The card is busy programming the block anyway */
 			} while (--count);
 			if (!xmit_datablock(0, 0xFD)) /* STOP_TRAN token */
 				count = 1;
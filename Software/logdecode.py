@@ -0,0 +1,168 @@
+#!/usr/bin/python3
+
+# Decodes the binary log stream of firmware built with LOG_DEFERRED_HOST
+# (see Teststand/Drivers/Board/log.h). Module names and format strings are
+# only sent as pointers, they are read from the ELF file of the same build.
+# The same goes for string arguments in flash, strings in RAM are sent along.
+#
+# Usage: logdecode.py <firmware.elf> <capture file or serial device>
+# A serial device has to be configured first, e.g. stty -F /dev/ttyUSB0 115200 raw
+
+import re
+import struct
+import sys
+
+SYNC = b'\xa5\x5a'
+HEADER = struct.Struct('<HBBIII')
+LEVELS = ['DBG', 'INF', 'WRN', 'ERR', 'CRT']
+MAX_RECORD_WORDS = 64
+# first byte of a string argument, see capture_args() in log.c
+STRING_COPY = 0
+STRING_POINTER = 1
+
+# same conversions as next_conversion() in log.c
+SPEC = re.compile(r'%([-+ #0]*)(\*|\d+)?(?:\.(\*|\d+)?)?(hh|h|ll|l|j|z|t|L)?([a-zA-Z%])')
+
+
+class Elf:
+	def __init__(self, filename):
+		with open(filename, 'rb') as f:
+			self.data = f.read()
+		if self.data[:4] != b'\x7fELF' or self.data[4] != 1:
+			raise ValueError('not a 32 bit ELF file')
+		shoff, = struct.unpack_from('<I', self.data, 0x20)
+		shentsize, shnum = struct.unpack_from('<HH', self.data, 0x2E)
+		self.sections = []
+		for i in range(shnum):
+			_, type, flags, addr, offset, size = struct.unpack_from('<IIIIII',
+					self.data, shoff + i * shentsize)
+			# allocated and with content in the file (no .bss)
+			if flags & 0x2 and type != 8 and size:
+				self.sections.append((addr, offset, size))
+		self.cache = {}
+
+	def string(self, address):
+		if address in self.cache:
+			return self.cache[address]
+		for addr, offset, size in self.sections:
+			if addr <= address < addr + size:
+				start = offset + address - addr
+				end = self.data.find(b'\0', start, offset + size)
+				if end < 0:
+					break
+				s = self.data[start:end].decode('ascii', 'replace')
+				self.cache[address] = s
+				return s
+		return None
+
+
+def format_message(elf, fmt, args):
+	out = []
+	pos = 0
+	argpos = 0
+
+	def take(size, code):
+		nonlocal argpos
+		if argpos + size > len(args):
+			raise IndexError
+		value, = struct.unpack_from('<' + code, args, argpos)
+		argpos += size
+		return value
+
+	for m in SPEC.finditer(fmt):
+		out.append(fmt[pos:m.start()])
+		pos = m.end()
+		flags, width, precision, length, conv = m.groups()
+		if conv == '%':
+			out.append('%')
+			continue
+		try:
+			if width == '*':
+				width = str(take(4, 'i'))
+			if precision == '*':
+				precision = str(take(4, 'i'))
+			spec = '%' + flags + (width or '')
+			if precision is not None:
+				spec += '.' + precision
+			if conv == 's':
+				tag = take(1, 'B')
+				if tag == STRING_POINTER:
+					value = elf.string(take(4, 'I'))
+					if value is None:
+						value = '<?>'
+				else:
+					end = args.find(b'\0', argpos)
+					if end < 0:
+						raise IndexError
+					value = args[argpos:end].decode('ascii', 'replace')
+					argpos = end + 1
+				out.append((spec + 's') % value)
+			elif conv in 'fFeEgGaA':
+				value = take(8, 'd')
+				out.append((spec + ('e' if conv in 'aA' else conv)) % value)
+			elif conv == 'n':
+				pass
+			else:
+				wide = length in ('ll', 'j')
+				signed = conv in 'di'
+				code = ('q' if wide else 'i') if signed else ('Q' if wide else 'I')
+				value = take(8 if wide else 4, code)
+				if conv == 'p':
+					out.append('0x%08x' % value)
+				elif conv == 'c':
+					out.append((spec + 'c') % chr(value & 0xFF))
+				else:
+					out.append((spec + ('d' if conv in 'diu' else conv)) % value)
+		except IndexError:
+			# argument did not fit into the record
+			out.append('<?>')
+			pos = len(fmt)
+			break
+	out.append(fmt[pos:])
+	return ''.join(out)
+
+
+def decode(elf, stream):
+	buf = b''
+	while True:
+		chunk = stream.read(256)
+		if not chunk:
+			break
+		buf += chunk
+		while True:
+			start = buf.find(SYNC)
+			if start < 0:
+				buf = buf[-1:]
+				break
+			if len(buf) < start + 2 + HEADER.size:
+				buf = buf[start:]
+				break
+			words, level, flags, timestamp, module, fmt = HEADER.unpack_from(buf,
+					start + 2)
+			length = words * 4
+			moduleName = elf.string(module)
+			fmtString = elf.string(fmt)
+			if (length < HEADER.size or words > MAX_RECORD_WORDS
+					or level >= len(LEVELS) or moduleName is None
+					or fmtString is None):
+				# not a record, resynchronize
+				buf = buf[start + 1:]
+				continue
+			if len(buf) < start + 2 + length:
+				buf = buf[start:]
+				break
+			args = buf[start + 2 + HEADER.size:start + 2 + length]
+			buf = buf[start + 2 + length:]
+			print('%05u [%6.6s,%s]: %s' % (timestamp, moduleName[4:],
+					LEVELS[level], format_message(elf, fmtString, args)))
+			sys.stdout.flush()
+
+
+if __name__ == '__main__':
+	if len(sys.argv) != 3:
+		print('Usage: %s <firmware.elf> <capture file or serial device>'
+				% sys.argv[0], file=sys.stderr)
+		sys.exit(2)
+	elf = Elf(sys.argv[1])
+	with open(sys.argv[2], 'rb', buffering=0) as stream:
+		decode(elf, stream)